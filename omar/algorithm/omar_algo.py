@@ -3,15 +3,10 @@
 import numpy as np
 import logging
 from utils.util import send_choose_rpc
+from cpp_code.read_and_merge import plan_rw_segment_moves
 from utils.config import MB, MIN_THRESHOLD, MAX_THRESHOLD, LESS_BALANCE_RATIO, MAX_W_SKEW, MAX_R_SKEW, MAX_BORROW_TOKENS
 
 
-def get_nested_attr(obj, attr):
-    attributes = attr.split('.')
-    for attribute in attributes:
-        obj = getattr(obj, attribute)
-    return obj
-
 def check_r_w_traffic(cpp_res, cf_logger):
 
     all_bs_traffic = cpp_res.bs_flow
@@ -71,132 +66,23 @@ def omar_schedule(cpp_res, args, rpc_method, cf_logger, f_logger, proc_executor,
         else:
             cf_logger.debug(f'Remain tokens: {remain_tokens}, but still need to schedule since skewness')
 
-    schedule_time = 0
-    choose_res = []
-    choose_read = []
-    r_index_map = {bs: 0 for bs in all_bs}
-    w_index_map = {bs: 0 for bs in all_bs}
-    r_cannot_sched_bs = set()
-    w_cannot_sched_bs = set()
-
-    def perform_transfer(io_type):
-        nonlocal schedule_time, remain_tokens
-        if io_type == 'w':
-            bs_urgent_traffic = bs_urgent_w
-            mean_bs_urgent_traffic = mean_bs_urgent_w
-            cannot_sched_bs = w_cannot_sched_bs
-            index_map = w_index_map
-            dw = w_max_ratio - 1
-        else:
-            bs_urgent_traffic = bs_urgent_r
-            mean_bs_urgent_traffic = mean_bs_urgent_r
-            cannot_sched_bs = r_cannot_sched_bs
-            index_map = r_index_map
-            dw = r_max_ratio - 1
-        assert dw > 0
-        delta = dw * mean_bs_urgent_traffic
-        max_bs_index = np.argmax(bs_urgent_traffic)
-        min_bs_index = np.argmin(bs_urgent_traffic)
-        source_bs = all_bs[max_bs_index]
-
-        index = 1
-        while source_bs in cannot_sched_bs:
-            source_bs = all_bs[np.argsort(bs_urgent_traffic)[-index]]
-            index += 1
-        target_bs = all_bs[min_bs_index]
-
-        if io_type == 'w':
-            source_items = cpp_res.sort_write_seg[source_bs]
-        else:
-            source_items = cpp_res.sort_read_seg[source_bs]
-        dev_attr = 'segment_id.device_id'
-        seg_attr = 'segment_id.segment_index'
-        if index_map[source_bs] >= len(source_items):
-            cannot_sched_bs.add(source_bs)
-            f_logger.debug(f'{io_type}: Cannot schedule source bs: {source_bs} anymore')
-            return -1
-        for i in range(index_map[source_bs], len(source_items)):
-            if index_map[source_bs] >= len(source_items):
-                cannot_sched_bs.add(source_bs)
-                f_logger.debug(f'{io_type}: Cannot schedule source bs: {source_bs} anymore')
-                return -1
-            if io_type == 'w':
-                urgent_traffic = source_items[i].traffic.write_urgent_sum
-                urgent_std = source_items[i].traffic_std.write_urgent_std
-            else:
-                urgent_traffic = source_items[i].traffic.read_urgent_sum    
-                urgent_std = source_items[i].traffic_std.read_urgent_std  
-            if urgent_traffic <= MB:
-                index_map[source_bs] = len(source_items)
-                cannot_sched_bs.add(source_bs)
-                f_logger.debug(f'{io_type}: Cannot schedule source bs: {source_bs} anymore')
-                return -1          
-            dev_id = get_nested_attr(source_items[i], dev_attr)
-            seg_id = get_nested_attr(source_items[i], seg_attr)
-            if io_type == 'w' and [dev_id, seg_id] in choose_read:
-                index_map[source_bs] = i+1
-                f_logger.debug(f'{io_type}: Skip device: {dev_id}, segment_id: {seg_id} since already scheduled in read')
-                continue
-            diff = bs_urgent_traffic[max_bs_index] - mean_bs_urgent_traffic - urgent_traffic
-            if diff > -delta:
-                choose_res.append([dev_id, seg_id, target_bs])
-                if io_type == 'r':
-                    choose_read.append([dev_id, seg_id])
-                bs_urgent_traffic[max_bs_index] -= urgent_traffic
-                bs_urgent_traffic[min_bs_index] += urgent_traffic
-                if io_type == 'r':
-                    bs_urgent_w[max_bs_index] -= source_items[i].traffic.write_urgent_sum
-                    bs_urgent_w[min_bs_index] += source_items[i].traffic.write_urgent_sum
-                else:
-                    bs_urgent_r[max_bs_index] -= source_items[i].traffic.read_urgent_sum
-                    bs_urgent_r[min_bs_index] += source_items[i].traffic.read_urgent_sum
-                f_logger.debug(f'{io_type}: Choose device: {dev_id}, segment_id: {seg_id}, source bs: {source_bs}, target bs: {target_bs}, urgent traffic: {urgent_traffic}, urgent std: {urgent_std}, i: {i}, index: {index_map[source_bs]}, after schedule urgent traffic: {(bs_urgent_traffic / MB).astype(int)}')
-                schedule_time += 1
-                remain_tokens -= 1
-                index_map[source_bs] = i+1
-                break
-        return schedule_time
-    
-    if tmp_max_urgent_r > MIN_THRESHOLD:
-        while r_max_skew > r_max_ratio or r_min_skew < r_min_ratio:
-            if remain_tokens <= -MAX_BORROW_TOKENS:
-                f_logger.debug('r: No token to schedule, break!')
-                break
-            if len(r_cannot_sched_bs) >= len(all_bs)-1:
-                break
-            if perform_transfer('r') == -1:
-                if r_max_skew > r_max_ratio and r_min_skew >= r_min_ratio:
-                    break
-            if remain_tokens <= 0:
-                r_max_ratio = 1+MAX_R_SKEW
-                r_min_ratio = 1-MAX_R_SKEW
-                w_max_ratio = 1+MAX_W_SKEW
-                w_min_ratio = 1-MAX_W_SKEW
-            r_max_skew = max(bs_urgent_r) / mean_bs_urgent_r
-            r_min_skew = min(bs_urgent_r) / mean_bs_urgent_r
-    else:
+    plan = plan_rw_segment_moves(cpp_res, w_max_ratio=w_max_ratio, w_min_ratio=w_min_ratio, r_max_ratio=r_max_ratio, r_min_ratio=r_min_ratio,
+                                 remain_tokens=remain_tokens, min_threshold=MIN_THRESHOLD, min_segment_traffic=MB,
+                                 max_w_skew=MAX_W_SKEW, max_r_skew=MAX_R_SKEW, max_borrow_tokens=MAX_BORROW_TOKENS)
+    if tmp_max_urgent_r <= MIN_THRESHOLD:
         f_logger.debug(f'No need to schedule read since max_r < {MIN_THRESHOLD}')
+    if tmp_max_urgent_w <= MIN_THRESHOLD:
+        f_logger.debug(f'No need to schedule write since max_w < {MIN_THRESHOLD}')
+    if plan.remain_tokens <= -MAX_BORROW_TOKENS:
+        f_logger.debug('No token to schedule, break!')
+
+    choose_res = []
+    for move in plan.moves:
+        dev_id, seg_id = move.segment_id.device_id, move.segment_id.segment_index
+        choose_res.append([dev_id, seg_id, move.target_bs])
+        f_logger.debug(f'{"r" if move.read else "w"}: Choose device: {dev_id}, segment_id: {seg_id}, source bs: {move.source_bs}, target bs: {move.target_bs}, urgent traffic: {move.urgent_traffic}')
 
-    if tmp_max_urgent_w > MIN_THRESHOLD:
-        while w_max_skew > w_max_ratio or w_min_skew < w_min_ratio:
-            if remain_tokens <= -MAX_BORROW_TOKENS:
-                f_logger.debug('w: No token to schedule, break!')
-                break
-            if len(w_cannot_sched_bs) >= len(all_bs)-1:
-                break
-            if perform_transfer('w') == -1:
-                if w_max_skew > w_max_ratio and w_min_skew >= w_min_ratio:
-                    break
-            if remain_tokens <= 0:
-                w_max_ratio = 1+MAX_W_SKEW
-                w_min_ratio = 1-MAX_W_SKEW
-            w_max_skew = max(bs_urgent_w) / mean_bs_urgent_w
-            w_min_skew = min(bs_urgent_w) / mean_bs_urgent_w
-    else:
-        f_logger.debug(f'No need to schedule read since max_w < {MIN_THRESHOLD}')
-    
     if f_logger.isEnabledFor(logging.DEBUG):
-        f_logger.debug(f'After schedule, w_max_skew: {w_max_skew:.2f}, w_min_skew: {w_min_skew:.2f}, r_max_skew: {r_max_skew:.2f}, r_min_skew: {r_min_skew:.2f}')
+        f_logger.debug(f'After schedule, w_max_skew: {plan.w_max_skew:.2f}, w_min_skew: {plan.w_min_skew:.2f}, r_max_skew: {plan.r_max_skew:.2f}, r_min_skew: {plan.r_min_skew:.2f}')
     send_choose_rpc(choose_res, proc_executor, rpc_method, f_logger)
-    return schedule_time
-    
+    return len(plan.moves)
@@ -0,0 +1,386 @@
+// Writes a segment stat table in the blockmaster's shm layout (ShmStatFileHeader
+// followed by SegmentShmIoStat records) to any path, so read_segment_iostats_mmap,
+// the merge_* functions and the planners can run without a live blockmaster.
+//
+//   synthetic: ./gen_seg_iostats --path /dev/shm/seg_iostats --bs 32 --devices 10000 --segments 16 --dist zipf --skew 1.1
+//   trace:     ./gen_seg_iostats --path /dev/shm/seg_iostats --bs 8 --devices 200 --trace ../data/fig3/vd1.csv --trace ../data/fig3/vd2.csv --ticks 600 --interval-ms 1000
+//   one table per blockmaster: run one per --path with disjoint --device-base
+//   ranges, or overlapping ones with a higher --load-version for segments that
+//   moved between blockmasters
+//
+// Each tick rewrites --update-ratio of the records in place, like the blockmaster.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "read_and_merge.h"
+
+#define GEN_STAT_MAGIC 0x3154415453474553ULL
+#define GEN_BS_PORT 8000
+#define GEN_AF_INET 2
+#define GEN_IO_SIZE (16 * 1024)
+#define GEN_MB (1024 * 1024)
+// trailing windows, in trace seconds, of the instant and longterm counters
+#define GEN_INSTANT_WINDOW 10
+#define GEN_LONGTERM_WINDOW 60
+// 2^40 records is far past any table, and keeps the mapped size from overflowing
+#define GEN_MAX_CAPACITY_BITS 40
+
+struct GenOptions {
+    std::string path;
+    size_t bsNum;
+    size_t deviceNum;
+    size_t segmentsPerDevice;
+    int capacityBits;
+    std::string dist;
+    double skew;
+    double segmentMb;
+    double readRatio;
+    long ticks;
+    int intervalMs;
+    double updateRatio;
+    double moveRatio;
+    uint64_t seed;
+    uint64_t deviceBase;
+    uint64_t loadVersion;
+    std::vector<std::string> traces;
+    size_t traceStep;
+    GenOptions() : bsNum(16), deviceNum(1000), segmentsPerDevice(16), capacityBits(-1), dist("uniform"), skew(1.0), segmentMb(4), readRatio(0.3), ticks(1), intervalMs(1000), updateRatio(1.0), moveRatio(0), seed(1), deviceBase(1), loadVersion(1), traceStep(3600) {}
+};
+
+// Per-second read/write MB of one VD, from the data/fig3/vd*.csv layout
+// (timestamp_sec,type,traffic(MB)), with prefix sums for O(1) window stats.
+struct VdTrace {
+    std::vector<double> read;
+    std::vector<double> write;
+    std::vector<double> readSum, readSq, writeSum, writeSq;
+
+    size_t Len() const { return read.size(); }
+    static void Window(const std::vector<double>& sum, const std::vector<double>& sq, size_t end, size_t window, double& mean, double& std){
+        size_t begin = end + 1 >= window ? end + 1 - window : 0;
+        double n = end + 1 - begin;
+        double s = sum[end + 1] - sum[begin];
+        mean = s / n;
+        std = std::sqrt(std::max(0.0, (sq[end + 1] - sq[begin]) / n - mean * mean));
+    }
+};
+
+void usage(){
+    std::cerr << "usage: gen_seg_iostats --path FILE [--bs N] [--devices N] [--segments N] [--capacity-bits N]\n"
+              << "                       [--dist uniform|zipf|lognormal] [--skew S] [--segment-mb MB] [--read-ratio R]\n"
+              << "                       [--ticks N, 0 runs forever] [--interval-ms MS] [--update-ratio R] [--move-ratio R]\n"
+              << "                       [--seed N] [--device-base ID] [--load-version N] [--trace vd.csv]... [--trace-step SEC]" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+GenOptions parse_options(int argc, char** argv){
+    GenOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string key = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+        }
+        std::string value = argv[++i];
+        if (key == "--path") opt.path = value;
+        else if (key == "--bs") opt.bsNum = std::stoul(value);
+        else if (key == "--devices") opt.deviceNum = std::stoul(value);
+        else if (key == "--segments") opt.segmentsPerDevice = std::stoul(value);
+        else if (key == "--capacity-bits") opt.capacityBits = std::stoi(value);
+        else if (key == "--dist") opt.dist = value;
+        else if (key == "--skew") opt.skew = std::stod(value);
+        else if (key == "--segment-mb") opt.segmentMb = std::stod(value);
+        else if (key == "--read-ratio") opt.readRatio = std::stod(value);
+        else if (key == "--ticks") opt.ticks = std::stol(value);
+        else if (key == "--interval-ms") opt.intervalMs = std::stoi(value);
+        else if (key == "--update-ratio") opt.updateRatio = std::stod(value);
+        else if (key == "--move-ratio") opt.moveRatio = std::stod(value);
+        else if (key == "--seed") opt.seed = std::stoull(value);
+        else if (key == "--device-base") opt.deviceBase = std::stoull(value);
+        else if (key == "--load-version") opt.loadVersion = std::stoull(value);
+        else if (key == "--trace") opt.traces.push_back(value);
+        else if (key == "--trace-step") opt.traceStep = std::stoul(value);
+        else usage();
+    }
+    if (opt.path.empty() || opt.bsNum == 0 || opt.deviceNum == 0 || opt.segmentsPerDevice == 0) {
+        usage();
+    }
+    if (opt.capacityBits < -1 || opt.capacityBits > GEN_MAX_CAPACITY_BITS) {
+        std::cerr << "--capacity-bits must be between 0 and " << GEN_MAX_CAPACITY_BITS << ": " << opt.capacityBits << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (opt.dist != "uniform" && opt.dist != "zipf" && opt.dist != "lognormal") {
+        std::cerr << "Unknown distribution: " << opt.dist << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return opt;
+}
+
+VdTrace load_vd_trace(const std::string& path){
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Failed to open trace: " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector<std::pair<int64_t, std::pair<char, double>>> rows;
+    std::string line;
+    std::getline(in, line);
+    int64_t first = std::numeric_limits<int64_t>::max();
+    while (std::getline(in, line)) {
+        std::stringstream ss(line);
+        std::string ts, type, traffic;
+        if (!std::getline(ss, ts, ',') || !std::getline(ss, type, ',') || !std::getline(ss, traffic, ',') || type.empty()) {
+            continue;
+        }
+        int64_t t = std::stoll(ts);
+        first = std::min(first, t);
+        rows.emplace_back(t, std::make_pair(type[0], std::stod(traffic)));
+    }
+    VdTrace trace;
+    for (const auto& row : rows) {
+        size_t t = row.first - first;
+        if (t >= trace.read.size()) {
+            trace.read.resize(t + 1, 0);
+            trace.write.resize(t + 1, 0);
+        }
+        (row.second.first == 'R' ? trace.read : trace.write)[t] += row.second.second;
+    }
+    if (trace.read.empty()) {
+        std::cerr << "Empty trace: " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    trace.readSum.assign(1, 0);
+    trace.readSq.assign(1, 0);
+    trace.writeSum.assign(1, 0);
+    trace.writeSq.assign(1, 0);
+    for (size_t t = 0; t < trace.Len(); ++t) {
+        trace.readSum.push_back(trace.readSum.back() + trace.read[t]);
+        trace.readSq.push_back(trace.readSq.back() + trace.read[t] * trace.read[t]);
+        trace.writeSum.push_back(trace.writeSum.back() + trace.write[t]);
+        trace.writeSq.push_back(trace.writeSq.back() + trace.write[t] * trace.write[t]);
+    }
+    return trace;
+}
+
+// ip 10.x.y.z and the port stored byte-swapped, as bs_ip_transform decodes them
+uint64_t gen_bs_id(size_t bs){
+    uint64_t ip = 10 | ((bs >> 16) & 0xFF) << 8 | ((bs >> 8) & 0xFF) << 16 | ((bs & 0xFF) + 1) << 24;
+    uint64_t port = ((GEN_BS_PORT & 0xFF) << 8) | (GEN_BS_PORT >> 8);
+    return ip << 32 | port << 16 | GEN_AF_INET;
+}
+
+// relative traffic of every device, mean 1
+std::vector<double> device_weights(const GenOptions& opt, std::mt19937_64& rng){
+    std::vector<double> weights(opt.deviceNum, 1.0);
+    if (opt.dist == "zipf") {
+        std::vector<size_t> rank(opt.deviceNum);
+        for (size_t d = 0; d < rank.size(); ++d) {
+            rank[d] = d + 1;
+        }
+        std::shuffle(rank.begin(), rank.end(), rng);
+        for (size_t d = 0; d < weights.size(); ++d) {
+            weights[d] = 1 / std::pow(static_cast<double>(rank[d]), opt.skew);
+        }
+    } else if (opt.dist == "lognormal") {
+        std::lognormal_distribution<double> lognormal(0, opt.skew);
+        for (auto& w : weights) {
+            w = lognormal(rng);
+        }
+    }
+    double sum = 0;
+    for (double w : weights) {
+        sum += w;
+    }
+    for (auto& w : weights) {
+        w *= weights.size() / sum;
+    }
+    return weights;
+}
+
+// Fills the counters of one record from its urgent/instant/longterm read and write MB.
+void fill_record(SegmentShmIoStat& e, const double mb[3][2], const double std_mb[3][2]){
+    LatencyStat* latency[3] = {&e.urgent_latency, &e.instant_latency, &e.longterm_latency};
+    IopsStat* iops[3] = {&e.urgent_iops, &e.instant_iops, &e.longterm_iops};
+    FlowStat* flow[3] = {&e.urgent_flow, &e.instant_flow, &e.longterm_flow};
+    FlowStdStat* flow_std[3] = {&e.urgent_flow_std, &e.instant_flow_std, &e.longterm_flow_std};
+    for (int w = 0; w < 3; ++w) {
+        flow[w]->readBytes = static_cast<int64_t>(mb[w][0] * GEN_MB);
+        flow[w]->writeBytes = static_cast<int64_t>(mb[w][1] * GEN_MB);
+        flow_std[w]->readStd = std_mb[w][0] * GEN_MB;
+        flow_std[w]->writeStd = std_mb[w][1] * GEN_MB;
+        iops[w]->readIops = flow[w]->readBytes / GEN_IO_SIZE;
+        iops[w]->writeIops = flow[w]->writeBytes / GEN_IO_SIZE;
+        // synthetic queueing: latency (us) grows with the segment's own load
+        latency[w]->readLatency = 200 + iops[w]->readIops / 8;
+        latency[w]->writeLatency = 100 + iops[w]->writeIops / 8;
+    }
+}
+
+class StatFileWriter {
+public:
+    StatFileWriter(const std::string& path, size_t records, int capacityBits) : mPath(path) {
+        if (capacityBits < 0) {
+            capacityBits = 0;
+            while ((static_cast<size_t>(1) << capacityBits) < records + 1) {
+                capacityBits++;
+            }
+        }
+        mCapacity = static_cast<size_t>(1) << capacityBits;
+        // one zeroed slot past the last record terminates the reader's scan
+        if (records >= mCapacity) {
+            std::cerr << "capacityBits " << capacityBits << " too small for " << records << " records" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        mSize = sizeof(ShmStatFileHeader) + mCapacity * sizeof(SegmentShmIoStat);
+        mFd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (mFd == -1 || ftruncate(mFd, mSize) == -1) {
+            std::cerr << "Failed to create file: " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        void* mapped = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "Failed to mmap file: " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        mHeader = static_cast<ShmStatFileHeader*>(mapped);
+        mRecords = reinterpret_cast<SegmentShmIoStat*>(static_cast<char*>(mapped) + sizeof(ShmStatFileHeader));
+        memset(mHeader, 0, sizeof(ShmStatFileHeader));
+        mHeader->recordSize = sizeof(SegmentShmIoStat);
+        mHeader->recordSizeBits = 0;
+        while ((static_cast<size_t>(1) << mHeader->recordSizeBits) < sizeof(SegmentShmIoStat)) {
+            mHeader->recordSizeBits++;
+        }
+        mHeader->capacityBits = capacityBits;
+    }
+    ~StatFileWriter(){
+        munmap(mHeader, mSize);
+        close(mFd);
+    }
+
+    void Write(size_t i, const SegmentShmIoStat& e){
+        memcpy(&mRecords[i], &e, sizeof(e));
+    }
+    // the magic goes in last: the reader treats 0 as "not initialized yet"
+    void Publish(){
+        std::atomic_thread_fence(std::memory_order_release);
+        mHeader->magic = GEN_STAT_MAGIC;
+    }
+    size_t Capacity() const { return mCapacity; }
+
+private:
+    std::string mPath;
+    int mFd;
+    size_t mSize;
+    size_t mCapacity;
+    ShmStatFileHeader* mHeader;
+    SegmentShmIoStat* mRecords;
+};
+
+int main(int argc, char** argv){
+    GenOptions opt = parse_options(argc, argv);
+    std::mt19937_64 rng(opt.seed);
+    std::vector<VdTrace> traces;
+    for (const auto& path : opt.traces) {
+        traces.emplace_back(load_vd_trace(path));
+    }
+
+    size_t records = opt.deviceNum * opt.segmentsPerDevice;
+    StatFileWriter writer(opt.path, records, opt.capacityBits);
+    std::vector<uint64_t> bsIds(opt.bsNum);
+    for (size_t bs = 0; bs < opt.bsNum; ++bs) {
+        bsIds[bs] = gen_bs_id(bs);
+    }
+    std::vector<double> weights = device_weights(opt, rng);
+    // share of its device's traffic each segment carries
+    std::vector<double> shares(records);
+    std::exponential_distribution<double> exponential(1.0);
+    for (size_t d = 0; d < opt.deviceNum; ++d) {
+        double sum = 0;
+        for (size_t s = 0; s < opt.segmentsPerDevice; ++s) {
+            shares[d * opt.segmentsPerDevice + s] = exponential(rng);
+            sum += shares[d * opt.segmentsPerDevice + s];
+        }
+        for (size_t s = 0; s < opt.segmentsPerDevice; ++s) {
+            shares[d * opt.segmentsPerDevice + s] /= sum;
+        }
+    }
+
+    std::vector<SegmentShmIoStat> table(records);
+    std::uniform_int_distribution<size_t> pick_bs(0, opt.bsNum - 1);
+    for (size_t i = 0; i < records; ++i) {
+        SegmentShmIoStat& e = table[i];
+        memset(static_cast<void*>(&e), 0, sizeof(e));
+        e.segmentId.device_id = i / opt.segmentsPerDevice + opt.deviceBase;
+        e.segmentId.segmentIdx = i % opt.segmentsPerDevice;
+        e.loadVersion = opt.loadVersion;
+        e.bsId = bsIds[pick_bs(rng)];
+    }
+
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::lognormal_distribution<double> noise(0, 0.3);
+    for (long tick = 0; opt.ticks <= 0 || tick < opt.ticks; ++tick) {
+        auto start = std::chrono::steady_clock::now();
+        size_t updated = 0;
+        for (size_t i = 0; i < records; ++i) {
+            if (tick > 0 && uniform(rng) >= opt.updateRatio) {
+                continue;
+            }
+            SegmentShmIoStat& e = table[i];
+            size_t d = i / opt.segmentsPerDevice;
+            double mb[3][2], std_mb[3][2];
+            if (!traces.empty()) {
+                // device d replays trace d % T, shifted by traceStep per reuse of the same trace
+                const VdTrace& trace = traces[d % traces.size()];
+                size_t t = (d / traces.size() * opt.traceStep + tick) % trace.Len();
+                const size_t windows[3] = {1, GEN_INSTANT_WINDOW, GEN_LONGTERM_WINDOW};
+                for (int w = 0; w < 3; ++w) {
+                    VdTrace::Window(trace.readSum, trace.readSq, t, windows[w], mb[w][0], std_mb[w][0]);
+                    VdTrace::Window(trace.writeSum, trace.writeSq, t, windows[w], mb[w][1], std_mb[w][1]);
+                    for (int dir = 0; dir < 2; ++dir) {
+                        mb[w][dir] *= shares[i];
+                        std_mb[w][dir] *= shares[i];
+                    }
+                }
+                // a single second has no spread: use the instant window's
+                std_mb[0][0] = std_mb[1][0];
+                std_mb[0][1] = std_mb[1][1];
+            } else {
+                double urgent = opt.segmentMb * opt.segmentsPerDevice * weights[d] * shares[i] * noise(rng);
+                double current[2] = {urgent * opt.readRatio, urgent * (1 - opt.readRatio)};
+                double last[2] = {e.instant_flow.readBytes / static_cast<double>(GEN_MB), e.instant_flow.writeBytes / static_cast<double>(GEN_MB)};
+                double longterm[2] = {e.longterm_flow.readBytes / static_cast<double>(GEN_MB), e.longterm_flow.writeBytes / static_cast<double>(GEN_MB)};
+                for (int dir = 0; dir < 2; ++dir) {
+                    // instant/longterm follow the urgent counter as moving averages
+                    mb[0][dir] = current[dir];
+                    mb[1][dir] = tick == 0 ? current[dir] : 0.8 * last[dir] + 0.2 * current[dir];
+                    mb[2][dir] = tick == 0 ? current[dir] : 0.95 * longterm[dir] + 0.05 * current[dir];
+                    std_mb[0][dir] = std::fabs(mb[0][dir] - mb[1][dir]);
+                    std_mb[1][dir] = std::fabs(mb[1][dir] - mb[2][dir]);
+                    std_mb[2][dir] = 0.3 * mb[2][dir];
+                }
+            }
+            fill_record(e, mb, std_mb);
+            if (tick > 0 && uniform(rng) < opt.moveRatio) {
+                e.bsId = bsIds[pick_bs(rng)];
+                e.loadVersion++;
+            }
+            writer.Write(i, e);
+            updated++;
+        }
+        if (tick == 0) {
+            writer.Publish();
+        }
+        auto end = std::chrono::steady_clock::now();
+        std::cout << "tick " << tick << ": wrote " << updated << "/" << records << " records to " << opt.path << " (capacity " << writer.Capacity() << ") in " << std::chrono::duration<double>(end - start).count() << " s" << std::endl;
+        if (opt.ticks <= 0 || tick + 1 < opt.ticks) {
+            std::this_thread::sleep_until(start + std::chrono::milliseconds(opt.intervalMs));
+        }
+    }
+    return 0;
+}
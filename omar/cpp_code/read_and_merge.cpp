@@ -9,27 +9,42 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <dirent.h>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <type_traits>
+#include <limits>
+#include <unordered_set>
+#include <stdexcept>
 #include "read_and_merge.h"
 
 
 double calculate_average_urgent_std(const std::vector<SegmentStdStat>& segment_traffic_std, UrgentStdType type) {
+    // pick the field once rather than per element, keeping the summation order
     double sum = 0.0;
-    for (const auto& stat : segment_traffic_std) {
-        if (type == UrgentStdType::Write){
+    if (type == UrgentStdType::Write){
+        for (const auto& stat : segment_traffic_std) {
             sum += stat.write_urgent_std;
-        } 
-        else if (type == UrgentStdType::Read){
+        }
+    }
+    else if (type == UrgentStdType::Read){
+        for (const auto& stat : segment_traffic_std) {
             sum += stat.read_urgent_std;
-        } 
-        else if (type == UrgentStdType::All){
-            sum += stat.write_urgent_std + stat.read_urgent_std;
         }
-        else{
-            std::cerr << "Invalid UrgentStdType: " << static_cast<int>(type) << std::endl;
-            exit(EXIT_FAILURE);
+    }
+    else if (type == UrgentStdType::All){
+        for (const auto& stat : segment_traffic_std) {
+            sum += stat.write_urgent_std + stat.read_urgent_std;
         }
     }
+    else{
+        std::cerr << "Invalid UrgentStdType: " << static_cast<int>(type) << std::endl;
+        exit(EXIT_FAILURE);
+    }
     return segment_traffic_std.empty() ? 0.0 : sum / segment_traffic_std.size();
 }
 
@@ -53,6 +68,21 @@ void AddValues(T& target, uint64_t read_urgent, uint64_t write_urgent, uint64_t
     target.write_longterm_sum += write_longterm;
 }
 
+template <typename T>
+void AddValues(T& target, const T& values) {
+    AddValues(target, values.read_urgent_sum, values.write_urgent_sum, values.read_instant_sum, values.write_instant_sum, values.read_longterm_sum, values.write_longterm_sum);
+}
+
+template <typename T>
+void SubValues(T& target, const T& values) {
+    target.read_urgent_sum -= values.read_urgent_sum;
+    target.write_urgent_sum -= values.write_urgent_sum;
+    target.read_instant_sum -= values.read_instant_sum;
+    target.write_instant_sum -= values.write_instant_sum;
+    target.read_longterm_sum -= values.read_longterm_sum;
+    target.write_longterm_sum -= values.write_longterm_sum;
+}
+
 bool operator==(const DeviceSummary& lhs, const DeviceSummary& rhs) {
     return lhs.device_id == rhs.device_id &&
            lhs.segment_index == rhs.segment_index &&
@@ -64,47 +94,213 @@ bool operator==(const DeviceSummary& lhs, const DeviceSummary& rhs) {
            lhs.traffic.write_longterm_sum == rhs.traffic.write_longterm_sum;
 }
 
-std::vector<SegmentShmIoStat> read_segment_iostats_mmap(const std::string& path) {
-    int fd = open(path.c_str(), O_RDONLY);
-    if (fd == -1) {
-        std::cerr << "Failed to open file: " << path << std::endl;
-        return {};
+void ShmStatReader::Unmap(){
+    if (mMapped != nullptr) {
+        munmap(mMapped, mMapSize);
+        mMapped = nullptr;
+        mMapSize = 0;
+    }
+    if (mFd != -1) {
+        close(mFd);
+        mFd = -1;
     }
+    mMagic = 0;
+}
 
+bool ShmStatReader::Remap(){
+    Unmap();
+    mFd = open(mPath.c_str(), O_RDONLY);
+    if (mFd == -1) {
+        std::cerr << "Failed to open file: " << mPath << std::endl;
+        return false;
+    }
     struct stat st;
-    if (fstat(fd, &st) == -1) {
-        close(fd);
-        std::cerr << "Failed to fstat file: " << path << std::endl;
-        return {};
+    if (fstat(mFd, &st) == -1) {
+        Unmap();
+        std::cerr << "Failed to fstat file: " << mPath << std::endl;
+        return false;
+    }
+    if (static_cast<size_t>(st.st_size) < sizeof(ShmStatFileHeader)) {
+        Unmap();
+        std::cerr << "Stat file too small: " << mPath << ", size: " << st.st_size << std::endl;
+        return false;
     }
-    // std::cout << "File size: " << st.st_size << std::endl;
-    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // MAP_SHARED so the long-lived mapping keeps following the blockmaster's writes
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, mFd, 0);
     if (mapped == MAP_FAILED) {
-        close(fd);
-        std::cerr << "Failed to mmap file: " << path << std::endl;
-        return {};
+        Unmap();
+        std::cerr << "Failed to mmap file: " << mPath << std::endl;
+        return false;
     }
+    mMapped = mapped;
+    mMapSize = st.st_size;
+    mDev = st.st_dev;
+    mIno = st.st_ino;
+    mMagic = static_cast<const ShmStatFileHeader*>(mMapped)->magic;
+    return true;
+}
 
-    ShmStatFileHeader* header = static_cast<ShmStatFileHeader*>(mapped);
-    size_t record_size = header->recordSize;
-    size_t capacity = 1 << header->capacityBits;
-    const SegmentShmIoStat* data_start = reinterpret_cast<const SegmentShmIoStat*>(static_cast<char*>(mapped) + sizeof(*header));
+bool ShmStatReader::Read(std::vector<SegmentShmIoStat>& results){
+    std::lock_guard<std::mutex> lock(mMutex);
+    results.clear();
+    struct stat st;
+    if (stat(mPath.c_str(), &st) == -1) {
+        Unmap();
+        std::cerr << "Failed to stat file: " << mPath << std::endl;
+        return false;
+    }
+    size_t file_size = st.st_size;
+    if (file_size < sizeof(ShmStatFileHeader)) {
+        Unmap();
+        std::cerr << "Stat file too small: " << mPath << ", size: " << file_size << std::endl;
+        return false;
+    }
+    // a file truncated in place keeps its inode; pages of the old mapping
+    // past the new end raise SIGBUS, so any size change remaps
+    bool replaced = st.st_dev != mDev || st.st_ino != mIno;
+    if (mMapped == nullptr || replaced || file_size != mMapSize) {
+        if (!Remap()) {
+            return false;
+        }
+    }
 
-    std::vector<SegmentShmIoStat> results;
-    results.reserve(capacity);
+    const ShmStatFileHeader* header = static_cast<const ShmStatFileHeader*>(mMapped);
+    if (header->magic == 0 || header->magic != mMagic) {
+        // not initialized yet, or re-initialized under us: pick it up next tick
+        std::cerr << "Invalid stat file magic: " << header->magic << ", path: " << mPath << std::endl;
+        Unmap();
+        return false;
+    }
+    if (header->capacityBits >= sizeof(size_t) * 8) {
+        // corrupt or half-initialized header: shifting by it is undefined
+        std::cerr << "Invalid stat file capacityBits: " << static_cast<int>(header->capacityBits) << ", path: " << mPath << std::endl;
+        Unmap();
+        return false;
+    }
+    if (header->recordSize != sizeof(SegmentShmIoStat)) {
+        // written with another record layout: the stride below would misread it
+        std::cerr << "Invalid stat file recordSize: " << static_cast<int>(header->recordSize) << ", expected: " << sizeof(SegmentShmIoStat) << ", path: " << mPath << std::endl;
+        Unmap();
+        return false;
+    }
+    size_t capacity = static_cast<size_t>(1) << header->capacityBits;
+    size_t mapped_capacity = (std::min(mMapSize, file_size) - sizeof(ShmStatFileHeader)) / sizeof(SegmentShmIoStat);
+    if (capacity > mapped_capacity) {
+        capacity = mapped_capacity;
+    }
+    const SegmentShmIoStat* data_start = reinterpret_cast<const SegmentShmIoStat*>(static_cast<const char*>(mMapped) + sizeof(ShmStatFileHeader));
+
+    results.reserve(mLastRecordNum);
+    SegmentShmIoStat copy;
+    uint64_t torn = 0;
     for (size_t i = 0; i < capacity; ++i) {
         const SegmentShmIoStat& e = data_start[i];
-        if (e.segmentId.device_id > 0) {
-            results.emplace_back(e);
-        } else {
+        if (e.segmentId.device_id == 0) {
             break;
         }
+        // The blockmaster updates records in place: accept a copy only once it
+        // matches the live record again and its loadVersion did not move. This
+        // detects records changing during the copy; it is best-effort without
+        // a writer-side sequence counter, a writer paused mid-update between
+        // both reads still gets through.
+        const volatile uint64_t& live_version = e.loadVersion;
+        bool stable = false;
+        for (int retry = 0; retry < SHM_TORN_READ_RETRY && !stable; ++retry) {
+            uint64_t version = live_version;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            memcpy(&copy, &e, sizeof(copy));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            stable = memcmp(&copy, &e, sizeof(copy)) == 0 && copy.loadVersion == version && live_version == version;
+        }
+        if (!stable) {
+            mTornRecords++;
+            torn++;
+            continue;
+        }
+        results.emplace_back(copy);
+    }
+    mLastRecordNum = results.size();
+    count_merge(mergeCounters.tableReads);
+    count_merge(mergeCounters.records, results.size());
+    count_merge(mergeCounters.bytesScanned, (results.size() + torn) * sizeof(SegmentShmIoStat));
+    count_merge(mergeCounters.tornRecords, torn);
+    return true;
+}
+
+std::shared_ptr<ShmStatReader> shm_stat_reader(const std::string& path){
+    std::lock_guard<std::mutex> lock(statReadersMutex);
+    auto& reader = statReaders[path];
+    if (!reader) {
+        reader = std::make_shared<ShmStatReader>(path);
+    }
+    return reader;
+}
+
+std::vector<SegmentShmIoStat> read_segment_iostats_mmap(const std::string& path) {
+    std::vector<SegmentShmIoStat> results;
+    shm_stat_reader(path)->Read(results);
+    return results;
+}
+
+std::vector<SegmentShmIoStat> read_segment_iostats(const std::vector<std::string>& paths) {
+    if (paths.size() == 1) {
+        return read_segment_iostats_mmap(paths[0]);
     }
-    munmap(mapped, st.st_size);
-    close(fd);
+    // a table that fails to read leaves its segments out, as a single one does
+    std::vector<std::vector<SegmentShmIoStat>> tables(paths.size());
+    parallel_for(paths.size(), paths.size(), [&](size_t, size_t begin, size_t end){
+        for (size_t t = begin; t < end; ++t) {
+            shm_stat_reader(paths[t])->Read(tables[t]);
+        }
+    });
+    std::vector<SegmentShmIoStat> results;
+    count_merge(mergeCounters.duplicateRecords, merge_segment_tables(tables, results));
     return results;
 }
 
+size_t merge_segment_tables(const std::vector<std::vector<SegmentShmIoStat>>& tables, std::vector<SegmentShmIoStat>& merged){
+    size_t total = 0;
+    for (const auto& table : tables) {
+        total += table.size();
+    }
+    // power-of-two sized and at most half full; the key is kept in the slot so
+    // probing never touches the records
+    struct Slot {
+        uint64_t device_id;
+        uint32_t segmentIdx;
+        uint32_t record;  // EMPTY_RECORD when unused
+    };
+    const uint32_t EMPTY_RECORD = 0xffffffff;
+    size_t capacity = 16;
+    while (capacity < total * 2) {
+        capacity <<= 1;
+    }
+    size_t mask = capacity - 1;
+    Slot empty = {0, 0, EMPTY_RECORD};
+    std::vector<Slot> slots(capacity, empty);
+    merged.clear();
+    merged.reserve(total);
+    for (const auto& table : tables) {
+        for (const SegmentShmIoStat& e : table) {
+            const SegmentId& id = e.segmentId;
+            uint64_t h = (id.device_id ^ (static_cast<uint64_t>(id.segmentIdx) << 48)) * 0x9e3779b97f4a7c15ULL;
+            size_t i = static_cast<size_t>(h ^ (h >> 29)) & mask;
+            while (slots[i].record != EMPTY_RECORD && (slots[i].device_id != id.device_id || slots[i].segmentIdx != id.segmentIdx)) {
+                i = (i + 1) & mask;
+            }
+            if (slots[i].record == EMPTY_RECORD) {
+                Slot slot = {id.device_id, id.segmentIdx, static_cast<uint32_t>(merged.size())};
+                slots[i] = slot;
+                merged.push_back(e);
+            }
+            else if (e.loadVersion > merged[slots[i].record].loadVersion) {
+                merged[slots[i].record] = e;
+            }
+        }
+    }
+    return total - merged.size();
+}
+
 std::string bs_ip_transform(uint64_t bsId){
     uint32_t front_32_bits = bsId >> 32;
     std::stringstream ip_ss;
@@ -122,717 +318,3139 @@ std::string bs_ip_transform(uint64_t bsId){
 }
 
 std::string bs_ip_transform_cache(uint64_t bsId){
-    auto it = bsIdToIp.find(bsId);
-    if (it != bsIdToIp.end()){
+    auto cache = std::atomic_load(&bsIdToIp);
+    auto it = cache->find(bsId);
+    if (it != cache->end()){
+        count_merge(mergeCounters.bsIpHits);
         return it->second;
     }
+    count_merge(mergeCounters.bsIpMisses);
     std::string ip_port = bs_ip_transform(bsId);
-    bsIdToIp[bsId] = ip_port;
+    std::lock_guard<std::mutex> lock(bsIdToIpMutex);
+    cache = std::atomic_load(&bsIdToIp);
+    if (cache->count(bsId) == 0){
+        auto next = std::make_shared<std::map<uint64_t, std::string>>(*cache);
+        next->emplace(bsId, ip_port);
+        std::atomic_store(&bsIdToIp, std::shared_ptr<const std::map<uint64_t, std::string>>(std::move(next)));
+    }
     return ip_port;
 }
 
-extern "C" ReturnSegStat merge_bs_segment(int sort_flag) {
-    auto iostats = read_segment_iostats_mmap("/var/run/pangu_blockmaster_seg_iostats");
-    std::map<std::string, BsSumState> bs_flow;
-    BsSegTrafficMap bssegmap;
-    for (const auto& e : iostats) {
-        std::string bs_ip = bs_ip_transform_cache(e.bsId);
-        auto bsIt = bs_flow.find(bs_ip);
-        if (bsIt == bs_flow.end()) {
-            bs_flow[bs_ip] = BsSumState();
-            bsIt = bs_flow.find(bs_ip);
-        }
-        bsIt->second.AddResult(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        auto& segVec = bssegmap[bs_ip];
-        auto seg_traffic_std = SegmentStdStat(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
-        auto seg_traffic = SumTraffic(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes);
-        auto seg_latency = SumLatency(e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency);
-        auto seg_iops = SumIops(e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        auto segsum = SegmentSummary(e.segmentId, seg_traffic, seg_latency, seg_iops, seg_traffic_std);
-        segVec.emplace_back(segsum);
-    }
-    int16_t maxblastradius = sortBsSegMap(bssegmap, "write", sort_flag);
-    double avgblastradius = static_cast<double>(bssegmap.size()) / maxblastradius;
-    ReturnSegStat result;
-    result.bs_flow = bs_flow;
-    result.sortSegMap = bssegmap;
-    BlastRadius blastRadius;
-    blastRadius.avgblastradius = avgblastradius;
-    blastRadius.maxblastradius = maxblastradius;
-    result.blastRadius = blastRadius;
-    return result;
+SegmentSummary make_segment_summary(const SegmentShmIoStat& e){
+    auto seg_traffic_std = SegmentStdStat(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
+    auto seg_traffic = SumTraffic(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes);
+    auto seg_latency = SumLatency(e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency);
+    auto seg_iops = SumIops(e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
+    return SegmentSummary(e.segmentId, seg_traffic, seg_latency, seg_iops, seg_traffic_std);
 }
 
-extern "C" std::map<std::string, BsSumState> bs_stat() {
-    auto iostats = read_segment_iostats_mmap("/var/run/pangu_blockmaster_seg_iostats");
-    std::map<std::string, BsSumState> bs_flow;
-    for (const auto& e : iostats) {
-        std::string bs_ip = bs_ip_transform_cache(e.bsId);
-        auto bsIt = bs_flow.find(bs_ip);
-        if (bsIt == bs_flow.end()) {
-            bs_flow[bs_ip] = BsSumState();
-            bsIt = bs_flow.find(bs_ip);
-        }
-        bsIt->second.AddResult(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-    }
-    return bs_flow;
-}
-
-extern "C" ReturnDevStat merge_bs_device(int sort_flag) {
-    auto iostats = read_segment_iostats_mmap("/var/run/pangu_blockmaster_seg_iostats");
-    std::map<std::string, BsSumState> bs_flow;
-    BsDeviceTrafficMap bsdevicemap;
-    for (const auto& e : iostats) {
-        std::string bs_ip = bs_ip_transform_cache(e.bsId);
-        auto bsIt = bs_flow.find(bs_ip);
-        if (bsIt == bs_flow.end()) {
-            bs_flow[bs_ip] = BsSumState();
-            bsIt = bs_flow.find(bs_ip);
-        }
-        bsIt->second.AddResult(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        auto& devMap = bsdevicemap[bs_ip];
-        auto devIt = devMap.find(e.segmentId.device_id);
-        if (devIt == devMap.end()) {
-            devMap[e.segmentId.device_id] = DeviceSummary(e.segmentId.device_id);
-            devIt = devMap.find(e.segmentId.device_id);
-        }
-        SegmentStdStat s(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
-        devIt->second.AddResult(e.segmentId.segmentIdx, s, e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-    }
-    std::map<std::string, std::vector<DeviceSummary>> sortedBsMap;
-    int bs_device_num = 0;
-    int16_t maxblastradius = sortBsDevMap(bsdevicemap, sortedBsMap, bs_device_num, "write", sort_flag);
-    double avgblastradius = static_cast<double>(bs_device_num) / bsdevicemap.size();
-    ReturnDevStat result;
-    result.bs_flow = bs_flow;
-    result.sortDevMap = sortedBsMap;
-    BlastRadius blastRadius;
-    blastRadius.avgblastradius = avgblastradius;
-    blastRadius.maxblastradius = maxblastradius;
-    result.blastRadius = blastRadius;
-    return result;
+void add_bs_result(BsSumState& state, const SegmentShmIoStat& e){
+    state.AddResult(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
 }
 
-extern "C" ReturnRwSegStat merge_bs_rw_segment(int r_sort_flag, int w_sort_flag, double w_traffic, double w_read_traffic_ratio) {
-    auto iostats = read_segment_iostats_mmap("/var/run/pangu_blockmaster_seg_iostats");
-    std::map<std::string, BsSumState> bs_flow;
-    BsSegTrafficMap bssegmap;
-    for (const auto& e : iostats) {
-        std::string bs_ip = bs_ip_transform_cache(e.bsId);
-        auto bsIt = bs_flow.find(bs_ip);
-        if (bsIt == bs_flow.end()) {
-            bs_flow[bs_ip] = BsSumState();
-            bsIt = bs_flow.find(bs_ip);
-        }
-        bsIt->second.AddResult(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        auto& segVec = bssegmap[bs_ip];
-        auto seg_traffic_std = SegmentStdStat(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
-        auto seg_traffic = SumTraffic(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes);
-        auto seg_latency = SumLatency(e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency);
-        auto seg_iops = SumIops(e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        auto segsum = SegmentSummary(e.segmentId, seg_traffic, seg_latency, seg_iops, seg_traffic_std);
-        segVec.emplace_back(segsum);
+void add_bs_state(BsSumState& state, const BsSumState& other){
+    AddValues(state.mTrafficSum, other.mTrafficSum);
+    AddValues(state.mLatencySum, other.mLatencySum);
+    AddValues(state.mIopsSum, other.mIopsSum);
+}
+
+void add_device_result(std::map<uint64_t, DeviceSummary>& devMap, const SegmentShmIoStat& e){
+    auto devIt = devMap.find(e.segmentId.device_id);
+    if (devIt == devMap.end()) {
+        devIt = devMap.emplace(e.segmentId.device_id, DeviceSummary(e.segmentId.device_id)).first;
     }
-    ReturnRwSegStat result;
-    int16_t maxblastradius = sortBsSegMap(bssegmap, "write", w_sort_flag, w_traffic, w_read_traffic_ratio);
-    result.sortWriteSegMap = bssegmap;
-    sortBsSegMap(bssegmap, "read", r_sort_flag);
-    result.sortReadSegMap = bssegmap;
-    double avgblastradius = static_cast<double>(bssegmap.size()) / maxblastradius;
-    result.bs_flow = bs_flow;
-    BlastRadius blastRadius;
-    blastRadius.avgblastradius = avgblastradius;
-    blastRadius.maxblastradius = maxblastradius;
-    result.blastRadius = blastRadius;
-    return result;
+    SegmentStdStat s(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
+    devIt->second.AddResult(e.segmentId.segmentIdx, s, e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
 }
 
-double calculate_segment_score(const int64_t& urgent_traffic, const double& urgent_std, const int64_t& urgent_latency, const int64_t& urgent_iops, const SortType& sortType){
-    double score = 0.0;
-    switch (sortType){
-        case SortType::TrafficStdScore:
-            if (urgent_latency != 0){
-                score = (W_TRAFFIC * urgent_traffic - W_STD * urgent_std) * urgent_iops / urgent_latency;
+DeviceSummary BsDeviceTable::Summary(size_t d) const{
+    const DeviceAggregate& a = devices[d];
+    DeviceSummary s(a.device_id);
+    s.segment_index.assign(segmentIndex.begin() + a.segment_begin, segmentIndex.begin() + a.segment_begin + a.segment_num);
+    s.segment_traffic_std.assign(segmentStd.begin() + a.segment_begin, segmentStd.begin() + a.segment_begin + a.segment_num);
+    s.traffic = a.traffic;
+    s.latency = a.latency;
+    s.iops = a.iops;
+    s.read_urgent_std_sum = a.read_urgent_std_sum;
+    s.write_urgent_std_sum = a.write_urgent_std_sum;
+    s.all_urgent_std_sum = a.all_urgent_std_sum;
+    return s;
+}
+
+DeviceTableBuilder::DeviceTableBuilder(std::vector<DeviceAggregate>& devices, size_t expected_records) : mDevices(devices), mFirst(devices.size()), mBsNum(0){
+    // a device has at least one record, so neither the slots nor the devices
+    // grow; pages the devices do not reach are never touched
+    size_t capacity = 16;
+    while (capacity < expected_records) {
+        capacity <<= 1;
+    }
+    Slot empty = {0, 0, EMPTY_SLOT};
+    mSlots.assign(capacity, empty);
+    mDevices.reserve(mFirst + expected_records);
+    mAdded.reserve(expected_records);
+}
+
+size_t device_slot_hash(uint64_t device_id, uint32_t bs){
+    uint64_t h = (device_id ^ (static_cast<uint64_t>(bs) << 48)) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(h ^ (h >> 29));
+}
+
+void DeviceTableBuilder::Grow(){
+    std::vector<Slot> slots;
+    slots.swap(mSlots);
+    Slot empty = {0, 0, EMPTY_SLOT};
+    mSlots.assign(slots.size() * 2, empty);
+    size_t mask = mSlots.size() - 1;
+    for (const auto& slot : slots) {
+        if (slot.device == EMPTY_SLOT) {
+            continue;
+        }
+        size_t i = device_slot_hash(slot.device_id, slot.bs) & mask;
+        while (mSlots[i].device != EMPTY_SLOT) {
+            i = (i + 1) & mask;
+        }
+        mSlots[i] = slot;
+    }
+}
+
+void DeviceTableBuilder::Add(uint32_t bs, uint32_t record, const SegmentShmIoStat& e){
+    uint64_t device_id = e.segmentId.device_id;
+    size_t mask = mSlots.size() - 1;
+    size_t i = device_slot_hash(device_id, bs) & mask;
+    while (mSlots[i].device != EMPTY_SLOT && (mSlots[i].device_id != device_id || mSlots[i].bs != bs)) {
+        i = (i + 1) & mask;
+    }
+    uint32_t device = mSlots[i].device;
+    if (device == EMPTY_SLOT) {
+        device = DeviceNum();
+        mDevices.emplace_back(device_id, bs);
+        mBsNum = std::max(mBsNum, bs + 1);
+        Slot slot = {device_id, bs, device};
+        mSlots[i] = slot;
+        if (DeviceNum() * 2 > mSlots.size()) {
+            Grow();
+        }
+    }
+    // the same sums, in the same order, as DeviceSummary::AddResult
+    DeviceAggregate& d = mDevices[mFirst + device];
+    d.segment_num++;
+    d.read_urgent_std_sum += e.urgent_flow_std.readStd;
+    d.write_urgent_std_sum += e.urgent_flow_std.writeStd;
+    d.all_urgent_std_sum += e.urgent_flow_std.writeStd + e.urgent_flow_std.readStd;
+    AddValues(d.traffic, e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes);
+    AddValues(d.latency, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency);
+    AddValues(d.iops, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
+    mAdded.emplace_back(record, device);
+}
+
+void DeviceTableBuilder::Finish(const std::vector<SegmentShmIoStat>& records, BsDeviceTable& table, size_t device_offset, size_t segment_offset) const{
+    // the order the per-BS device maps used to iterate in: bucket by BS, then
+    // sort each BS by device_id over compact keys
+    size_t n = DeviceNum();
+    std::vector<uint32_t> bsStart(mBsNum + 1, 0);
+    for (size_t k = 0; k < n; ++k) {
+        bsStart[table.devices[device_offset + k].bs + 1]++;
+    }
+    for (size_t bs = 0; bs < mBsNum; ++bs) {
+        bsStart[bs + 1] += bsStart[bs];
+    }
+    std::vector<std::pair<uint64_t, uint32_t>> keys(n);
+    for (size_t k = 0; k < n; ++k) {
+        const DeviceAggregate& d = table.devices[device_offset + k];
+        keys[bsStart[d.bs]++] = std::make_pair(d.device_id, static_cast<uint32_t>(device_offset + k));
+    }
+    for (size_t bs = 0, begin = 0; bs < mBsNum; ++bs) {
+        std::sort(keys.begin() + begin, keys.begin() + bsStart[bs]);
+        begin = bsStart[bs];
+    }
+    for (size_t r = 0; r < n; ++r) {
+        table.order[device_offset + r] = keys[r].second;
+    }
+    size_t segment = segment_offset;
+    for (size_t k = 0; k < n; ++k) {
+        DeviceAggregate& d = table.devices[device_offset + k];
+        d.segment_begin = segment;
+        segment += d.segment_num;
+        d.segment_num = 0;  // counts the segments back in below
+    }
+    for (const auto& added : mAdded) {
+        DeviceAggregate& d = table.devices[device_offset + added.second];
+        const auto& e = records[added.first];
+        size_t at = d.segment_begin + d.segment_num++;
+        table.segmentIndex[at] = e.segmentId.segmentIdx;
+        table.segmentStd[at] = SegmentStdStat(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
+    }
+}
+
+void set_merge_threads(int threads){
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    mergeThreads = threads;
+}
+
+const char* merge_phase_name(MergePhase phase){
+    switch (phase) {
+        case MergePhase::ShmRead: return "shm_read";
+        case MergePhase::Delta: return "delta";
+        case MergePhase::Scan: return "scan";
+        case MergePhase::Rank: return "rank";
+        case MergePhase::Result: return "result";
+        case MergePhase::Plan: return "plan";
+        case MergePhase::Convert: return "convert";
+        case MergePhase::Detect: return "detect";
+        default: return "unknown";
+    }
+}
+
+MergeStats merge_stats(bool reset){
+    // with reset every counter is swapped out on its own, so an update racing
+    // the read lands in either this tick or the next, never in neither
+    auto take = [reset](std::atomic<uint64_t>& counter){
+        return reset ? counter.exchange(0, std::memory_order_relaxed) : counter.load(std::memory_order_relaxed);
+    };
+    MergeStats stats;
+    for (size_t p = 0; p < MERGE_PHASE_NUM; ++p) {
+        const char* name = merge_phase_name(static_cast<MergePhase>(p));
+        stats.phaseMs[name] = take(mergeCounters.phaseNs[p]) / 1e6;
+        stats.phaseCalls[name] = take(mergeCounters.phaseCalls[p]);
+    }
+    stats.tableReads = take(mergeCounters.tableReads);
+    stats.records = take(mergeCounters.records);
+    stats.bytesScanned = take(mergeCounters.bytesScanned);
+    stats.tornRecords = take(mergeCounters.tornRecords);
+    stats.duplicateRecords = take(mergeCounters.duplicateRecords);
+    stats.bsNum = mergeCounters.bsNum.load(std::memory_order_relaxed);
+    stats.bsIpHits = take(mergeCounters.bsIpHits);
+    stats.bsIpMisses = take(mergeCounters.bsIpMisses);
+    stats.summaries = take(mergeCounters.summaries);
+    stats.resultEntries = take(mergeCounters.resultEntries);
+    return stats;
+}
+
+std::string MergeStats::ToString() const{
+    std::ostringstream ss;
+    ss.setf(std::ios::fixed);
+    ss.precision(3);
+    for (size_t p = 0; p < MERGE_PHASE_NUM; ++p) {
+        const char* name = merge_phase_name(static_cast<MergePhase>(p));
+        ss << name << "=" << phaseMs.at(name) << "ms/" << phaseCalls.at(name) << " ";
+    }
+    ss << "reads=" << tableReads << " records=" << records << " bytes=" << bytesScanned << " torn=" << tornRecords << " duplicates=" << duplicateRecords
+       << " bs=" << bsNum << " bs_ip_hit_rate=" << BsIpHitRate() << " summaries=" << summaries << " result_entries=" << resultEntries;
+    return ss.str();
+}
+
+// The sums are unsigned and wrap, so taking a record back out is exact even
+// when its counters were negative.
+void remove_bs_result(BsSumState& state, const SegmentShmIoStat& e){
+    BsSumState record;
+    add_bs_result(record, e);
+    SubValues(state.mTrafficSum, record.mTrafficSum);
+    SubValues(state.mLatencySum, record.mLatencySum);
+    SubValues(state.mIopsSum, record.mIopsSum);
+}
+
+std::shared_ptr<SegmentSnapshot> SegmentSnapshot::Load(const std::vector<std::string>& paths, const std::shared_ptr<SegmentSnapshot>& base){
+    std::shared_ptr<SegmentSnapshot> snapshot;
+    {
+        PhaseTimer timer(MergePhase::ShmRead);
+        snapshot = std::make_shared<SegmentSnapshot>(read_segment_iostats(paths));
+    }
+    if (base) {
+        PhaseTimer timer(MergePhase::Delta);
+        snapshot->ApplyDelta(*base);
+    }
+    return snapshot;
+}
+
+uint32_t SegmentSnapshot::InternBs(uint64_t bsId){
+    auto it = mBsIndex.find(bsId);
+    if (it != mBsIndex.end()) {
+        return it->second;
+    }
+    // bsIds that format to the same "ip:port" share one BS, as with the string keys
+    std::string bs_ip = bs_ip_transform_cache(bsId);
+    uint32_t bs = 0;
+    while (bs < mBsIps.size() && mBsIps[bs] != bs_ip) {
+        bs++;
+    }
+    if (bs == mBsIps.size()) {
+        mBsIps.emplace_back(bs_ip);
+        mBsState.emplace_back();
+        mBsRecordNum.emplace_back(0);
+    }
+    mBsIndex.emplace(bsId, bs);
+    return bs;
+}
+
+uint32_t SegmentSnapshot::AccumulateBs(size_t i){
+    const auto& e = mRecords[i];
+    uint32_t bs = InternBs(e.bsId);
+    mRecordBs[i] = bs;
+    mBsRecordNum[bs]++;
+    add_bs_result(mBsState[bs], e);
+    return bs;
+}
+
+void SegmentSnapshot::PatchRecord(const SegmentShmIoStat& old, uint32_t old_bs, size_t i){
+    const auto& e = mRecords[i];
+    if (memcmp(&old, &e, sizeof(e)) == 0) {
+        mRecordBs[i] = old_bs;
+        return;
+    }
+    mChangedRecords++;
+    remove_bs_result(mBsState[old_bs], old);
+    mBsRecordNum[old_bs]--;
+    uint32_t bs = AccumulateBs(i);
+    if (bs != old_bs) {
+        mMoves.emplace_back(e.segmentId, mBsIps[old_bs], mBsIps[bs], e.loadVersion);
+    }
+}
+
+void SegmentSnapshot::ApplyDelta(SegmentSnapshot& base){
+    // the base may be published, with merges filling its other views
+    std::lock_guard<std::mutex> lock(base.mFillMutex);
+    if (!base.mHasBsState || mHasBsState) {
+        return;
+    }
+    mBsIndex = base.mBsIndex;
+    mBsIps = base.mBsIps;
+    mBsState = base.mBsState;
+    mBsRecordNum = base.mBsRecordNum;
+    mRecordBs.resize(mRecords.size());
+    // Records usually stay in the same slot, so compare slot by slot and only
+    // look up by SegmentId the ones that were added, dropped or shifted.
+    const auto& baseRecords = base.mRecords;
+    size_t common = std::min(mRecords.size(), baseRecords.size());
+    std::unordered_multimap<SegmentId, size_t, SegmentIdHash> dropped;
+    std::vector<size_t> added;
+    for (size_t i = 0; i < common; ++i) {
+        if (mRecords[i].segmentId == baseRecords[i].segmentId) {
+            PatchRecord(baseRecords[i], base.mRecordBs[i], i);
+            continue;
+        }
+        dropped.emplace(baseRecords[i].segmentId, i);
+        added.push_back(i);
+    }
+    for (size_t i = common; i < baseRecords.size(); ++i) {
+        dropped.emplace(baseRecords[i].segmentId, i);
+    }
+    for (size_t i = common; i < mRecords.size(); ++i) {
+        added.push_back(i);
+    }
+    for (size_t i : added) {
+        auto it = dropped.find(mRecords[i].segmentId);
+        if (it == dropped.end()) {
+            mChangedRecords++;
+            AccumulateBs(i);
+            continue;
+        }
+        PatchRecord(baseRecords[it->second], base.mRecordBs[it->second], i);
+        dropped.erase(it);
+    }
+    for (const auto& entry : dropped) {
+        mChangedRecords++;
+        uint32_t bs = base.mRecordBs[entry.second];
+        remove_bs_result(mBsState[bs], baseRecords[entry.second]);
+        mBsRecordNum[bs]--;
+    }
+    mHasBsState = true;
+    mIsDelta = true;
+    // a BS that lost all its segments would linger as an empty entry: rebuild
+    // from scratch instead, which is rare enough not to matter
+    if (std::find(mBsRecordNum.begin(), mBsRecordNum.end(), 0) != mBsRecordNum.end()) {
+        mBsIndex.clear();
+        mBsIps.clear();
+        mBsState.clear();
+        mBsRecordNum.clear();
+        mHasBsState = false;
+        mIsDelta = false;
+        Scan(false, false);
+    }
+}
+
+size_t SegmentSnapshot::Workers() const{
+    size_t workers = std::min<size_t>(std::max(mergeThreads.load(), 1), mRecords.size() / MIN_RECORDS_PER_WORKER);
+    return std::max<size_t>(workers, 1);
+}
+
+void SegmentSnapshot::AccumulateBsParallel(size_t workers){
+    // Each worker interns the bsIds of its own range locally. Interning those
+    // worker by worker afterwards gives the same BS order as a serial scan.
+    struct LocalBs {
+        std::unordered_map<uint64_t, uint32_t> index;
+        std::vector<uint64_t> bsIds;
+        std::vector<BsSumState> state;
+        std::vector<uint32_t> recordNum;
+    };
+    std::vector<LocalBs> locals(workers);
+    mRecordBs.resize(mRecords.size());
+    parallel_for(workers, mRecords.size(), [&](size_t w, size_t begin, size_t end){
+        auto& local = locals[w];
+        for (size_t i = begin; i < end; ++i) {
+            const auto& e = mRecords[i];
+            auto it = local.index.find(e.bsId);
+            if (it == local.index.end()) {
+                it = local.index.emplace(e.bsId, local.bsIds.size()).first;
+                local.bsIds.push_back(e.bsId);
+                local.state.emplace_back();
+                local.recordNum.push_back(0);
             }
-            break;
-        case SortType::TrafficScore:
-            if (urgent_latency != 0){
-                score = urgent_traffic * urgent_iops / urgent_latency;
+            mRecordBs[i] = it->second;
+            local.recordNum[it->second]++;
+            add_bs_result(local.state[it->second], e);
+        }
+    });
+    std::vector<std::vector<uint32_t>> toGlobal(workers);
+    for (size_t w = 0; w < workers; ++w) {
+        const auto& local = locals[w];
+        for (size_t l = 0; l < local.bsIds.size(); ++l) {
+            uint32_t bs = InternBs(local.bsIds[l]);
+            toGlobal[w].push_back(bs);
+            mBsRecordNum[bs] += local.recordNum[l];
+            add_bs_state(mBsState[bs], local.state[l]);
+        }
+    }
+    parallel_for(workers, mRecords.size(), [&](size_t w, size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            mRecordBs[i] = toGlobal[w][mRecordBs[i]];
+        }
+    });
+    mHasBsState = true;
+}
+
+void SegmentSnapshot::BucketRecords(){
+    if (mBsRecordStart.size() == mBsIps.size() + 1) {
+        return;
+    }
+    mBsRecordStart.assign(mBsIps.size() + 1, 0);
+    for (size_t bs = 0; bs < mBsIps.size(); ++bs) {
+        mBsRecordStart[bs + 1] = mBsRecordStart[bs] + mBsRecordNum[bs];
+    }
+    std::vector<size_t> next(mBsRecordStart.begin(), mBsRecordStart.end() - 1);
+    mBsRecordIdx.resize(mRecords.size());
+    for (size_t i = 0; i < mRecords.size(); ++i) {
+        mBsRecordIdx[next[mRecordBs[i]]++] = i;
+    }
+}
+
+void SegmentSnapshot::ResizeDevices(size_t device_num, size_t segment_num){
+    mBsDevices.devices.resize(device_num);
+    mBsDevices.order.resize(device_num);
+    mBsDevices.segmentIndex.resize(segment_num);
+    mBsDevices.segmentStd.resize(segment_num);
+}
+
+void SegmentSnapshot::IndexDevices(){
+    mBsDevices.bsStart.assign(mBsIps.size() + 1, 0);
+    for (const auto& d : mBsDevices.devices) {
+        mBsDevices.bsStart[d.bs + 1]++;
+    }
+    for (size_t bs = 0; bs < mBsIps.size(); ++bs) {
+        mBsDevices.bsStart[bs + 1] += mBsDevices.bsStart[bs];
+    }
+}
+
+std::vector<size_t> SegmentSnapshot::BsRanges(size_t workers) const{
+    // cut the BS range where the record counts, not the BS counts, even out
+    std::vector<size_t> bounds(workers + 1, mBsIps.size());
+    bounds[0] = 0;
+    for (size_t w = 1; w < workers; ++w) {
+        size_t target = mRecords.size() * w / workers;
+        bounds[w] = std::lower_bound(mBsRecordStart.begin(), mBsRecordStart.end() - 1, target) - mBsRecordStart.begin();
+    }
+    return bounds;
+}
+
+void SegmentSnapshot::Scan(bool want_segments, bool want_devices){
+    std::lock_guard<std::mutex> lock(mFillMutex);
+    bool fill_bs = !mHasBsState;
+    bool fill_seg = want_segments && !mHasSegView;
+    bool fill_dev = want_devices && !mHasDevView;
+    if (!fill_bs && !fill_seg && !fill_dev){
+        return;
+    }
+    PhaseTimer timer(MergePhase::Scan);
+    size_t workers = Workers();
+    if (workers > 1){
+        if (fill_bs){
+            AccumulateBsParallel(workers);
+        }
+        if (fill_seg || fill_dev){
+            // each worker owns whole BSs and walks their records in table
+            // order, so every list comes out as the serial scan builds it
+            BucketRecords();
+            if (fill_seg){
+                mBsSegments.resize(mBsIps.size());
             }
-            break;
-        default:
-            std::cerr << "Invalid sort type: " << static_cast<int>(sortType) << std::endl;
-            exit(EXIT_FAILURE);
+            std::vector<size_t> bounds = BsRanges(workers);
+            std::vector<std::vector<DeviceAggregate>> found(fill_dev ? workers : 0);
+            std::vector<DeviceTableBuilder> builders;
+            for (size_t w = 0; w < found.size(); ++w) {
+                builders.emplace_back(found[w], mBsRecordStart[bounds[w + 1]] - mBsRecordStart[bounds[w]]);
+            }
+            parallel_ranges(bounds, [&](size_t w, size_t begin, size_t end){
+                for (size_t bs = begin; bs < end; ++bs) {
+                    if (fill_seg){
+                        mBsSegments[bs].reserve(mBsRecordNum[bs]);
+                    }
+                    for (size_t j = mBsRecordStart[bs]; j < mBsRecordStart[bs + 1]; ++j) {
+                        const auto& e = mRecords[mBsRecordIdx[j]];
+                        if (fill_seg){
+                            mBsSegments[bs].emplace_back(make_segment_summary(e));
+                        }
+                        if (fill_dev){
+                            builders[w].Add(bs, mBsRecordIdx[j], e);
+                        }
+                    }
+                }
+            });
+            if (fill_dev){
+                // workers own ascending BS ranges, so their tables concatenate
+                std::vector<size_t> deviceOffset(workers + 1, 0);
+                std::vector<size_t> segmentOffset(workers + 1, 0);
+                for (size_t w = 0; w < workers; ++w) {
+                    deviceOffset[w + 1] = deviceOffset[w] + builders[w].DeviceNum();
+                    segmentOffset[w + 1] = segmentOffset[w] + builders[w].SegmentNum();
+                }
+                ResizeDevices(deviceOffset[workers], segmentOffset[workers]);
+                parallel_for(workers, workers, [&](size_t w, size_t, size_t){
+                    std::copy(found[w].begin(), found[w].end(), mBsDevices.devices.begin() + deviceOffset[w]);
+                    builders[w].Finish(mRecords, mBsDevices, deviceOffset[w], segmentOffset[w]);
+                });
+                IndexDevices();
+            }
+        }
+    }
+    else{
+        if (fill_bs){
+            mRecordBs.resize(mRecords.size());
+        }
+        DeviceTableBuilder builder(mBsDevices.devices, fill_dev ? mRecords.size() : 0);
+        for (size_t i = 0; i < mRecords.size(); ++i) {
+            const auto& e = mRecords[i];
+            uint32_t bs = fill_bs ? AccumulateBs(i) : mRecordBs[i];
+            if (fill_seg){
+                if (bs >= mBsSegments.size()) {
+                    mBsSegments.resize(bs + 1);
+                }
+                mBsSegments[bs].emplace_back(make_segment_summary(e));
+            }
+            if (fill_dev){
+                builder.Add(bs, i, e);
+            }
+        }
+        if (fill_dev){
+            ResizeDevices(builder.DeviceNum(), builder.SegmentNum());
+            builder.Finish(mRecords, mBsDevices, 0, 0);
+            IndexDevices();
+        }
+    }
+    if (fill_bs){
+        mHasBsState = true;
+    }
+    mHasSegView = mHasSegView || fill_seg;
+    mHasDevView = mHasDevView || fill_dev;
+    mergeCounters.bsNum.store(mBsIps.size(), std::memory_order_relaxed);
+    if (fill_seg){
+        count_merge(mergeCounters.summaries, mRecords.size());
+    }
+    if (fill_dev){
+        count_merge(mergeCounters.summaries, mBsDevices.devices.size());
     }
-    return score;
 }
 
-void calculate_bs_score(std::map<std::string, BsSumScoreState>& bs_score_flow, double w1){
-    std::vector<double> bs_wtraffic, bs_rtraffic, bs_wlatency_iops, bs_rlatency_iops;
-    for (auto& bs : bs_score_flow){ 
-        bs_wtraffic.emplace_back(bs.second.mTrafficSum.write_urgent_sum);
-        bs_rtraffic.emplace_back(bs.second.mTrafficSum.read_urgent_sum);
-        if (bs.second.mIopsSum.write_urgent_sum != 0){
-            bs_wlatency_iops.emplace_back(bs.second.mLatencySum.write_urgent_sum / bs.second.mIopsSum.write_urgent_sum);
+size_t SegmentSnapshot::BsNum(){
+    Scan(false, false);
+    return mBsIps.size();
+}
+
+const std::vector<std::string>& SegmentSnapshot::BsIps(){
+    Scan(false, false);
+    return mBsIps;
+}
+
+const std::vector<uint32_t>& SegmentSnapshot::RecordBs(){
+    Scan(false, false);
+    return mRecordBs;
+}
+
+const std::vector<BsSumState>& SegmentSnapshot::BsState(){
+    Scan(false, false);
+    return mBsState;
+}
+
+const std::vector<std::vector<SegmentSummary>>& SegmentSnapshot::BsSegments(){
+    Scan(true, false);
+    return mBsSegments;
+}
+
+const BsDeviceTable& SegmentSnapshot::BsDevices(){
+    Scan(false, true);
+    return mBsDevices;
+}
+
+const std::map<std::string, BsSumState>& SegmentSnapshot::BsFlow(){
+    Scan(false, false);
+    std::lock_guard<std::mutex> lock(mFillMutex);
+    if (!mHasBsFlow){
+        for (size_t bs = 0; bs < mBsIps.size(); ++bs) {
+            mBsFlow.emplace(mBsIps[bs], mBsState[bs]);
         }
-        else{
-            bs_wlatency_iops.emplace_back(0);
+        mHasBsFlow = true;
+    }
+    return mBsFlow;
+}
+
+const std::vector<uint32_t>& SegmentSnapshot::BsRecordNum(){
+    Scan(false, false);
+    return mBsRecordNum;
+}
+
+const std::unordered_map<SegmentId, uint32_t, SegmentIdHash>& SegmentSnapshot::SegmentIndex(){
+    std::lock_guard<std::mutex> lock(mFillMutex);
+    if (!mHasSegmentIndex){
+        mSegmentIndex.reserve(mRecords.size());
+        for (size_t i = 0; i < mRecords.size(); ++i) {
+            mSegmentIndex.emplace(mRecords[i].segmentId, i);
         }
-        if (bs.second.mIopsSum.read_urgent_sum != 0){
-            bs_rlatency_iops.emplace_back(bs.second.mLatencySum.read_urgent_sum / bs.second.mIopsSum.read_urgent_sum);
+        mHasSegmentIndex = true;
+    }
+    return mSegmentIndex;
+}
+
+int16_t SegmentSnapshot::RankSegmentsTopK(RankOrder* write_ranked, int w_sort_flag, RankOrder* read_ranked, int r_sort_flag, const ScoringModel& model, size_t top_k, uint64_t traffic_floor){
+    struct BsTopK {
+        TopKHeap<uint32_t> write;
+        TopKHeap<uint32_t> read;
+        int64_t seg_num;
+        explicit BsTopK(size_t k) : write(k), read(k), seg_num(0) {}
+    };
+    SortType wsortType = static_cast<SortType>(w_sort_flag);
+    SortType rsortType = static_cast<SortType>(r_sort_flag);
+    size_t k = top_k > 0 ? top_k : mRecords.size();
+    // normalizing needs the feature maxima before the first key
+    RankParams wparams = model.norm == ScoreNorm::None ? rank_params(model, wsortType) : compile_rank_params(model, wsortType, true, BsSegments());
+    RankParams rparams = model.norm == ScoreNorm::None ? rank_params(model, rsortType) : compile_rank_params(model, rsortType, false, BsSegments());
+    std::vector<BsTopK> bsTopK;
+    auto rank = [&](BsTopK& top, uint32_t i){
+        top.seg_num++;
+        SegmentSummary seg = make_segment_summary(mRecords[i]);
+        double wkey = write_ranked != nullptr ? segment_rank_key(seg, wsortType, true, model.window, wparams) : 0;
+        if (write_ranked != nullptr && (traffic_floor == 0 || seg.traffic.write_urgent_sum > traffic_floor)){
+            top.write.Push(wkey, i);
+        }
+        // read ties follow the write ranking, as in RankSegments
+        if (read_ranked != nullptr && (traffic_floor == 0 || seg.traffic.read_urgent_sum > traffic_floor)){
+            top.read.Push(segment_rank_key(seg, rsortType, false, model.window, rparams), i, wkey);
+        }
+    };
+    size_t workers = Workers();
+    if (workers > 1){
+        Scan(false, false);
+    }
+    PhaseTimer timer(MergePhase::Rank);
+    if (workers > 1){
+        // the heaps of one BS see its records in table order, as in the serial pass
+        {
+            std::lock_guard<std::mutex> lock(mFillMutex);
+            BucketRecords();
+        }
+        bsTopK.resize(mBsIps.size(), BsTopK(k));
+        parallel_ranges(BsRanges(workers), [&](size_t, size_t begin, size_t end){
+            for (size_t bs = begin; bs < end; ++bs) {
+                for (size_t j = mBsRecordStart[bs]; j < mBsRecordStart[bs + 1]; ++j) {
+                    rank(bsTopK[bs], mBsRecordIdx[j]);
+                }
+            }
+        });
+    }
+    else{
+        // the BS sums are filled by the ranking pass itself when still missing
+        std::unique_lock<std::mutex> fill(mFillMutex);
+        bool fill_bs = !mHasBsState;
+        if (fill_bs){
+            mRecordBs.resize(mRecords.size());
         }
         else{
-            bs_rlatency_iops.emplace_back(0);
+            fill.unlock();
+        }
+        for (size_t i = 0; i < mRecords.size(); ++i) {
+            uint32_t bs = fill_bs ? AccumulateBs(i) : mRecordBs[i];
+            if (bs >= bsTopK.size()) {
+                bsTopK.resize(bs + 1, BsTopK(k));
+            }
+            rank(bsTopK[bs], i);
+        }
+        if (fill_bs){
+            mHasBsState = true;
         }
+        mergeCounters.bsNum.store(mBsIps.size(), std::memory_order_relaxed);
+    }
+    count_merge(mergeCounters.summaries, mRecords.size());
+    int64_t maxblastradius = 0;
+    for (RankOrder* ranked : {write_ranked, read_ranked}) {
+        if (ranked != nullptr){
+            ranked->start.assign(1, 0);
+            ranked->index.clear();
+        }
+    }
+    for (size_t bs = 0; bs < bsTopK.size(); ++bs) {
+        maxblastradius = std::max(maxblastradius, bsTopK[bs].seg_num);
+        if (write_ranked != nullptr){
+            bsTopK[bs].write.Drain(write_ranked->index);
+            write_ranked->start.push_back(write_ranked->index.size());
+        }
+        if (read_ranked != nullptr){
+            bsTopK[bs].read.Drain(read_ranked->index);
+            read_ranked->start.push_back(read_ranked->index.size());
+        }
+    }
+    return static_cast<int16_t>(maxblastradius);
+}
+
+int16_t SegmentSnapshot::RankSegments(RankOrder& ranked, bool write, int sort_flag, const ScoringModel& model, const RankOrder* ties){
+    const auto& bsSegments = BsSegments();
+    PhaseTimer timer(MergePhase::Rank);
+    SortType sortType = static_cast<SortType>(sort_flag);
+    RankParams params = compile_rank_params(model, sortType, write, bsSegments);
+    ranked.start.assign(1, 0);
+    ranked.index.clear();
+    ranked.index.reserve(mRecords.size());
+    std::vector<double> keys, tieKeys;
+    int16_t maxblastradius = 0;
+    for (size_t bs = 0; bs < bsSegments.size(); ++bs) {
+        const auto& segVec = bsSegments[bs];
+        maxblastradius = std::max(maxblastradius, static_cast<int16_t>(segVec.size()));
+        segment_rank_keys(segVec, sortType, write, model.window, params, keys);
+        uint32_t base = ranked.index.size();
+        if (ties == nullptr){
+            for (uint32_t i : rank_order(keys)) {
+                ranked.index.push_back(base + i);
+            }
+        }
+        else{
+            const uint32_t* tied = &ties->index[ties->start[bs]];
+            tieKeys.resize(keys.size());
+            for (size_t j = 0; j < keys.size(); ++j) {
+                tieKeys[j] = keys[tied[j] - base];
+            }
+            for (uint32_t j : rank_order(tieKeys)) {
+                ranked.index.push_back(tied[j]);
+            }
+        }
+        ranked.start.push_back(ranked.index.size());
+    }
+    return maxblastradius;
+}
+
+// Fills ranked with every entry the write or the read ranking keeps, once,
+// BS by BS in IP order. Both rankings index the same source of source_num
+// entries, BS by BS in bsIps order; make(bs, i) builds source entry i.
+template <typename T, typename Make>
+void build_ranked_entries(const std::vector<std::string>& bsIps, const RankOrder& write, const RankOrder& read, size_t source_num, Make make, RankedEntries<T>& ranked){
+    PhaseTimer timer(MergePhase::Result);
+    std::vector<uint32_t> byIp(bsIps.size());
+    for (size_t bs = 0; bs < byIp.size(); ++bs) {
+        byIp[bs] = bs;
+    }
+    std::sort(byIp.begin(), byIp.end(), [&bsIps](uint32_t a, uint32_t b){ return bsIps[a] < bsIps[b]; });
+    const uint32_t none = 0xffffffff;
+    std::vector<uint32_t> slot(source_num, none);
+    ranked.bs.reserve(bsIps.size());
+    ranked.entries.reserve(std::max(write.index.size(), read.index.size()));
+    ranked.write.start.assign(1, 0);
+    ranked.read.start.assign(1, 0);
+    ranked.write.index.reserve(write.index.size());
+    ranked.read.index.reserve(read.index.size());
+    for (uint32_t bs : byIp) {
+        ranked.bs.push_back(bsIps[bs]);
+        for (int r = 0; r < 2; ++r) {
+            const RankOrder& in = r == 0 ? write : read;
+            RankOrder& out = r == 0 ? ranked.write : ranked.read;
+            for (size_t j = in.start[bs]; j < in.start[bs + 1]; ++j) {
+                uint32_t i = in.index[j];
+                if (slot[i] == none) {
+                    slot[i] = ranked.entries.size();
+                    ranked.entries.push_back(make(bs, i));
+                }
+                out.index.push_back(slot[i]);
+            }
+            out.start.push_back(out.index.size());
+        }
+    }
+    count_merge(mergeCounters.resultEntries, ranked.entries.size());
+}
+
+ReturnSegStat SegmentSnapshot::MergeSegment(int sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model){
+    ScoringModel scoring = model != nullptr ? *model : scoring_model();
+    ReturnSegStat result;
+    int16_t maxblastradius;
+    if (top_k > 0 || traffic_floor > 0){
+        RankOrder ranked;
+        maxblastradius = RankSegmentsTopK(&ranked, sort_flag, nullptr, 0, scoring, top_k, traffic_floor);
+        PhaseTimer timer(MergePhase::Result);
+        for (size_t bs = 0; bs + 1 < ranked.start.size(); ++bs) {
+            auto& segs = result.sortSegMap[mBsIps[bs]];
+            segs.reserve(ranked.Size(bs));
+            for (size_t j = ranked.start[bs]; j < ranked.start[bs + 1]; ++j) {
+                segs.emplace_back(make_segment_summary(mRecords[ranked.index[j]]));
+            }
+        }
+        count_merge(mergeCounters.resultEntries, ranked.index.size());
+    }
+    else{
+        const auto& bsSegments = BsSegments();
+        {
+            PhaseTimer timer(MergePhase::Result);
+            for (size_t bs = 0; bs < bsSegments.size(); ++bs) {
+                result.sortSegMap[mBsIps[bs]] = bsSegments[bs];
+            }
+            count_merge(mergeCounters.resultEntries, mRecords.size());
+        }
+        maxblastradius = sortBsSegMap(result.sortSegMap, "write", sort_flag, scoring);
+    }
+    result.bs_flow = BsFlow();
+    BlastRadius blastRadius;
+    blastRadius.avgblastradius = static_cast<double>(result.sortSegMap.size()) / maxblastradius;
+    blastRadius.maxblastradius = maxblastradius;
+    result.blastRadius = blastRadius;
+    return result;
+}
+
+int16_t SegmentSnapshot::RankDevices(RankOrder& ranked, int& bs_device_num, std::string sort_type, int sort_flag, const ScoringModel& model, size_t top_k, uint64_t traffic_floor){
+    const auto& table = BsDevices();
+    PhaseTimer timer(MergePhase::Rank);
+    bool write = is_write_rank(sort_type);
+    SortType sortType = static_cast<SortType>(sort_flag);
+    const std::vector<DeviceAggregate>* lists[] = {&table.devices};
+    RankParams params = compile_rank_params(model, sortType, write, lists);
+    std::vector<double> keys;
+    device_rank_keys(table.devices, sortType, write, model.window, params, keys);
+    bool bounded = top_k > 0 || traffic_floor > 0;
+    ranked.start.assign(1, 0);
+    ranked.index.clear();
+    if (!bounded){
+        // one sort over every device in table.order; ties keep that order,
+        // which is device_id order within a BS, so bucketing it by BS gives
+        // each BS the order a sort of its own devices would
+        std::vector<double> orderKeys(keys.size());
+        for (size_t j = 0; j < keys.size(); ++j) {
+            orderKeys[j] = keys[table.order[j]];
+        }
+        ranked.index.resize(keys.size());
+        std::vector<uint32_t> next(table.bsStart.begin(), table.bsStart.end() - 1);
+        for (uint32_t j : rank_order(orderKeys)) {
+            uint32_t d = table.order[j];
+            ranked.index[next[table.devices[d].bs]++] = d;
+        }
+    }
+    int16_t maxblastradius = 0;
+    for (size_t bs = 0; bs < table.BsNum(); ++bs) {
+        size_t deviceNum = table.DeviceNum(bs);
+        bs_device_num += deviceNum;
+        maxblastradius = std::max(maxblastradius, static_cast<int16_t>(deviceNum));
+        if (bounded){
+            TopKHeap<uint32_t> heap(top_k > 0 ? top_k : deviceNum);
+            for (size_t j = table.bsStart[bs]; j < table.bsStart[bs + 1]; ++j) {
+                uint32_t d = table.order[j];
+                if (traffic_floor == 0 || (write ? RankSide<true>::Traffic(table.devices[d]) : RankSide<false>::Traffic(table.devices[d])) > traffic_floor){
+                    heap.Push(keys[d], d);
+                }
+            }
+            heap.Drain(ranked.index);
+        }
+        ranked.start.push_back(bounded ? ranked.index.size() : table.bsStart[bs + 1]);
+    }
+    return maxblastradius;
+}
+
+ReturnDevStat SegmentSnapshot::MergeDevice(int sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model){
+    ScoringModel scoring = model != nullptr ? *model : scoring_model();
+    ReturnDevStat result;
+    int bs_device_num = 0;
+    RankOrder ranked;
+    int16_t maxblastradius = RankDevices(ranked, bs_device_num, "write", sort_flag, scoring, top_k, traffic_floor);
+    {
+        PhaseTimer timer(MergePhase::Result);
+        const auto& table = BsDevices();
+        for (size_t bs = 0; bs < table.BsNum(); ++bs) {
+            auto& devices = result.sortDevMap[mBsIps[bs]];
+            devices.reserve(ranked.Size(bs));
+            for (size_t j = ranked.start[bs]; j < ranked.start[bs + 1]; ++j) {
+                devices.emplace_back(table.Summary(ranked.index[j]));
+            }
+        }
+        count_merge(mergeCounters.resultEntries, ranked.index.size());
+    }
+    result.bs_flow = BsFlow();
+    BlastRadius blastRadius;
+    blastRadius.avgblastradius = static_cast<double>(bs_device_num) / BsDevices().BsNum();
+    blastRadius.maxblastradius = maxblastradius;
+    result.blastRadius = blastRadius;
+    return result;
+}
+
+ReturnRwSegStat SegmentSnapshot::MergeRwSegment(int r_sort_flag, int w_sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model){
+    ScoringModel scoring = model != nullptr ? *model : scoring_model();
+    ReturnRwSegStat result;
+    RankOrder write, read;
+    int16_t maxblastradius;
+    if (top_k > 0 || traffic_floor > 0){
+        maxblastradius = RankSegmentsTopK(&write, w_sort_flag, &read, r_sort_flag, scoring, top_k, traffic_floor);
+        build_ranked_entries(mBsIps, write, read, mRecords.size(), [this](size_t, uint32_t i){ return make_segment_summary(mRecords[i]); }, result.segments);
+    }
+    else{
+        maxblastradius = RankSegments(write, true, w_sort_flag, scoring);
+        // the read lists used to be sorted from a copy of the write ones
+        RankSegments(read, false, r_sort_flag, scoring, &write);
+        const auto& bsSegments = BsSegments();
+        build_ranked_entries(mBsIps, write, read, mRecords.size(), [&](size_t bs, uint32_t i){ return bsSegments[bs][i - write.start[bs]]; }, result.segments);
+    }
+    result.bs_flow = BsFlow();
+    BlastRadius blastRadius;
+    blastRadius.avgblastradius = static_cast<double>(result.segments.bs.size()) / maxblastradius;
+    blastRadius.maxblastradius = maxblastradius;
+    result.blastRadius = blastRadius;
+    return result;
+}
+
+ReturnRwSegScoreStat SegmentSnapshot::MergeScoreRwSegment(int r_sort_flag, int w_sort_flag, double w1, size_t top_k, const ScoringModel* model){
+    double w_traffic = model != nullptr ? model->traffic_weight : scoring_model().traffic_weight;
+    SortType wsortType = static_cast<SortType>(w_sort_flag);
+    assert ((r_sort_flag == w_sort_flag) && (wsortType == SortType::TrafficScore || wsortType == SortType::TrafficStdScore));
+    assert (w1 >= 0.5);
+    ReturnRwSegScoreStat result;
+    const auto& bsSegments = BsSegments();
+    std::vector<SegmentScoreSummary> scored;
+    std::vector<uint32_t> start(1, 0);
+    {
+        PhaseTimer timer(MergePhase::Result);
+        scored.reserve(mRecords.size());
+        for (size_t bs = 0; bs < bsSegments.size(); ++bs) {
+            auto& bsScore = result.bs_score_flow[mBsIps[bs]];
+            static_cast<BsSumState&>(bsScore) = mBsState[bs];
+            for (const auto& seg : bsSegments[bs]) {
+                bsScore.AddScore(w_sort_flag, w1, seg.traffic.read_urgent_sum, seg.traffic.write_urgent_sum, seg.traffic_std.read_urgent_std, seg.traffic_std.write_urgent_std, seg.latency.read_urgent_sum, seg.latency.write_urgent_sum, seg.iops.read_urgent_sum, seg.iops.write_urgent_sum);
+                auto read_score = calculate_segment_score(seg.traffic.read_urgent_sum, seg.traffic_std.read_urgent_std, seg.latency.read_urgent_sum, seg.iops.read_urgent_sum, wsortType, w_traffic);
+                auto write_score = calculate_segment_score(seg.traffic.write_urgent_sum, seg.traffic_std.write_urgent_std, seg.latency.write_urgent_sum, seg.iops.write_urgent_sum, wsortType, w_traffic);
+                scored.emplace_back(seg.segmentId, seg.traffic, seg.latency, seg.iops, seg.traffic_std, read_score, write_score);
+            }
+            start.push_back(scored.size());
+        }
+        // calculate_bs_score(result.bs_score_flow, w1);
+    }
+    RankOrder write, read;
+    int16_t maxblastradius = rank_segment_scores(scored, start, "write", top_k, write);
+    rank_segment_scores(scored, start, "read", top_k, read);
+    build_ranked_entries(mBsIps, write, read, scored.size(), [&scored](size_t, uint32_t i){ return scored[i]; }, result.segments);
+    BlastRadius blastRadius;
+    blastRadius.avgblastradius = static_cast<double>(result.segments.bs.size()) / maxblastradius;
+    blastRadius.maxblastradius = maxblastradius;
+    result.blastRadius = blastRadius;
+    return result;
+}
+
+ReturnRwDevStat SegmentSnapshot::MergeRwDevice(int r_sort_flag, int w_sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model){
+    ScoringModel scoring = model != nullptr ? *model : scoring_model();
+    ReturnRwDevStat result;
+    int bs_device_num = 0;
+    RankOrder write, read;
+    int16_t maxblastradius = RankDevices(write, bs_device_num, "write", w_sort_flag, scoring, top_k, traffic_floor);
+    double avgblastradius = static_cast<double>(bs_device_num) / BsDevices().BsNum();
+    bs_device_num = 0;
+    RankDevices(read, bs_device_num, "read", r_sort_flag, scoring, top_k, traffic_floor);
+    const auto& table = BsDevices();
+    build_ranked_entries(mBsIps, write, read, table.devices.size(), [&table](size_t, uint32_t d){ return table.Summary(d); }, result.devices);
+    result.bs_flow = BsFlow();
+    BlastRadius blastRadius;
+    blastRadius.avgblastradius = avgblastradius;
+    blastRadius.maxblastradius = maxblastradius;
+    result.blastRadius = blastRadius;
+    return result;
+}
+
+std::shared_ptr<SegmentSnapshot> take_snapshot(int max_age_ms, bool incremental){
+    auto view = std::atomic_load(&samplerView);
+    if (view) {
+        return view->snapshot;
+    }
+    std::lock_guard<std::mutex> lock(lastSnapshotMutex);
+    auto now = std::chrono::steady_clock::now();
+    if (max_age_ms > 0 && lastSnapshot && now - lastSnapshot->LoadTime() <= std::chrono::milliseconds(max_age_ms)){
+        return lastSnapshot;
+    }
+    lastSnapshot = SegmentSnapshot::Load(segIostatsPaths, incremental ? lastSnapshot : nullptr);
+    return lastSnapshot;
+}
+
+void set_stat_path(const std::string& path){
+    set_stat_paths(std::vector<std::string>(1, path));
+}
+
+void set_stat_paths(const std::vector<std::string>& paths){
+    if (paths.empty()) {
+        std::cerr << "No segment stat table to read" << std::endl;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(lastSnapshotMutex);
+    if (paths != segIostatsPaths) {
+        segIostatsPaths = paths;
+        lastSnapshot.reset();
+    }
+}
+
+SampledTraffic SamplerView::Segment(const SegmentId& id) const{
+    const auto& index = snapshot->SegmentIndex();
+    auto it = index.find(id);
+    if (it == index.end()) {
+        return SampledTraffic();
+    }
+    return segments[it->second];
+}
+
+SnapshotSampler::SnapshotSampler(int interval_ms, double alpha, bool incremental) : mIntervalMs(std::max(interval_ms, 1)), mAlpha(alpha), mIncremental(incremental), mSequence(0), mResetPeaks(false), mStop(false) {
+    // set from SAMPLER_ALPHA through start_sampler: raises ValueError there
+    if (!(alpha > 0 && alpha <= 1)) {
+        std::ostringstream ss;
+        ss << "Invalid sampler alpha: " << alpha;
+        throw std::invalid_argument(ss.str());
+    }
+    mThread = std::thread(&SnapshotSampler::Run, this);
+}
+
+void SnapshotSampler::Run(){
+    std::unique_lock<std::mutex> lock(mStopMutex);
+    while (!mStop) {
+        auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(mIntervalMs);
+        lock.unlock();
+        Poll();
+        lock.lock();
+        mStopCv.wait_until(lock, next, [this](){ return mStop; });
+    }
+}
+
+void SnapshotSampler::Update(SampledTraffic& stat, uint64_t read, uint64_t write, bool fresh, bool reset_peaks) const{
+    stat.read = read;
+    stat.write = write;
+    stat.readEwma = fresh ? read : mAlpha * read + (1 - mAlpha) * stat.readEwma;
+    stat.writeEwma = fresh ? write : mAlpha * write + (1 - mAlpha) * stat.writeEwma;
+    stat.readPeak = fresh || reset_peaks ? read : std::max(stat.readPeak, read);
+    stat.writePeak = fresh || reset_peaks ? write : std::max(stat.writePeak, write);
+}
+
+// Keeps only the slots of this poll's records, and the BSs it has.
+void SnapshotSampler::DropDeadSlots(const std::vector<std::string>& bsIps){
+    const uint32_t dead = 0xffffffff;
+    std::vector<uint32_t> remap(mSegmentStat.size(), dead);
+    std::vector<SampledTraffic> segmentStat;
+    for (uint32_t& slot : mRecordSlot) {
+        if (remap[slot] == dead) {
+            remap[slot] = segmentStat.size();
+            segmentStat.push_back(mSegmentStat[slot]);
+        }
+        slot = remap[slot];
+    }
+    std::unordered_map<SegmentId, uint32_t, SegmentIdHash> slots;
+    slots.reserve(segmentStat.size());
+    for (const auto& entry : mSlots) {
+        if (remap[entry.second] != dead) {
+            slots.emplace(entry.first, remap[entry.second]);
+        }
+    }
+    mSlots.swap(slots);
+    mSegmentStat.swap(segmentStat);
+    std::map<std::string, SampledTraffic> bsStat;
+    for (const auto& bsIp : bsIps) {
+        auto it = mBsStat.find(bsIp);
+        if (it != mBsStat.end()) {
+            bsStat.insert(*it);
+        }
+    }
+    mBsStat.swap(bsStat);
+}
+
+void SnapshotSampler::Poll(){
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> lock(lastSnapshotMutex);
+        paths = segIostatsPaths;
+    }
+    auto snap = SegmentSnapshot::Load(paths, mIncremental ? mPrev : nullptr);
+    // everything readers look up is built here, before the view is shared
+    const auto& bsState = snap->BsState();
+    const auto& bsIps = snap->BsIps();
+    snap->SegmentIndex();
+    bool reset_peaks = mResetPeaks.exchange(false);
+
+    // records mostly keep their slot in the table, so only look up the ones
+    // whose segment differs from the last poll's record at the same index
+    const auto& records = snap->Records();
+    const std::vector<SegmentShmIoStat>* prevRecords = mPrev ? &mPrev->Records() : nullptr;
+    std::vector<uint32_t> recordSlot(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        const auto& e = records[i];
+        bool fresh = false;
+        uint32_t slot;
+        if (prevRecords != nullptr && i < prevRecords->size() && (*prevRecords)[i].segmentId == e.segmentId) {
+            slot = mRecordSlot[i];
+        }
+        else {
+            auto inserted = mSlots.emplace(e.segmentId, mSegmentStat.size());
+            slot = inserted.first->second;
+            if (inserted.second) {
+                mSegmentStat.emplace_back();
+                fresh = true;
+            }
+        }
+        recordSlot[i] = slot;
+        Update(mSegmentStat[slot], e.urgent_flow.readBytes, e.urgent_flow.writeBytes, fresh, reset_peaks);
+    }
+    mRecordSlot.swap(recordSlot);
+    // deleted and recreated segments leave their slots behind; at most
+    // records.size() are live, so past twice that most of them are dead
+    if (mSegmentStat.size() > 2 * records.size()) {
+        DropDeadSlots(bsIps);
+    }
+    for (size_t bs = 0; bs < bsIps.size(); ++bs) {
+        auto inserted = mBsStat.emplace(bsIps[bs], SampledTraffic());
+        Update(inserted.first->second, bsState[bs].mTrafficSum.read_urgent_sum, bsState[bs].mTrafficSum.write_urgent_sum, inserted.second, reset_peaks);
+    }
+
+    std::shared_ptr<SamplerView> view;
+    if (mSpare && mSpare.use_count() == 1) {
+        // use_count() is a relaxed load: order the refill after the last
+        // reader's release of the view
+        std::atomic_thread_fence(std::memory_order_acquire);
+        view.swap(mSpare);
+    }
+    else {
+        view = std::make_shared<SamplerView>();
+    }
+    view->snapshot = snap;
+    view->sequence = ++mSequence;
+    view->sampleTime = snap->LoadTime();
+    view->segments.resize(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        view->segments[i] = mSegmentStat[mRecordSlot[i]];
+    }
+    view->bs.clear();
+    for (const auto& bsIp : bsIps) {
+        view->bs.emplace(bsIp, mBsStat[bsIp]);
+    }
+    mSpare = std::atomic_exchange(&samplerView, view);
+    mPrev = snap;
+}
+
+void start_sampler(int interval_ms, double alpha, bool incremental){
+    std::lock_guard<std::mutex> lock(samplerMutex);
+    sampler.reset();
+    std::atomic_store(&samplerView, std::shared_ptr<SamplerView>());
+    sampler.reset(new SnapshotSampler(interval_ms, alpha, incremental));
+}
+
+void stop_sampler(){
+    std::lock_guard<std::mutex> lock(samplerMutex);
+    sampler.reset();
+    std::atomic_store(&samplerView, std::shared_ptr<SamplerView>());
+}
+
+std::shared_ptr<SamplerView> sampler_view(bool reset_peaks){
+    if (reset_peaks) {
+        std::lock_guard<std::mutex> lock(samplerMutex);
+        if (sampler) {
+            sampler->ResetPeaks();
+        }
+    }
+    return std::atomic_load(&samplerView);
+}
+
+LatencySketch::LatencySketch(double accuracy, size_t bins) : mAccuracy(accuracy), mMinKey(0), mZero(0), mCount(0), mCounts(bins){
+    // reachable from Python: a bad argument raises ValueError there
+    if (!(accuracy >= 0.001 && accuracy < 1) || bins == 0) {
+        std::ostringstream ss;
+        ss << "Invalid latency sketch: accuracy " << accuracy << ", bins " << bins;
+        throw std::invalid_argument(ss.str());
+    }
+    mGamma = (1 + accuracy) / (1 - accuracy);
+    mLogGamma = std::log(mGamma);
+}
+
+int32_t LatencySketch::Key(uint64_t value) const{
+    return value == 0 ? ZERO_KEY : static_cast<int32_t>(std::ceil(std::log(static_cast<double>(value)) / mLogGamma));
+}
+
+double LatencySketch::Value(int32_t key) const{
+    // within relative error accuracy of every value in the bucket
+    return 2 * std::pow(mGamma, key) / (mGamma + 1);
+}
+
+void LatencySketch::Slide(int32_t key){
+    size_t bins = mCounts.size();
+    size_t shift = static_cast<size_t>(key - (mMinKey + static_cast<int32_t>(bins) - 1));
+    uint64_t collapsed = 0;
+    for (size_t i = 0; i <= std::min(shift, bins - 1); ++i) {
+        collapsed += mCounts[i];
+    }
+    if (shift < bins) {
+        std::copy(mCounts.begin() + shift + 1, mCounts.end(), mCounts.begin() + 1);
+        std::fill(mCounts.end() - shift, mCounts.end(), 0);
+    }
+    else {
+        std::fill(mCounts.begin(), mCounts.end(), 0);
+    }
+    mCounts[0] = collapsed;
+    mMinKey = key - static_cast<int32_t>(bins) + 1;
+}
+
+void LatencySketch::AddBucket(int32_t key, uint64_t n){
+    if (key >= mMinKey + static_cast<int32_t>(mCounts.size())) {
+        Slide(key);
+    }
+    mCounts[key > mMinKey ? key - mMinKey : 0] += n;
+    mCount += n;
+}
+
+void LatencySketch::AddKey(int32_t key, uint64_t n){
+    if (key == ZERO_KEY) {
+        mZero += n;
+        mCount += n;
+        return;
+    }
+    if (mCount == mZero) {
+        // the window is empty: centre it on the first value
+        std::fill(mCounts.begin(), mCounts.end(), 0);
+        mMinKey = key - static_cast<int32_t>(mCounts.size() / 2);
+    }
+    AddBucket(key, n);
+}
+
+void LatencySketch::RemoveKey(int32_t key, uint64_t n){
+    if (key == ZERO_KEY) {
+        n = std::min(n, mZero);
+        mZero -= n;
+        mCount -= n;
+        return;
+    }
+    // the window only slid up since the value was added, so it is still in
+    // its own bucket or was collapsed into the lowest one
+    uint64_t& count = mCounts[key > mMinKey ? key - mMinKey : 0];
+    n = std::min(n, count);
+    count -= n;
+    mCount -= n;
+}
+
+bool LatencySketch::Merge(const LatencySketch& other){
+    if (other.mGamma != mGamma) {
+        std::cerr << "Cannot merge latency sketches of accuracy " << mAccuracy << " and " << other.mAccuracy << std::endl;
+        return false;
+    }
+    if (&other == this) {
+        LatencySketch copy(other);
+        return Merge(copy);
+    }
+    mZero += other.mZero;
+    mCount += other.mZero;
+    if (other.mCount == other.mZero) {
+        return true;
+    }
+    int32_t low = 0, high = 0;
+    bool found = false;
+    for (size_t i = 0; i < other.mCounts.size(); ++i) {
+        if (other.mCounts[i] > 0) {
+            high = other.mMinKey + static_cast<int32_t>(i);
+            low = found ? low : high;
+            found = true;
+        }
+    }
+    if (mCount == mZero) {
+        // start where the other's lowest bucket is, unless its top would not fit
+        std::fill(mCounts.begin(), mCounts.end(), 0);
+        mMinKey = std::max(low, high - static_cast<int32_t>(mCounts.size()) + 1);
+    }
+    // highest first, so the window slides at most once
+    for (size_t i = other.mCounts.size(); i-- > 0;) {
+        if (other.mCounts[i] > 0) {
+            AddBucket(other.mMinKey + static_cast<int32_t>(i), other.mCounts[i]);
+        }
+    }
+    return true;
+}
+
+void LatencySketch::Clear(){
+    std::fill(mCounts.begin(), mCounts.end(), 0);
+    mMinKey = 0;
+    mZero = 0;
+    mCount = 0;
+}
+
+double LatencySketch::Percentile(double q) const{
+    if (mCount == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::max(0.0, std::min(100.0, q)) / 100 * (mCount - 1));
+    if (rank < mZero) {
+        return 0;
+    }
+    uint64_t seen = mZero;
+    for (size_t i = 0; i < mCounts.size(); ++i) {
+        seen += mCounts[i];
+        if (rank < seen) {
+            return Value(mMinKey + static_cast<int32_t>(i));
+        }
+    }
+    return Value(mMinKey + static_cast<int32_t>(mCounts.size()) - 1);
+}
+
+uint32_t SegmentLatencyStore::InternBs(uint64_t bsId){
+    auto it = mBsIndex.find(bsId);
+    if (it != mBsIndex.end()) {
+        return it->second;
+    }
+    uint32_t bs = mBsIps.size();
+    mBsIndex.emplace(bsId, bs);
+    mBsIps.emplace_back(bs_ip_transform(bsId));
+    mBsStat.emplace_back();
+    mBsRead.push_back(mSketch);
+    mBsWrite.push_back(mSketch);
+    return bs;
+}
+
+void SegmentLatencyStore::Push(uint32_t slot, const LatencySample& sample){
+    Ring& ring = mRings[slot];
+    LatencySample& cell = mSamples[slot * mCapacity + ring.head];
+    if (ring.size == mCapacity) {
+        // evict the oldest sample from every sum it was counted in
+        LatencyWindowStat& bs = mBsStat[cell.bs];
+        bs.count--;
+        bs.readSum -= cell.read;
+        bs.writeSum -= cell.write;
+        ring.stat.count--;
+        ring.stat.readSum -= cell.read;
+        ring.stat.writeSum -= cell.write;
+        mCluster.count--;
+        mCluster.readSum -= cell.read;
+        mCluster.writeSum -= cell.write;
+        mBsRead[cell.bs].RemoveKey(cell.readKey);
+        mBsWrite[cell.bs].RemoveKey(cell.writeKey);
+        mClusterRead.RemoveKey(cell.readKey);
+        mClusterWrite.RemoveKey(cell.writeKey);
+    } else {
+        ring.size++;
+    }
+    cell = sample;
+    ring.head = (ring.head + 1) % mCapacity;
+    LatencyWindowStat& bs = mBsStat[sample.bs];
+    bs.count++;
+    bs.readSum += sample.read;
+    bs.writeSum += sample.write;
+    ring.stat.count++;
+    ring.stat.readSum += sample.read;
+    ring.stat.writeSum += sample.write;
+    mCluster.count++;
+    mCluster.readSum += sample.read;
+    mCluster.writeSum += sample.write;
+    mBsRead[sample.bs].AddKey(sample.readKey);
+    mBsWrite[sample.bs].AddKey(sample.writeKey);
+    mClusterRead.AddKey(sample.readKey);
+    mClusterWrite.AddKey(sample.writeKey);
+    if (ring.size == mCapacity) {
+        mFull = true;
+    }
+}
+
+void SegmentLatencyStore::Append(const SegmentSnapshot& snapshot){
+    for (const auto& e : snapshot.Records()) {
+        // look up before emplacing, which would allocate a node every time
+        auto it = mIndex.find(e.segmentId);
+        if (it == mIndex.end()) {
+            it = mIndex.emplace(e.segmentId, mRings.size()).first;
+            mRings.emplace_back(Ring{0, 0, LatencyWindowStat()});
+            mSamples.resize(mRings.size() * mCapacity);
+        }
+        const LatencyStat& latency = mWindow == RankWindow::Urgent ? e.urgent_latency : mWindow == RankWindow::Instant ? e.instant_latency : e.longterm_latency;
+        LatencySample sample;
+        sample.read = latency.readLatency;
+        sample.write = latency.writeLatency;
+        sample.bs = InternBs(e.bsId);
+        sample.readKey = static_cast<int16_t>(mSketch.Key(sample.read));
+        sample.writeKey = static_cast<int16_t>(mSketch.Key(sample.write));
+        Push(it->second, sample);
+    }
+}
+
+void SegmentLatencyStore::Reset(){
+    mIndex.clear();
+    mRings.clear();
+    mSamples.clear();
+    std::fill(mBsStat.begin(), mBsStat.end(), LatencyWindowStat());
+    std::fill(mBsRead.begin(), mBsRead.end(), mSketch);
+    std::fill(mBsWrite.begin(), mBsWrite.end(), mSketch);
+    mCluster = LatencyWindowStat();
+    mClusterRead = mSketch;
+    mClusterWrite = mSketch;
+    mFull = false;
+}
+
+LatencyWindowStat SegmentLatencyStore::Segment(const SegmentId& id) const {
+    auto it = mIndex.find(id);
+    return it == mIndex.end() ? LatencyWindowStat() : mRings[it->second].stat;
+}
+
+std::map<std::string, LatencyWindowStat> SegmentLatencyStore::Bs() const {
+    std::map<std::string, LatencyWindowStat> result;
+    for (size_t bs = 0; bs < mBsIps.size(); ++bs) {
+        if (mBsStat[bs].count) {
+            result[mBsIps[bs]] = mBsStat[bs];
+        }
+    }
+    return result;
+}
+
+double window_percentile(std::vector<uint64_t>& values, double q){
+    if (values.empty()) {
+        return 0;
+    }
+    double pos = std::max(0.0, std::min(100.0, q)) / 100 * (values.size() - 1);
+    size_t lo = static_cast<size_t>(pos);
+    std::nth_element(values.begin(), values.begin() + lo, values.end());
+    double low = values[lo];
+    if (lo + 1 >= values.size()) {
+        return low;
+    }
+    double high = *std::min_element(values.begin() + lo + 1, values.end());
+    return low + (high - low) * (pos - lo);
+}
+
+double SegmentLatencyStore::SegmentPercentile(const SegmentId& id, double q, bool read) const {
+    std::vector<uint64_t> values;
+    auto it = mIndex.find(id);
+    if (it != mIndex.end()) {
+        const LatencySample* ring = &mSamples[it->second * mCapacity];
+        for (uint32_t i = 0; i < mRings[it->second].size; ++i) {
+            values.push_back(read ? ring[i].read : ring[i].write);
+        }
+    }
+    return window_percentile(values, q);
+}
+
+LatencySketch SegmentLatencyStore::SegmentSketch(const SegmentId& id, bool read) const {
+    LatencySketch sketch(mSketch);
+    auto it = mIndex.find(id);
+    if (it != mIndex.end()) {
+        const LatencySample* ring = &mSamples[it->second * mCapacity];
+        for (uint32_t i = 0; i < mRings[it->second].size; ++i) {
+            sketch.Add(read ? ring[i].read : ring[i].write);
+        }
+    }
+    return sketch;
+}
+
+std::map<std::string, LatencySketch> SegmentLatencyStore::BsSketch(bool read) const {
+    std::map<std::string, LatencySketch> result;
+    for (size_t bs = 0; bs < mBsIps.size(); ++bs) {
+        if (mBsStat[bs].count) {
+            result.emplace(mBsIps[bs], read ? mBsRead[bs] : mBsWrite[bs]);
+        }
+    }
+    return result;
+}
+
+double SegmentLatencyStore::ClusterPercentile(double q, bool read) const {
+    std::vector<uint64_t> values;
+    values.reserve(mCluster.count);
+    for (size_t slot = 0; slot < mRings.size(); ++slot) {
+        const LatencySample* ring = &mSamples[slot * mCapacity];
+        for (uint32_t i = 0; i < mRings[slot].size; ++i) {
+            values.push_back(read ? ring[i].read : ring[i].write);
+        }
+    }
+    return window_percentile(values, q);
+}
+
+// urgent at least the floor and above the baseline by z std or ratio times
+bool hotspot_test(uint64_t urgent, uint64_t baseline, double std, uint64_t floor, const HotspotConfig& config){
+    if (urgent < floor || urgent <= baseline) {
+        return false;
+    }
+    double excess = static_cast<double>(urgent - baseline);
+    return (config.zThreshold > 0 && excess >= config.zThreshold * std::max(std, 1.0))
+        || (config.ratioThreshold > 0 && urgent >= config.ratioThreshold * baseline);
+}
+
+// Fills the windows and scores of h for one direction and returns whether it is hot.
+bool hotspot_score(Hotspot& h, uint64_t urgent, uint64_t instant, uint64_t longterm, double std, uint64_t floor, const HotspotConfig& config){
+    if (!hotspot_test(urgent, longterm, std, floor, config)) {
+        return false;
+    }
+    h.urgent = urgent;
+    h.instant = instant;
+    h.longterm = longterm;
+    h.z = (static_cast<double>(urgent) - longterm) / std::max(std, 1.0);
+    h.ratio = static_cast<double>(urgent) / std::max<uint64_t>(longterm, 1);
+    h.sustained = hotspot_test(instant, longterm, std, floor, config);
+    return true;
+}
+
+// Indices of the top_k with the most traffic above the baseline, largest first.
+std::vector<uint32_t> rank_hotspots(const std::vector<Hotspot>& hotspots, size_t top_k){
+    auto cmp = [&hotspots](uint32_t i, uint32_t j){
+        const Hotspot& a = hotspots[i];
+        const Hotspot& b = hotspots[j];
+        uint64_t ea = a.urgent - a.longterm, eb = b.urgent - b.longterm;
+        if (ea != eb) {
+            return ea > eb;
+        }
+        if (a.segmentId.device_id != b.segmentId.device_id) {
+            return a.segmentId.device_id < b.segmentId.device_id;
+        }
+        if (a.segmentId.segmentIdx != b.segmentId.segmentIdx) {
+            return a.segmentId.segmentIdx < b.segmentId.segmentIdx;
+        }
+        return a.bs != b.bs ? a.bs < b.bs : a.read > b.read;
+    };
+    std::vector<uint32_t> order(hotspots.size());
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    if (top_k > 0 && top_k < order.size()) {
+        std::partial_sort(order.begin(), order.begin() + top_k, order.end(), cmp);
+        order.resize(top_k);
+    }
+    else {
+        std::sort(order.begin(), order.end(), cmp);
+    }
+    return order;
+}
+
+inline uint64_t window_traffic(int64_t bytes){
+    return static_cast<uint64_t>(std::max<int64_t>(bytes, 0));
+}
+
+HotspotReport HotspotDetector::Update(SegmentSnapshot& snapshot){
+    const auto& records = snapshot.Records();
+    const auto& recordBs = snapshot.RecordBs();
+    const auto& bsState = snapshot.BsState();
+    const auto& bsIps = snapshot.BsIps();
+    std::lock_guard<std::mutex> lock(mMutex);
+    PhaseTimer timer(MergePhase::Detect);
+    HotspotReport report;
+    report.sequence = ++mSequence;
+    size_t bs_num = bsIps.size();
+    size_t workers = std::min<size_t>(std::max(mergeThreads.load(), 1), records.size() / MIN_RECORDS_PER_WORKER);
+    workers = std::max<size_t>(workers, 1);
+    // per worker: the hot directions of its records with their BS, whose IP
+    // is only copied for the ranked ones, and the longterm variance of each
+    // BS and direction summed over its records
+    std::vector<std::vector<Hotspot>> found(workers);
+    std::vector<std::vector<uint32_t>> foundBs(workers);
+    std::vector<std::vector<double>> variance(workers, std::vector<double>(bs_num * 2));
+    parallel_for(workers, records.size(), [&](size_t w, size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) {
+            const SegmentShmIoStat& e = records[i];
+            uint32_t bs = recordBs[i];
+            variance[w][bs * 2] += e.longterm_flow_std.writeStd * e.longterm_flow_std.writeStd;
+            variance[w][bs * 2 + 1] += e.longterm_flow_std.readStd * e.longterm_flow_std.readStd;
+            Hotspot h;
+            h.segmentId = e.segmentId;
+            h.ticks = 0;
+            h.read = false;
+            if (hotspot_score(h, window_traffic(e.urgent_flow.writeBytes), window_traffic(e.instant_flow.writeBytes), window_traffic(e.longterm_flow.writeBytes), e.longterm_flow_std.writeStd, mConfig.minTraffic, mConfig)) {
+                found[w].push_back(h);
+                foundBs[w].push_back(bs);
+            }
+            h.read = true;
+            if (hotspot_score(h, window_traffic(e.urgent_flow.readBytes), window_traffic(e.instant_flow.readBytes), window_traffic(e.longterm_flow.readBytes), e.longterm_flow_std.readStd, mConfig.minTraffic, mConfig)) {
+                found[w].push_back(h);
+                foundBs[w].push_back(bs);
+            }
+        }
+    });
+
+    // every flagged segment carries its streak on, ranked or not
+    std::vector<Hotspot> hot;
+    std::vector<uint32_t> hotBs;
+    std::unordered_map<SegmentId, uint32_t, SegmentIdHash> segmentTicks[2];
+    for (size_t w = 0; w < workers; ++w) {
+        for (auto& h : found[w]) {
+            auto it = mSegmentTicks[h.read].find(h.segmentId);
+            h.ticks = it == mSegmentTicks[h.read].end() ? 1 : it->second + 1;
+            segmentTicks[h.read].emplace(h.segmentId, h.ticks);
+        }
+        hot.insert(hot.end(), found[w].begin(), found[w].end());
+        hotBs.insert(hotBs.end(), foundBs[w].begin(), foundBs[w].end());
+    }
+    mSegmentTicks[0].swap(segmentTicks[0]);
+    mSegmentTicks[1].swap(segmentTicks[1]);
+    for (uint32_t i : rank_hotspots(hot, mConfig.topK)) {
+        report.segments.push_back(hot[i]);
+        report.segments.back().bs = bsIps[hotBs[i]];
+    }
+
+    std::vector<Hotspot> hotBsList;
+    std::map<std::string, uint32_t> bsTicks[2];
+    SegmentId none;
+    memset(&none, 0, sizeof(none));
+    for (size_t bs = 0; bs < bs_num; ++bs) {
+        double var[2] = {0, 0};
+        for (size_t w = 0; w < workers; ++w) {
+            var[0] += variance[w][bs * 2];
+            var[1] += variance[w][bs * 2 + 1];
+        }
+        const SumTraffic& t = bsState[bs].mTrafficSum;
+        for (int read = 0; read < 2; ++read) {
+            Hotspot h;
+            h.segmentId = none;
+            h.bs = bsIps[bs];
+            h.read = read;
+            bool hot = read ? hotspot_score(h, t.read_urgent_sum, t.read_instant_sum, t.read_longterm_sum, std::sqrt(var[1]), mConfig.minBsTraffic, mConfig)
+                            : hotspot_score(h, t.write_urgent_sum, t.write_instant_sum, t.write_longterm_sum, std::sqrt(var[0]), mConfig.minBsTraffic, mConfig);
+            if (!hot) {
+                continue;
+            }
+            auto it = mBsTicks[read].find(h.bs);
+            h.ticks = it == mBsTicks[read].end() ? 1 : it->second + 1;
+            bsTicks[read].emplace(h.bs, h.ticks);
+            hotBsList.push_back(std::move(h));
+        }
+    }
+    mBsTicks[0].swap(bsTicks[0]);
+    mBsTicks[1].swap(bsTicks[1]);
+
+    for (uint32_t i : rank_hotspots(hotBsList, mConfig.topK)) {
+        report.bs.push_back(hotBsList[i]);
+    }
+    return report;
+}
+
+HotspotConfig HotspotDetector::Config(){
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mConfig;
+}
+
+void HotspotDetector::SetConfig(const HotspotConfig& config){
+    std::lock_guard<std::mutex> lock(mMutex);
+    mConfig = config;
+}
+
+void put_varint(std::string& out, uint64_t v){
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+bool get_varint(const char*& p, const char* end, uint64_t& v){
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*p++);
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint64_t record_word(const SegmentShmIoStat& e, size_t w){
+    uint64_t v;
+    memcpy(&v, reinterpret_cast<const char*>(&e) + w * sizeof(uint64_t), sizeof(v));
+    return v;
+}
+
+// Appends the payload of a SnapshotLogFrame for records against prev, and
+// returns how many records it lists.
+uint32_t encode_log_tick(const std::vector<SegmentShmIoStat>& prev, const std::vector<SegmentShmIoStat>& records, std::string& out){
+    const size_t words = sizeof(SegmentShmIoStat) / sizeof(uint64_t);
+    std::vector<uint32_t> changed;
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (i >= prev.size() || memcmp(&prev[i], &records[i], sizeof(SegmentShmIoStat)) != 0) {
+            put_varint(out, changed.empty() ? i : i - changed.back() - 1);
+            changed.push_back(i);
+        }
+    }
+    for (size_t w = 0; w < words; ++w) {
+        for (uint32_t i : changed) {
+            put_varint(out, record_word(records[i], w) ^ (i < prev.size() ? record_word(prev[i], w) : 0));
+        }
+    }
+    return changed.size();
+}
+
+bool decode_log_tick(const char* p, const char* end, const SnapshotLogFrame& frame, std::vector<SegmentShmIoStat>& records){
+    const size_t words = sizeof(SegmentShmIoStat) / sizeof(uint64_t);
+    if (frame.keyframe) {
+        records.clear();
+    }
+    size_t old = records.size();
+    records.resize(frame.recordNum);
+    if (records.size() > old) {
+        memset(static_cast<void*>(&records[old]), 0, (records.size() - old) * sizeof(SegmentShmIoStat));
+    }
+    std::vector<uint32_t> changed(frame.changedNum);
+    uint64_t v;
+    for (uint32_t j = 0; j < frame.changedNum; ++j) {
+        if (!get_varint(p, end, v)) {
+            return false;
+        }
+        uint64_t i = j == 0 ? v : changed[j - 1] + v + 1;
+        if (i >= frame.recordNum) {
+            return false;
+        }
+        changed[j] = i;
+    }
+    for (size_t w = 0; w < words; ++w) {
+        for (uint32_t i : changed) {
+            if (!get_varint(p, end, v)) {
+                return false;
+            }
+            char* word = reinterpret_cast<char*>(&records[i]) + w * sizeof(uint64_t);
+            v ^= record_word(records[i], w);
+            memcpy(word, &v, sizeof(v));
+        }
+    }
+    return p == end;
+}
+
+// Chunk files of a snapshot log directory, oldest first.
+std::vector<std::string> list_log_chunks(const std::string& dir){
+    std::vector<std::string> chunks;
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return chunks;
+    }
+    const std::string prefix = "seg_iostats.", suffix = ".log";
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > prefix.size() + suffix.size() && name.compare(0, prefix.size(), prefix) == 0 && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            chunks.push_back(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    // zero-padded timestamps sort lexicographically
+    std::sort(chunks.begin(), chunks.end());
+    return chunks;
+}
+
+SnapshotRecorder::SnapshotRecorder(const std::string& dir, uint64_t max_bytes, uint64_t chunk_bytes, uint32_t keyframe_interval) : mDir(dir), mMaxBytes(max_bytes), mChunkBytes(chunk_bytes), mKeyframeInterval(std::max<uint32_t>(keyframe_interval, 1)), mFd(-1), mChunkSize(0), mSinceKeyframe(0), mTickNum(0), mLastTimestampUs(0), mBytes(0) {
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        std::cerr << "Failed to create snapshot log directory: " << dir << std::endl;
+    }
+    // earlier runs' chunks count against the budget too
+    for (const auto& path : list_log_chunks(dir)) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            mChunks.emplace_back(path, st.st_size);
+            mBytes += st.st_size;
+        }
+    }
+}
+
+SnapshotRecorder::~SnapshotRecorder(){
+    if (mFd != -1) {
+        close(mFd);
+    }
+}
+
+uint64_t SnapshotRecorder::TickNum(){
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTickNum;
+}
+
+uint64_t SnapshotRecorder::Bytes(){
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytes;
+}
+
+bool SnapshotRecorder::OpenChunk(int64_t timestamp_us){
+    if (mFd != -1) {
+        close(mFd);
+        mFd = -1;
+    }
+    for (int64_t name_us = timestamp_us; mFd == -1; ++name_us) {
+        char name[64];
+        snprintf(name, sizeof(name), "/seg_iostats.%020lld.log", static_cast<long long>(name_us));
+        std::string path = mDir + name;
+        mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+        if (mFd == -1 && errno != EEXIST) {
+            std::cerr << "Failed to create snapshot log chunk: " << path << std::endl;
+            return false;
+        }
+        if (mFd != -1) {
+            mChunks.emplace_back(path, 0);
+        }
+    }
+    mChunkSize = 0;
+    mSinceKeyframe = 0;
+    return true;
+}
+
+void SnapshotRecorder::Trim(){
+    // the open chunk is never deleted
+    size_t drop = 0;
+    while (mBytes > mMaxBytes && drop + 1 < mChunks.size()) {
+        unlink(mChunks[drop].first.c_str());
+        mBytes -= mChunks[drop].second;
+        drop++;
+    }
+    mChunks.erase(mChunks.begin(), mChunks.begin() + drop);
+}
+
+bool SnapshotRecorder::Append(const SegmentSnapshot& snapshot, int64_t timestamp_us){
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (timestamp_us == 0) {
+        timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    // the reader binary searches the timestamps
+    timestamp_us = std::max(timestamp_us, mLastTimestampUs);
+    if (mFd == -1 || mChunkSize >= mChunkBytes) {
+        if (!OpenChunk(timestamp_us)) {
+            return false;
+        }
+    }
+    const auto& records = snapshot.Records();
+    bool keyframe = mSinceKeyframe == 0 || mSinceKeyframe >= mKeyframeInterval;
+    SnapshotLogFrame frame;
+    frame.magic = SNAPSHOT_LOG_MAGIC;
+    frame.timestampUs = timestamp_us;
+    frame.recordNum = records.size();
+    frame.keyframe = keyframe;
+    mBuf.assign(sizeof(frame), '\0');
+    frame.changedNum = encode_log_tick(keyframe ? std::vector<SegmentShmIoStat>() : mPrev, records, mBuf);
+    frame.payloadBytes = mBuf.size() - sizeof(frame);
+    memcpy(&mBuf[0], &frame, sizeof(frame));
+
+    size_t written = 0;
+    while (written < mBuf.size()) {
+        ssize_t n = write(mFd, mBuf.data() + written, mBuf.size() - written);
+        if (n <= 0) {
+            // the reader ignores the torn frame; carry on in a new chunk
+            std::cerr << "Failed to write snapshot log chunk: " << mChunks.back().first << std::endl;
+            close(mFd);
+            mFd = -1;
+            mChunks.back().second += written;
+            mBytes += written;
+            return false;
+        }
+        written += n;
+    }
+    mChunkSize += written;
+    mChunks.back().second += written;
+    mBytes += written;
+    mPrev = records;
+    mSinceKeyframe = keyframe ? 1 : mSinceKeyframe + 1;
+    mTickNum++;
+    mLastTimestampUs = timestamp_us;
+    Trim();
+    return true;
+}
+
+SnapshotLog::SnapshotLog(const std::string& dir) : mDir(dir), mFd(-1), mFdChunk(-1), mCurrentTick(-1) {
+    Refresh();
+}
+
+SnapshotLog::~SnapshotLog(){
+    CloseChunk();
+}
+
+void SnapshotLog::CloseChunk(){
+    if (mFd != -1) {
+        close(mFd);
+        mFd = -1;
+    }
+    mFdChunk = -1;
+}
+
+size_t SnapshotLog::Refresh(){
+    std::lock_guard<std::mutex> lock(mMutex);
+    CloseChunk();
+    mCurrent.clear();
+    mCurrentTick = -1;
+    mTicks.clear();
+    mChunks = list_log_chunks(mDir);
+    for (size_t c = 0; c < mChunks.size(); ++c) {
+        int fd = open(mChunks[c].c_str(), O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            // deleted by the recorder's trimming since it was listed
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+        uint64_t size = st.st_size;
+        uint64_t offset = 0;
+        int64_t keyframe = -1;
+        SnapshotLogFrame frame;
+        while (offset + sizeof(frame) <= size && pread(fd, &frame, sizeof(frame), offset) == static_cast<ssize_t>(sizeof(frame))) {
+            if (frame.magic != SNAPSHOT_LOG_MAGIC) {
+                std::cerr << "Invalid snapshot log frame at " << offset << ", path: " << mChunks[c] << std::endl;
+                break;
+            }
+            // a frame still being written, or torn by a failed write
+            if (offset + sizeof(frame) + frame.payloadBytes > size) {
+                break;
+            }
+            if (frame.keyframe) {
+                keyframe = mTicks.size();
+            }
+            if (keyframe != -1) {
+                Tick tick;
+                tick.chunk = c;
+                tick.offset = offset;
+                tick.timestampUs = frame.timestampUs;
+                tick.keyframe = keyframe;
+                mTicks.push_back(tick);
+            }
+            offset += sizeof(frame) + frame.payloadBytes;
+        }
+        close(fd);
+    }
+    return mTicks.size();
+}
+
+int64_t SnapshotLog::Timestamp(size_t tick) const{
+    return tick < mTicks.size() ? mTicks[tick].timestampUs : 0;
+}
+
+int64_t SnapshotLog::Find(int64_t timestamp_us) const{
+    auto it = std::upper_bound(mTicks.begin(), mTicks.end(), timestamp_us, [](int64_t ts, const Tick& tick) { return ts < tick.timestampUs; });
+    return static_cast<int64_t>(it - mTicks.begin()) - 1;
+}
+
+bool SnapshotLog::Decode(const Tick& tick){
+    if (mFdChunk != tick.chunk) {
+        CloseChunk();
+        mFd = open(mChunks[tick.chunk].c_str(), O_RDONLY);
+        if (mFd == -1) {
+            std::cerr << "Failed to open snapshot log chunk: " << mChunks[tick.chunk] << std::endl;
+            return false;
+        }
+        mFdChunk = tick.chunk;
+    }
+    SnapshotLogFrame frame;
+    if (pread(mFd, &frame, sizeof(frame), tick.offset) != static_cast<ssize_t>(sizeof(frame)) || frame.magic != SNAPSHOT_LOG_MAGIC) {
+        std::cerr << "Invalid snapshot log frame at " << tick.offset << ", path: " << mChunks[tick.chunk] << std::endl;
+        return false;
+    }
+    mBuf.resize(frame.payloadBytes);
+    if (pread(mFd, &mBuf[0], mBuf.size(), tick.offset + sizeof(frame)) != static_cast<ssize_t>(mBuf.size()) || !decode_log_tick(mBuf.data(), mBuf.data() + mBuf.size(), frame, mCurrent)) {
+        std::cerr << "Corrupt snapshot log frame at " << tick.offset << ", path: " << mChunks[tick.chunk] << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<SegmentSnapshot> SnapshotLog::Snapshot(size_t tick){
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (tick >= mTicks.size()) {
+        return nullptr;
+    }
+    // carry on from the last tick rebuilt when it is on the way
+    size_t from = mTicks[tick].keyframe;
+    if (mCurrentTick >= static_cast<int64_t>(from) && mCurrentTick <= static_cast<int64_t>(tick)) {
+        from = mCurrentTick + 1;
+    }
+    for (size_t t = from; t <= tick; ++t) {
+        if (!Decode(mTicks[t])) {
+            mCurrent.clear();
+            mCurrentTick = -1;
+            return nullptr;
+        }
+        mCurrentTick = t;
+    }
+    return std::make_shared<SegmentSnapshot>(mCurrent);
+}
+
+extern "C" std::map<std::string, BsSumState> bs_stat() {
+    return take_snapshot()->BsFlow();
+}
+
+extern "C" ReturnSegStat merge_bs_segment(int sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model) {
+    return take_snapshot()->MergeSegment(sort_flag, top_k, traffic_floor, model);
+}
+
+extern "C" ReturnDevStat merge_bs_device(int sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model) {
+    return take_snapshot()->MergeDevice(sort_flag, top_k, traffic_floor, model);
+}
+
+extern "C" ReturnRwSegStat merge_bs_rw_segment(int r_sort_flag, int w_sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model) {
+    return take_snapshot()->MergeRwSegment(r_sort_flag, w_sort_flag, top_k, traffic_floor, model);
+}
+
+double calculate_segment_score(const int64_t& urgent_traffic, const double& urgent_std, const int64_t& urgent_latency, const int64_t& urgent_iops, const SortType& sortType, double w_traffic){
+    double score = 0.0;
+    switch (sortType){
+        case SortType::TrafficStdScore:
+            if (urgent_latency != 0){
+                score = (w_traffic * urgent_traffic - (1 - w_traffic) * urgent_std) * urgent_iops / urgent_latency;
+            }
+            break;
+        case SortType::TrafficScore:
+            if (urgent_latency != 0){
+                score = urgent_traffic * urgent_iops / urgent_latency;
+            }
+            break;
+        default:
+            std::cerr << "Invalid sort type: " << static_cast<int>(sortType) << std::endl;
+            exit(EXIT_FAILURE);
+    }
+    return score;
+}
+
+void calculate_bs_score(std::map<std::string, BsSumScoreState>& bs_score_flow, double w1){
+    std::vector<double> bs_wtraffic, bs_rtraffic, bs_wlatency_iops, bs_rlatency_iops;
+    for (auto& bs : bs_score_flow){ 
+        bs_wtraffic.emplace_back(bs.second.mTrafficSum.write_urgent_sum);
+        bs_rtraffic.emplace_back(bs.second.mTrafficSum.read_urgent_sum);
+        if (bs.second.mIopsSum.write_urgent_sum != 0){
+            bs_wlatency_iops.emplace_back(bs.second.mLatencySum.write_urgent_sum / bs.second.mIopsSum.write_urgent_sum);
+        }
+        else{
+            bs_wlatency_iops.emplace_back(0);
+        }
+        if (bs.second.mIopsSum.read_urgent_sum != 0){
+            bs_rlatency_iops.emplace_back(bs.second.mLatencySum.read_urgent_sum / bs.second.mIopsSum.read_urgent_sum);
+        }
+        else{
+            bs_rlatency_iops.emplace_back(0);
+        }
+    }
+    double max_wtraffic = *std::max_element(bs_wtraffic.begin(), bs_wtraffic.end());
+    double max_rtraffic = *std::max_element(bs_rtraffic.begin(), bs_rtraffic.end());
+    double max_wlatency_iops = *std::max_element(bs_wlatency_iops.begin(), bs_wlatency_iops.end());
+    double max_rlatency_iops = *std::max_element(bs_rlatency_iops.begin(), bs_rlatency_iops.end());
+    int index = 0;
+    for (auto& bs : bs_score_flow){
+        if (max_wtraffic != 0){
+            bs.second.BsWriteScore = w1 * bs_wtraffic[index] / max_wtraffic + (1-w1) * bs_wlatency_iops[index] / max_wlatency_iops;
+        }
+        else{
+            bs.second.BsWriteScore = 0;
+        }
+        if (max_rtraffic != 0){
+            bs.second.BsReadScore = w1 * bs_rtraffic[index] / max_rtraffic + (1-w1) * bs_rlatency_iops[index] / max_rlatency_iops;
+        }
+        else{
+            bs.second.BsReadScore = 0;
+        }
+        index++;
+    }
+}
+
+extern "C" ReturnRwSegScoreStat merge_bsscore_rw_segment(int r_sort_flag, int w_sort_flag, double w1, size_t top_k, const ScoringModel* model) {
+    return take_snapshot()->MergeScoreRwSegment(r_sort_flag, w_sort_flag, w1, top_k, model);
+}
+
+extern "C" ReturnRwDevStat merge_bs_rw_device(int r_sort_flag, int w_sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel* model) {
+    return take_snapshot()->MergeRwDevice(r_sort_flag, w_sort_flag, top_k, traffic_floor, model);
+}
+
+RwMovePlan plan_rw_segment_moves(const ReturnRwSegStat& res, double w_max_ratio, double w_min_ratio, double r_max_ratio, double r_min_ratio, int64_t remain_tokens, uint64_t min_threshold, uint64_t min_segment_traffic, double max_w_skew, double max_r_skew, int64_t max_borrow_tokens){
+    PhaseTimer timer(MergePhase::Plan);
+    enum class Transfer { Moved, Exhausted, NoFit };
+    RwMovePlan plan;
+    std::vector<std::string> all_bs;
+    std::vector<int64_t> w_loads, r_loads;
+    int64_t w_sum = 0, r_sum = 0;
+    for (const auto& bsEntry : res.bs_flow) {
+        all_bs.emplace_back(bsEntry.first);
+        w_loads.emplace_back(bsEntry.second.mTrafficSum.write_urgent_sum);
+        r_loads.emplace_back(bsEntry.second.mTrafficSum.read_urgent_sum);
+        w_sum += w_loads.back();
+        r_sum += r_loads.back();
+    }
+    plan.remainTokens = remain_tokens;
+    if (all_bs.empty()) {
+        plan.wMaxSkew = plan.wMinSkew = plan.rMaxSkew = plan.rMinSkew = 0;
+        return plan;
+    }
+    BsLoadIndex w_load(w_loads), r_load(r_loads);
+    double mean_w = static_cast<double>(w_sum) / all_bs.size();
+    double mean_r = static_cast<double>(r_sum) / all_bs.size();
+    std::vector<bool> w_cannot(all_bs.size(), false), r_cannot(all_bs.size(), false);
+    size_t w_cannot_num = 0, r_cannot_num = 0;
+    std::vector<size_t> w_next(all_bs.size(), 0), r_next(all_bs.size(), 0);
+    std::unordered_set<SegmentId, SegmentIdHash> chosen_read;
+
+    auto transfer = [&](bool read) -> Transfer {
+        BsLoadIndex& load = read ? r_load : w_load;
+        BsLoadIndex& other = read ? w_load : r_load;
+        double mean = read ? mean_r : mean_w;
+        std::vector<bool>& cannot = read ? r_cannot : w_cannot;
+        size_t& cannot_num = read ? r_cannot_num : w_cannot_num;
+        std::vector<size_t>& next = read ? r_next : w_next;
+        double dw = (read ? r_max_ratio : w_max_ratio) - 1;
+        assert(dw > 0);
+        double delta = dw * mean;
+        size_t max_bs = load.Max();
+        size_t min_bs = load.Min();
+        // walk down from the most loaded BS to the first one still schedulable,
+        // while the load accounting below stays on max_bs as the Python loop did
+        size_t source = max_bs;
+        auto it = load.Order().rbegin();
+        while (cannot[source]) {
+            source = it->second;
+            ++it;
+        }
+        const RankOrder& order = read ? res.segments.read : res.segments.write;
+        size_t b = res.segments.Find(all_bs[source]);
+        size_t item_num = b == res.segments.bs.size() ? 0 : order.Size(b);
+        auto exhaust = [&](){
+            next[source] = item_num;
+            if (!cannot[source]) {
+                cannot[source] = true;
+                cannot_num++;
+            }
+            return Transfer::Exhausted;
+        };
+        if (next[source] >= item_num) {
+            return exhaust();
+        }
+        for (size_t i = next[source]; i < item_num; ++i) {
+            const auto& seg = res.segments.At(order, b, i);
+            int64_t traffic = read ? seg.traffic.read_urgent_sum : seg.traffic.write_urgent_sum;
+            if (traffic <= static_cast<int64_t>(min_segment_traffic)) {
+                return exhaust();
+            }
+            if (!read && chosen_read.count(seg.segmentId)) {
+                next[source] = i + 1;
+                continue;
+            }
+            double diff = load.Load(max_bs) - mean - traffic;
+            if (diff > -delta) {
+                plan.moves.emplace_back(seg.segmentId, all_bs[source], all_bs[min_bs], read, traffic);
+                if (read) {
+                    chosen_read.insert(seg.segmentId);
+                }
+                int64_t other_traffic = read ? seg.traffic.write_urgent_sum : seg.traffic.read_urgent_sum;
+                load.Add(max_bs, -traffic);
+                load.Add(min_bs, traffic);
+                other.Add(max_bs, -other_traffic);
+                other.Add(min_bs, other_traffic);
+                remain_tokens--;
+                next[source] = i + 1;
+                return Transfer::Moved;
+            }
+        }
+        if (next[source] >= item_num) {
+            return exhaust();
+        }
+        return Transfer::NoFit;
+    };
+
+    int64_t max_w = w_load.MaxLoad(), max_r = r_load.MaxLoad();
+    double w_max_skew = w_load.MaxLoad() / mean_w, w_min_skew = w_load.MinLoad() / mean_w;
+    double r_max_skew = r_load.MaxLoad() / mean_r, r_min_skew = r_load.MinLoad() / mean_r;
+    // NoFit leaves nothing changed, so retrying would spin forever: stop instead
+    if (max_r > static_cast<int64_t>(min_threshold)) {
+        while (r_max_skew > r_max_ratio || r_min_skew < r_min_ratio) {
+            if (remain_tokens <= -max_borrow_tokens || r_cannot_num >= all_bs.size() - 1) {
+                break;
+            }
+            Transfer result = transfer(true);
+            if (result == Transfer::NoFit || (result == Transfer::Exhausted && r_max_skew > r_max_ratio && r_min_skew >= r_min_ratio)) {
+                break;
+            }
+            if (remain_tokens <= 0) {
+                r_max_ratio = 1 + max_r_skew;
+                r_min_ratio = 1 - max_r_skew;
+                w_max_ratio = 1 + max_w_skew;
+                w_min_ratio = 1 - max_w_skew;
+            }
+            r_max_skew = r_load.MaxLoad() / mean_r;
+            r_min_skew = r_load.MinLoad() / mean_r;
+        }
+    }
+    if (max_w > static_cast<int64_t>(min_threshold)) {
+        while (w_max_skew > w_max_ratio || w_min_skew < w_min_ratio) {
+            if (remain_tokens <= -max_borrow_tokens || w_cannot_num >= all_bs.size() - 1) {
+                break;
+            }
+            Transfer result = transfer(false);
+            if (result == Transfer::NoFit || (result == Transfer::Exhausted && w_max_skew > w_max_ratio && w_min_skew >= w_min_ratio)) {
+                break;
+            }
+            if (remain_tokens <= 0) {
+                w_max_ratio = 1 + max_w_skew;
+                w_min_ratio = 1 - max_w_skew;
+            }
+            w_max_skew = w_load.MaxLoad() / mean_w;
+            w_min_skew = w_load.MinLoad() / mean_w;
+        }
+    }
+    plan.remainTokens = remain_tokens;
+    plan.wMaxSkew = w_max_skew;
+    plan.wMinSkew = w_min_skew;
+    plan.rMaxSkew = r_max_skew;
+    plan.rMinSkew = r_min_skew;
+    return plan;
+}
+
+// The snapshot state every plan starts from, read once so plans can be
+// projected concurrently without touching the snapshot.
+class MoveProjector {
+public:
+    explicit MoveProjector(SegmentSnapshot& snap) : mRecords(snap.Records()), mRecordBs(snap.RecordBs()), mBsIps(snap.BsIps()), mBsState(snap.BsState()), mBsRecordNum(snap.BsRecordNum()), mSegmentIndex(snap.SegmentIndex()) {
+        for (size_t bs = 0; bs < mBsIps.size(); ++bs) {
+            mBsIndex.emplace(mBsIps[bs], bs);
+        }
+    }
+    PlanProjection Project(const std::vector<MoveCandidate>& moves) const;
+
+private:
+    const std::vector<SegmentShmIoStat>& mRecords;
+    const std::vector<uint32_t>& mRecordBs;
+    const std::vector<std::string>& mBsIps;
+    const std::vector<BsSumState>& mBsState;
+    const std::vector<uint32_t>& mBsRecordNum;
+    const std::unordered_map<SegmentId, uint32_t, SegmentIdHash>& mSegmentIndex;
+    std::unordered_map<std::string, uint32_t> mBsIndex;
+};
+
+PlanProjection MoveProjector::Project(const std::vector<MoveCandidate>& moves) const{
+    PlanProjection proj;
+    std::vector<BsSumState> state(mBsState);
+    std::vector<uint32_t> record_num(mBsRecordNum);
+    std::vector<std::string> new_bs;
+    // records this plan already moved, and where to
+    std::unordered_map<uint32_t, uint32_t> placed;
+    proj.appliedMoves = 0;
+    for (size_t i = 0; i < moves.size(); ++i) {
+        auto segIt = mSegmentIndex.find(moves[i].segmentId);
+        if (segIt == mSegmentIndex.end()) {
+            proj.skippedMoves.push_back(i);
+            continue;
+        }
+        uint32_t record = segIt->second;
+        auto placedIt = placed.find(record);
+        uint32_t from = placedIt == placed.end() ? mRecordBs[record] : placedIt->second;
+        uint32_t to;
+        auto bsIt = mBsIndex.find(moves[i].targetBs);
+        if (bsIt != mBsIndex.end()) {
+            to = bsIt->second;
+        }
+        else {
+            to = mBsIps.size() + (std::find(new_bs.begin(), new_bs.end(), moves[i].targetBs) - new_bs.begin());
+            if (to == state.size()) {
+                new_bs.push_back(moves[i].targetBs);
+                state.emplace_back();
+                record_num.push_back(0);
+            }
+        }
+        proj.appliedMoves++;
+        if (from == to) {
+            continue;
+        }
+        remove_bs_result(state[from], mRecords[record]);
+        record_num[from]--;
+        add_bs_result(state[to], mRecords[record]);
+        record_num[to]++;
+        placed[record] = to;
+    }
+
+    uint64_t w_sum = 0, r_sum = 0;
+    uint64_t w_max = 0, r_max = 0;
+    uint64_t w_min = std::numeric_limits<uint64_t>::max(), r_min = std::numeric_limits<uint64_t>::max();
+    uint32_t max_records = 0;
+    for (size_t bs = 0; bs < state.size(); ++bs) {
+        const auto& traffic = state[bs].mTrafficSum;
+        proj.bs_flow.emplace(bs < mBsIps.size() ? mBsIps[bs] : new_bs[bs - mBsIps.size()], state[bs]);
+        w_sum += traffic.write_urgent_sum;
+        r_sum += traffic.read_urgent_sum;
+        w_max = std::max(w_max, traffic.write_urgent_sum);
+        w_min = std::min(w_min, traffic.write_urgent_sum);
+        r_max = std::max(r_max, traffic.read_urgent_sum);
+        r_min = std::min(r_min, traffic.read_urgent_sum);
+        max_records = std::max(max_records, record_num[bs]);
+    }
+    double mean_w = state.empty() ? 0 : static_cast<double>(w_sum) / state.size();
+    double mean_r = state.empty() ? 0 : static_cast<double>(r_sum) / state.size();
+    proj.wMaxSkew = mean_w > 0 ? w_max / mean_w : 0;
+    proj.wMinSkew = mean_w > 0 ? w_min / mean_w : 0;
+    proj.rMaxSkew = mean_r > 0 ? r_max / mean_r : 0;
+    proj.rMinSkew = mean_r > 0 ? r_min / mean_r : 0;
+    proj.blastRadius.maxblastradius = static_cast<int16_t>(max_records);
+    proj.blastRadius.avgblastradius = max_records > 0 ? static_cast<double>(state.size()) / proj.blastRadius.maxblastradius : 0;
+    return proj;
+}
+
+PlanProjection simulate_moves(SegmentSnapshot& snap, const std::vector<MoveCandidate>& moves){
+    PhaseTimer timer(MergePhase::Plan);
+    return MoveProjector(snap).Project(moves);
+}
+
+std::vector<PlanProjection> simulate_move_plans(SegmentSnapshot& snap, const std::vector<std::vector<MoveCandidate>>& plans){
+    PhaseTimer timer(MergePhase::Plan);
+    MoveProjector projector(snap);
+    std::vector<PlanProjection> projections(plans.size());
+    size_t workers = std::min<size_t>(std::max(mergeThreads.load(), 1), std::max<size_t>(plans.size(), 1));
+    parallel_for(workers, plans.size(), [&](size_t, size_t begin, size_t end){
+        for (size_t p = begin; p < end; ++p) {
+            projections[p] = projector.Project(plans[p]);
+        }
+    });
+    return projections;
+}
+
+// Calls visitor.Run<Policy>() with the ranking policy of sortType: one switch
+// per ranked list rather than one per comparison.
+template <typename Side, typename Visitor>
+typename Visitor::Result visit_segment_rank_side(SortType sortType, Visitor& visitor){
+    switch (sortType){
+        case SortType::Traffic:
+            return visitor.template Run<TrafficRank<Side>>();
+        case SortType::TrafficStd:
+            return visitor.template Run<TrafficStdRank<Side>>();
+        case SortType::TrafficIopsLatency:
+            return visitor.template Run<TrafficIopsLatencyRank<Side>>();
+        case SortType::wrTrafficStd:
+            return visitor.template Run<RwTrafficStdRank<Side>>();
+        case SortType::Latency:
+            return visitor.template Run<LatencyRank<Side>>();
+        case SortType::LatencyPerIops:
+            return visitor.template Run<LatencyPerIopsRank<Side>>();
+        case SortType::TrafficStdLong:
+            return visitor.template Run<TrafficStdLongRank<Side>>();
+        case SortType::TrafficStdScore:
+            return visitor.template Run<TrafficStdScoreRank<Side>>();
+        case SortType::TrafficStdLatScore:
+            return visitor.template Run<TrafficStdLatScoreRank<Side>>();
+        case SortType::TrafficStdIopsScore:
+            return visitor.template Run<TrafficStdIopsScoreRank<Side>>();
+        case SortType::TrafficScore:
+            return visitor.template Run<TrafficScoreRank<Side>>();
+        case SortType::ReadRatio:
+            assert(!Side::write);
+            return visitor.template Run<ReadRatioRank<Side>>();
+        default:
+            std::cerr << "Invalid sort flag: " << static_cast<int>(sortType) << std::endl;
+            exit(EXIT_FAILURE);
+    }
+}
+
+// Calls visitor.Run<Side>() with the RankSide of a direction and window.
+template <typename Visitor>
+typename Visitor::Result visit_rank_side(bool write, RankWindow window, Visitor& visitor){
+    switch (window){
+        case RankWindow::Instant:
+            return write ? visitor.template Run<RankSide<true, RankWindow::Instant>>() : visitor.template Run<RankSide<false, RankWindow::Instant>>();
+        case RankWindow::Longterm:
+            return write ? visitor.template Run<RankSide<true, RankWindow::Longterm>>() : visitor.template Run<RankSide<false, RankWindow::Longterm>>();
+        default:
+            return write ? visitor.template Run<RankSide<true>>() : visitor.template Run<RankSide<false>>();
+    }
+}
+
+template <typename Visitor>
+struct SegmentRankVisit {
+    typedef typename Visitor::Result Result;
+    SortType sortType;
+    Visitor& visitor;
+
+    template <typename Side>
+    Result Run(){
+        return visit_segment_rank_side<Side>(sortType, visitor);
+    }
+};
+
+template <typename Visitor>
+typename Visitor::Result visit_segment_rank(SortType sortType, bool write, RankWindow window, Visitor& visitor){
+    SegmentRankVisit<Visitor> visit = {sortType, visitor};
+    return visit_rank_side(write, window, visit);
+}
+
+template <typename Side, typename Visitor>
+typename Visitor::Result visit_device_rank_side(SortType sortType, Visitor& visitor){
+    switch (sortType){
+        case SortType::Traffic:
+            return visitor.template Run<TrafficRank<Side>>();
+        case SortType::TrafficStd:
+            return visitor.template Run<TrafficStdRank<Side>>();
+        case SortType::TrafficIopsLatency:
+            return visitor.template Run<TrafficIopsLatencyRank<Side>>();
+        case SortType::wrTrafficStd:
+            return visitor.template Run<RwTrafficStdRank<Side>>();
+        case SortType::Latency:
+            return visitor.template Run<LatencyRank<Side>>();
+        case SortType::LatencyPerIops:
+            return visitor.template Run<LatencyPerIopsRank<Side>>();
+        default:
+            std::cerr << "Invalid sort flag: " << static_cast<int>(sortType) << std::endl;
+            exit(EXIT_FAILURE);
+    }
+}
+
+template <typename Visitor>
+struct DeviceRankVisit {
+    typedef typename Visitor::Result Result;
+    SortType sortType;
+    Visitor& visitor;
+
+    template <typename Side>
+    Result Run(){
+        return visit_device_rank_side<Side>(sortType, visitor);
+    }
+};
+
+template <typename Visitor>
+typename Visitor::Result visit_device_rank(SortType sortType, bool write, RankWindow window, Visitor& visitor){
+    DeviceRankVisit<Visitor> visit = {sortType, visitor};
+    return visit_rank_side(write, window, visit);
+}
+
+void set_scoring_model(const ScoringModel& model){
+    std::lock_guard<std::mutex> lock(scoringModelMutex);
+    scoringModel = model;
+}
+
+ScoringModel scoring_model(){
+    std::lock_guard<std::mutex> lock(scoringModelMutex);
+    return scoringModel;
+}
+
+std::string ScoringModel::ToString() const{
+    static const char* windows[] = {"urgent", "instant", "longterm"};
+    std::ostringstream out;
+    out << "ScoringModel(traffic_weight=" << traffic_weight << ", read_traffic_ratio=" << read_traffic_ratio
+        << ", urgent_traffic_weight=" << urgent_traffic_weight << ", urgent_std_weight=" << urgent_std_weight << ", instant_std_weight=" << instant_std_weight
+        << ", mix_traffic_weight=" << mix_traffic_weight << ", mix_iops_weight=" << mix_iops_weight << ", mix_latency_weight=" << mix_latency_weight << ", mix_std_weight=" << mix_std_weight
+        << ", window=" << windows[static_cast<int>(window)] << ", norm=" << (norm == ScoreNorm::Max ? "max" : "none") << ")";
+    return out.str();
+}
+
+RankParams rank_params(const ScoringModel& model, SortType sortType){
+    RankParams p;
+    std::fill(p.coef, p.coef + RANK_FEATURE_NUM, 0.0);
+    auto set = [&p](RankFeature f, double w){ p.coef[static_cast<size_t>(f)] = w; };
+    switch (sortType){
+        case SortType::Traffic:
+            set(RankFeature::Traffic, 1);
+            break;
+        case SortType::TrafficStd:
+        case SortType::TrafficStdScore:
+        case SortType::TrafficStdLatScore:
+        case SortType::TrafficStdIopsScore:
+            set(RankFeature::Traffic, model.traffic_weight);
+            set(RankFeature::Std, -(1 - model.traffic_weight));
+            break;
+        case SortType::TrafficIopsLatency:
+            set(RankFeature::Traffic, model.mix_traffic_weight);
+            set(RankFeature::Iops, model.mix_iops_weight);
+            set(RankFeature::Latency, model.mix_latency_weight);
+            set(RankFeature::Std, -model.mix_std_weight);
+            break;
+        case SortType::wrTrafficStd:
+            set(RankFeature::RwTraffic, model.traffic_weight);
+            set(RankFeature::RwStd, -(1 - model.traffic_weight));
+            break;
+        case SortType::Latency:
+            set(RankFeature::Latency, 1);
+            break;
+        case SortType::LatencyPerIops:
+        case SortType::TrafficScore:
+            break;  // ratios of the raw counters, nothing to weight
+        case SortType::TrafficStdLong:
+            set(RankFeature::Traffic, model.urgent_traffic_weight);
+            set(RankFeature::Std, -model.urgent_std_weight);
+            set(RankFeature::LongerStd, -model.instant_std_weight);
+            break;
+        case SortType::ReadRatio:
+            set(RankFeature::ReadTraffic, model.read_traffic_ratio);
+            set(RankFeature::WriteTraffic, -(1 - model.read_traffic_ratio));
+            break;
+        default:
+            break;  // the visit_*_rank switches reject it
+    }
+    return p;
+}
+
+template <typename T>
+const T& rank_item(const T& item){
+    return item;
+}
+
+template <typename T>
+const T& rank_item(const T* item){
+    return *item;
+}
+
+template <typename K, typename T>
+const T& rank_item(const std::pair<const K, T>& entry){
+    return entry.second;
+}
+
+template <typename Side, typename S>
+double rank_feature(const S& s, RankFeature f){
+    switch (f){
+        case RankFeature::Traffic: return Side::Traffic(s);
+        case RankFeature::Iops: return Side::Iops(s);
+        case RankFeature::Latency: return Side::Latency(s);
+        case RankFeature::Std: return Side::Std(s);
+        case RankFeature::LongerStd: return Side::LongerStd(s);
+        case RankFeature::RwTraffic: return Side::RwTraffic(s);
+        case RankFeature::RwStd: return Side::RwStd(s);
+        case RankFeature::ReadTraffic: return RankSide<false, Side::window>::Traffic(s);
+        default: return RankSide<true, Side::window>::Traffic(s);
+    }
+}
+
+// Raises max to the largest magnitude of each weighted feature over a list.
+template <typename List>
+struct RankFeatureScan {
+    typedef void Result;
+    const List& items;
+    const RankParams& params;
+    double* max;
+
+    template <typename Side>
+    void Run(){
+        for (size_t f = 0; f < RANK_FEATURE_NUM; ++f) {
+            if (params.coef[f] == 0) {
+                continue;
+            }
+            for (const auto& item : items) {
+                max[f] = std::max(max[f], std::fabs(rank_feature<Side>(rank_item(item), static_cast<RankFeature>(f))));
+            }
+        }
+    }
+};
+
+template <typename Lists>
+RankParams compile_rank_params(const ScoringModel& model, SortType sortType, bool write, const Lists& lists){
+    RankParams params = rank_params(model, sortType);
+    if (model.norm != ScoreNorm::Max){
+        return params;
+    }
+    double max[RANK_FEATURE_NUM] = {0};
+    for (const auto& list : lists) {
+        typedef typename std::decay<decltype(rank_item(list))>::type List;
+        RankFeatureScan<List> scan = {rank_item(list), params, max};
+        visit_rank_side(write, model.window, scan);
+    }
+    for (size_t f = 0; f < RANK_FEATURE_NUM; ++f) {
+        if (max[f] > 0) {
+            params.coef[f] /= max[f];
+        }
+    }
+    return params;
+}
+
+// Fills keys with one policy over items, summaries or pointers to them.
+template <typename Item>
+struct RankKeyFill {
+    typedef void Result;
+    const std::vector<Item>& items;
+    const RankParams& params;
+    std::vector<double>& keys;
+
+    template <typename Policy>
+    void Run(){
+        keys.resize(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            keys[i] = Policy::Key(rank_item(items[i]), params);
+        }
+    }
+};
+
+template <typename S>
+struct RankKeyOne {
+    typedef double Result;
+    const S& item;
+    const RankParams& params;
+
+    template <typename Policy>
+    double Run(){
+        return Policy::Key(item, params);
+    }
+};
+
+double segment_rank_key(const SegmentSummary& s, SortType sortType, bool write, RankWindow window, const RankParams& params){
+    RankKeyOne<SegmentSummary> one = {s, params};
+    return visit_segment_rank(sortType, write, window, one);
+}
+
+void segment_rank_keys(const std::vector<SegmentSummary>& segments, SortType sortType, bool write, RankWindow window, const RankParams& params, std::vector<double>& keys){
+    RankKeyFill<SegmentSummary> fill = {segments, params, keys};
+    visit_segment_rank(sortType, write, window, fill);
+}
+
+double device_rank_key(const DeviceSummary& d, SortType sortType, bool write, RankWindow window, const RankParams& params){
+    RankKeyOne<DeviceSummary> one = {d, params};
+    return visit_device_rank(sortType, write, window, one);
+}
+
+void device_rank_keys(const std::vector<DeviceAggregate>& devices, SortType sortType, bool write, RankWindow window, const RankParams& params, std::vector<double>& keys){
+    RankKeyFill<DeviceAggregate> fill = {devices, params, keys};
+    visit_device_rank(sortType, write, window, fill);
+}
+
+uint64_t descending_key_bits(double key){
+    if (key == 0) {
+        key = 0;  // -0.0 ties with 0.0
+    }
+    uint64_t bits;
+    memcpy(&bits, &key, sizeof(bits));
+    bits = (bits >> 63) ? ~bits : (bits | (static_cast<uint64_t>(1) << 63));
+    return ~bits;
+}
+
+std::vector<uint32_t> rank_order(const std::vector<double>& keys){
+    size_t n = keys.size();
+    std::vector<uint64_t> bits(n);
+    std::vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; ++i) {
+        bits[i] = descending_key_bits(keys[i]);
+        order[i] = i;
     }
-    double max_wtraffic = *std::max_element(bs_wtraffic.begin(), bs_wtraffic.end());
-    double max_rtraffic = *std::max_element(bs_rtraffic.begin(), bs_rtraffic.end());
-    double max_wlatency_iops = *std::max_element(bs_wlatency_iops.begin(), bs_wlatency_iops.end());
-    double max_rlatency_iops = *std::max_element(bs_rlatency_iops.begin(), bs_rlatency_iops.end());
-    int index = 0;
-    for (auto& bs : bs_score_flow){
-        if (max_wtraffic != 0){
-            bs.second.BsWriteScore = w1 * bs_wtraffic[index] / max_wtraffic + (1-w1) * bs_wlatency_iops[index] / max_wlatency_iops;
+    if (n < RADIX_SORT_MIN) {
+        std::sort(order.begin(), order.end(), [&bits](uint32_t a, uint32_t b){
+            return bits[a] < bits[b] || (bits[a] == bits[b] && a < b);
+        });
+        return order;
+    }
+    // LSD radix over 11-bit digits. Each pass is stable, so ties keep their
+    // input order; digits every key shares, mostly exponent bits, are skipped.
+    const int digit_bits = 11;
+    const size_t buckets = static_cast<size_t>(1) << digit_bits;
+    const int passes = (64 + digit_bits - 1) / digit_bits;
+    std::vector<uint32_t> counts(passes * buckets, 0);
+    for (size_t i = 0; i < n; ++i) {
+        for (int p = 0; p < passes; ++p) {
+            counts[p * buckets + ((bits[i] >> (p * digit_bits)) & (buckets - 1))]++;
         }
-        else{
-            bs.second.BsWriteScore = 0;
+    }
+    std::vector<uint32_t> next(n);
+    for (int p = 0; p < passes; ++p) {
+        uint32_t* count = &counts[p * buckets];
+        int shift = p * digit_bits;
+        if (count[(bits[0] >> shift) & (buckets - 1)] == n) {
+            continue;
         }
-        if (max_rtraffic != 0){
-            bs.second.BsReadScore = w1 * bs_rtraffic[index] / max_rtraffic + (1-w1) * bs_rlatency_iops[index] / max_rlatency_iops;
+        uint32_t start = 0;
+        for (size_t b = 0; b < buckets; ++b) {
+            uint32_t c = count[b];
+            count[b] = start;
+            start += c;
         }
-        else{
-            bs.second.BsReadScore = 0;
+        for (uint32_t i : order) {
+            next[count[(bits[i] >> shift) & (buckets - 1)]++] = i;
         }
-        index++;
+        order.swap(next);
     }
+    return order;
 }
 
-extern "C" ReturnRwSegScoreStat merge_bsscore_rw_segment(int r_sort_flag, int w_sort_flag, double w1) {
-    SortType wsortType = static_cast<SortType>(w_sort_flag);
-    SortType rsortType = static_cast<SortType>(r_sort_flag);
-    assert ((r_sort_flag == w_sort_flag) && (wsortType == SortType::TrafficScore || wsortType == SortType::TrafficStdScore));
-    assert (w1 >= 0.5);
-    auto iostats = read_segment_iostats_mmap("/var/run/pangu_blockmaster_seg_iostats");
-    std::map<std::string, BsSumScoreState> bs_score_flow;
-    BsSegScoreMap bssegmap;
-    for (const auto& e : iostats) {
-        std::string bs_ip = bs_ip_transform_cache(e.bsId);
-        auto bsIt = bs_score_flow.find(bs_ip);
-        if (bsIt == bs_score_flow.end()) {
-            bs_score_flow[bs_ip] = BsSumScoreState();
-            bsIt = bs_score_flow.find(bs_ip);
-        }
-        bsIt->second.AddResult(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        bsIt->second.AddScore(w_sort_flag, w1, e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops);
-        auto& segVec = bssegmap[bs_ip];
-        auto seg_traffic_std = SegmentStdStat(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
-        auto seg_traffic = SumTraffic(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes);
-        auto seg_latency = SumLatency(e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency);
-        auto seg_iops = SumIops(e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        auto read_score = calculate_segment_score(e.urgent_flow.readBytes, e.urgent_flow_std.readStd, e.urgent_latency.readLatency, e.urgent_iops.readIops, wsortType);
-        auto write_score = calculate_segment_score(e.urgent_flow.writeBytes, e.urgent_flow_std.writeStd, e.urgent_latency.writeLatency, e.urgent_iops.writeIops, wsortType);
-        auto segsum = SegmentScoreSummary(e.segmentId, seg_traffic, seg_latency, seg_iops, seg_traffic_std, read_score, write_score);
-        segVec.emplace_back(segsum);
-    }
-    // calculate_bs_score(bs_score_flow, w1);
-    ReturnRwSegScoreStat result;
-    int16_t maxblastradius = sortBsSegScoreMap(bssegmap, "write");
-    result.sortWriteSegMap = bssegmap;
-    sortBsSegScoreMap(bssegmap, "read");
-    result.sortReadSegMap = bssegmap;
-    double avgblastradius = static_cast<double>(bssegmap.size()) / maxblastradius;
-    result.bs_score_flow = bs_score_flow;
-    BlastRadius blastRadius;
-    blastRadius.avgblastradius = avgblastradius;
-    blastRadius.maxblastradius = maxblastradius;
-    result.blastRadius = blastRadius;
-    return result;
+bool is_write_rank(const std::string& sort_type){
+    if (sort_type == "write"){
+        return true;
+    }
+    if (sort_type != "read"){
+        std::cerr << "Invalid sort type: " << sort_type << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return false;
 }
 
-extern "C" ReturnRwDevStat merge_bs_rw_device(int r_sort_flag, int w_sort_flag) {
-    auto iostats = read_segment_iostats_mmap("/var/run/pangu_blockmaster_seg_iostats");
-    std::map<std::string, BsSumState> bs_flow;
-    BsDeviceTrafficMap bsdevicemap;
-    for (const auto& e : iostats) {
-        std::string bs_ip = bs_ip_transform_cache(e.bsId);
-        auto bsIt = bs_flow.find(bs_ip);
-        if (bsIt == bs_flow.end()) {
-            bs_flow[bs_ip] = BsSumState();
-            bsIt = bs_flow.find(bs_ip);
-        }
-        bsIt->second.AddResult(e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
-        auto& devMap = bsdevicemap[bs_ip];
-        auto devIt = devMap.find(e.segmentId.device_id);
-        if (devIt == devMap.end()) {
-            devMap[e.segmentId.device_id] = DeviceSummary(e.segmentId.device_id);
-            devIt = devMap.find(e.segmentId.device_id);
+void sortDevices(const std::map<uint64_t, DeviceSummary>& devMap, std::vector<DeviceSummary>& devices, bool write, SortType sortType, RankWindow window, const RankParams& params, size_t top_k, uint64_t traffic_floor){
+    std::vector<const DeviceSummary*> ranked;
+    ranked.reserve(devMap.size());
+    for (const auto& deviceEntry : devMap) {
+        ranked.push_back(&deviceEntry.second);
+    }
+    std::vector<double> keys;
+    RankKeyFill<const DeviceSummary*> fill = {ranked, params, keys};
+    visit_device_rank(sortType, write, window, fill);
+    if (top_k > 0 || traffic_floor > 0){
+        TopKHeap<DeviceSummary> heap(top_k > 0 ? top_k : ranked.size());
+        for (size_t i = 0; i < ranked.size(); ++i) {
+            if (traffic_floor == 0 || (write ? RankSide<true>::Traffic(*ranked[i]) : RankSide<false>::Traffic(*ranked[i])) > traffic_floor){
+                heap.Push(keys[i], *ranked[i]);
+            }
         }
-        SegmentStdStat s(e.urgent_flow_std.readStd, e.urgent_flow_std.writeStd, e.instant_flow_std.readStd, e.instant_flow_std.writeStd, e.longterm_flow_std.readStd, e.longterm_flow_std.writeStd);
-        devIt->second.AddResult(e.segmentId.segmentIdx, s, e.urgent_flow.readBytes, e.urgent_flow.writeBytes, e.instant_flow.readBytes, e.instant_flow.writeBytes, e.longterm_flow.readBytes, e.longterm_flow.writeBytes, e.urgent_latency.readLatency, e.urgent_latency.writeLatency, e.instant_latency.readLatency, e.instant_latency.writeLatency, e.longterm_latency.readLatency, e.longterm_latency.writeLatency, e.urgent_iops.readIops, e.urgent_iops.writeIops, e.instant_iops.readIops, e.instant_iops.writeIops, e.longterm_iops.readIops, e.longterm_iops.writeIops);
+        heap.Drain(devices);
+        return;
+    }
+    devices.reserve(devices.size() + ranked.size());
+    for (uint32_t i : rank_order(keys)) {
+        devices.emplace_back(*ranked[i]);
     }
-    ReturnRwDevStat result;
-    int bs_device_num = 0;
-    std::map<std::string, std::vector<DeviceSummary>> sortedWriteBsMap;
-    int16_t maxblastradius = sortBsDevMap(bsdevicemap, sortedWriteBsMap, bs_device_num, "write", w_sort_flag);
-    double avgblastradius = static_cast<double>(bs_device_num) / bsdevicemap.size();
-    result.sortWriteDevMap = sortedWriteBsMap;
-    bs_device_num = 0;
-    std::map<std::string, std::vector<DeviceSummary>> sortedReadBsMap;
-    sortBsDevMap(bsdevicemap, sortedReadBsMap, bs_device_num, "read", r_sort_flag);
-    result.sortReadDevMap = sortedReadBsMap;
-    result.bs_flow = bs_flow;
-    BlastRadius blastRadius;
-    blastRadius.avgblastradius = avgblastradius;
-    blastRadius.maxblastradius = maxblastradius;
-    result.blastRadius = blastRadius;
-    return result;
 }
 
-int16_t sortBsDevMap(BsDeviceTrafficMap& bsdevicemap, std::map<std::string, std::vector<DeviceSummary>>& sortedBsMap, int& bs_device_num, std::string sort_type, int sort_flag){
-    int16_t maxblastradius = 0;
+int16_t sortBsDevMap(const BsDeviceTrafficMap& bsdevicemap, std::map<std::string, std::vector<DeviceSummary>>& sortedBsMap, int& bs_device_num, std::string sort_type, int sort_flag, size_t top_k, uint64_t traffic_floor, const ScoringModel& model){
+    PhaseTimer timer(MergePhase::Rank);
+    bool write = is_write_rank(sort_type);
     SortType sortType = static_cast<SortType>(sort_flag);
+    RankParams params = compile_rank_params(model, sortType, write, bsdevicemap);
+    int16_t maxblastradius = 0;
     for (const auto& bsEntry : bsdevicemap) {
-        std::string bs_ip = bsEntry.first;
         const auto& devMap = bsEntry.second;
         bs_device_num += devMap.size();
         maxblastradius = std::max(maxblastradius, static_cast<int16_t>(devMap.size()));
-        std::vector<DeviceSummary> devices;
-        // devices.reserve(bsEntry.second.size());
-        for (const auto& deviceEntry : devMap) {
-            devices.emplace_back(deviceEntry.second);
-        }
-        switch (sortType){
-            case SortType::Traffic:
-                if (sort_type == "write"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        return a.traffic.write_urgent_sum > b.traffic.write_urgent_sum;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        return a.traffic.read_urgent_sum > b.traffic.read_urgent_sum;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficStd:
-                if (sort_type == "write"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        double a_std = calculate_average_urgent_std(a.segment_traffic_std, UrgentStdType::Write);
-                        double b_std = calculate_average_urgent_std(b.segment_traffic_std, UrgentStdType::Write);
-                        return (W_TRAFFIC * a.traffic.write_urgent_sum - W_STD * a_std) > (W_TRAFFIC * b.traffic.write_urgent_sum - W_STD * b_std);
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        double a_std = calculate_average_urgent_std(a.segment_traffic_std, UrgentStdType::Read);
-                        double b_std = calculate_average_urgent_std(b.segment_traffic_std, UrgentStdType::Read);
-                        return (W_TRAFFIC * a.traffic.read_urgent_sum - W_STD * a_std) > (W_TRAFFIC * b.traffic.read_urgent_sum - W_STD * b_std);
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficIopsLatency:
-                if (sort_type == "write"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        double a_score = traffic_weight * a.traffic.write_urgent_sum + iops_weight * a.iops.write_urgent_sum + latency_weight * a.latency.write_urgent_sum - std_weight * calculate_average_urgent_std(a.segment_traffic_std, UrgentStdType::Write);
-                        double b_score = traffic_weight * b.traffic.write_urgent_sum + iops_weight * b.iops.write_urgent_sum + latency_weight * b.latency.write_urgent_sum - std_weight * calculate_average_urgent_std(b.segment_traffic_std, UrgentStdType::Write);
-                        return a_score > b_score;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        double a_score = traffic_weight * a.traffic.read_urgent_sum + iops_weight * a.iops.read_urgent_sum + latency_weight * a.latency.read_urgent_sum - std_weight * calculate_average_urgent_std(a.segment_traffic_std, UrgentStdType::Read);
-                        double b_score = traffic_weight * b.traffic.read_urgent_sum + iops_weight * b.iops.read_urgent_sum + latency_weight * b.latency.read_urgent_sum - std_weight * calculate_average_urgent_std(b.segment_traffic_std, UrgentStdType::Read);
-                        return a_score > b_score;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::wrTrafficStd:
-                std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                    uint64_t a_traffic = a.traffic.write_urgent_sum + a.traffic.read_urgent_sum;
-                    uint64_t b_traffic = b.traffic.write_urgent_sum + b.traffic.read_urgent_sum;
-                    double a_std = calculate_average_urgent_std(a.segment_traffic_std, UrgentStdType::All);
-                    double b_std = calculate_average_urgent_std(b.segment_traffic_std, UrgentStdType::All);
-                    return (W_TRAFFIC * a_traffic - W_STD * a_std) > (W_TRAFFIC * b_traffic - W_STD * b_std);
-                });
-                break;
-            case SortType::Latency:
-                if (sort_type == "write"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        return a.latency.write_urgent_sum > b.latency.write_urgent_sum;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        return a.latency.read_urgent_sum > b.latency.read_urgent_sum;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::LatencyPerIops:
-                if (sort_type == "write"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        if (a.iops.write_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.iops.write_urgent_sum == 0){
-                            return true;
-                        }
-                        return a.latency.write_urgent_sum / a.iops.write_urgent_sum > b.latency.write_urgent_sum / b.iops.write_urgent_sum;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(devices.begin(), devices.end(), [](const DeviceSummary& a, const DeviceSummary& b) {
-                        if (a.iops.read_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.iops.read_urgent_sum == 0){
-                            return true;
-                        }
-                        return a.latency.read_urgent_sum / a.iops.read_urgent_sum > b.latency.read_urgent_sum / b.iops.read_urgent_sum;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            default:
-                std::cerr << "Invalid sort flag: " << sort_flag << std::endl;
-                exit(EXIT_FAILURE);
-        }
-        sortedBsMap[bs_ip] = std::move(devices);
+        sortDevices(devMap, sortedBsMap[bsEntry.first], write, sortType, model.window, params, top_k, traffic_floor);
     }
     return maxblastradius;
 }
 
-int16_t sortBsSegMap(BsSegTrafficMap& bssegmap, std::string sort_type, int sort_flag, double w_traffic, double w_read_traffic_ratio){
-    int16_t maxblastradius = 0;
+void sortSegments(std::vector<SegmentSummary>& segVec, bool write, SortType sortType, RankWindow window, const RankParams& params){
+    std::vector<double> keys;
+    RankKeyFill<SegmentSummary> fill = {segVec, params, keys};
+    visit_segment_rank(sortType, write, window, fill);
+    apply_rank_order(segVec, rank_order(keys));
+}
+
+int16_t sortBsSegMap(BsSegTrafficMap& bssegmap, std::string sort_type, int sort_flag, const ScoringModel& model){
+    PhaseTimer timer(MergePhase::Rank);
+    bool write = is_write_rank(sort_type);
     SortType sortType = static_cast<SortType>(sort_flag);
+    RankParams params = compile_rank_params(model, sortType, write, bssegmap);
+    int16_t maxblastradius = 0;
     for(auto& bsEntry : bssegmap){
-        std::string bs_ip = bsEntry.first;
         auto& segVec = bsEntry.second;
         maxblastradius = std::max(maxblastradius, static_cast<int16_t>(segVec.size()));
-        switch (sortType)
-        {
-            case SortType::Traffic:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return a.traffic.write_urgent_sum > b.traffic.write_urgent_sum;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return a.traffic.read_urgent_sum > b.traffic.read_urgent_sum;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficStd:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        return (w_traffic * a.traffic.write_urgent_sum - (1-w_traffic) * a.traffic_std.write_urgent_std) > (w_traffic * b.traffic.write_urgent_sum - (1-w_traffic) * b.traffic_std.write_urgent_std);
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        return (w_traffic * a.traffic.read_urgent_sum - (1-w_traffic) * a.traffic_std.read_urgent_std) > (w_traffic * b.traffic.read_urgent_sum - (1-w_traffic) * b.traffic_std.read_urgent_std);
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficIopsLatency:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return (traffic_weight * a.traffic.write_urgent_sum + iops_weight * a.iops.write_urgent_sum + latency_weight * a.latency.write_urgent_sum - std_weight * a.traffic_std.write_urgent_std ) > (traffic_weight * b.traffic.write_urgent_sum + iops_weight * b.iops.write_urgent_sum + latency_weight * b.latency.write_urgent_sum - std_weight * b.traffic_std.write_urgent_std);
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return (traffic_weight * a.traffic.read_urgent_sum + iops_weight * a.iops.read_urgent_sum + latency_weight * a.latency.read_urgent_sum - std_weight * a.traffic_std.read_urgent_std ) > (traffic_weight * b.traffic.read_urgent_sum + iops_weight * b.iops.read_urgent_sum + latency_weight * b.latency.read_urgent_sum - std_weight * b.traffic_std.read_urgent_std);
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::wrTrafficStd:
-                std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                    uint64_t a_traffic = a.traffic.write_urgent_sum + a.traffic.read_urgent_sum;
-                    double a_std = a.traffic_std.write_urgent_std + a.traffic_std.read_urgent_std;
-                    uint64_t b_traffic = b.traffic.write_urgent_sum + b.traffic.read_urgent_sum;
-                    double b_std = b.traffic_std.write_urgent_std + b.traffic_std.read_urgent_std;
-                    return (W_TRAFFIC * a_traffic - W_STD * a_std) > (W_TRAFFIC * b_traffic - W_STD * b_std);
-                });
-                break;
-            case SortType::Latency:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return a.latency.write_urgent_sum > b.latency.write_urgent_sum;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return a.latency.read_urgent_sum > b.latency.read_urgent_sum;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::LatencyPerIops:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.iops.write_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.iops.write_urgent_sum == 0){
-                            return true;
-                        }
-                        return a.latency.write_urgent_sum / a.iops.write_urgent_sum > b.latency.write_urgent_sum / b.iops.write_urgent_sum;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.iops.read_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.iops.read_urgent_sum == 0){
-                            return true;
-                        }
-                        return a.latency.read_urgent_sum / a.iops.read_urgent_sum > b.latency.read_urgent_sum / b.iops.read_urgent_sum;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficStdLong:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return (W_TRAFFIC_URGENT * a.traffic.write_urgent_sum - W_STD_URGENT * a.traffic_std.write_urgent_std - W_STD_INSTANT * a.traffic_std.write_instant_std) > (W_TRAFFIC_URGENT * b.traffic.write_urgent_sum - W_STD_URGENT * b.traffic_std.write_urgent_std - W_STD_INSTANT * b.traffic_std.write_instant_std);
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        return (W_TRAFFIC_URGENT * a.traffic.read_urgent_sum - W_STD_URGENT * a.traffic_std.read_urgent_std - W_STD_INSTANT * a.traffic_std.read_instant_std) > (W_TRAFFIC_URGENT * b.traffic.read_urgent_sum - W_STD_URGENT * b.traffic_std.read_urgent_std - W_STD_INSTANT * b.traffic_std.read_instant_std);
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficStdScore:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.write_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.write_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = (w_traffic * a.traffic.write_urgent_sum - (1-w_traffic) * a.traffic_std.write_urgent_std) * a.iops.write_urgent_sum / a.latency.write_urgent_sum;
-                        double b_score = (w_traffic * b.traffic.write_urgent_sum - (1-w_traffic) * b.traffic_std.write_urgent_std) * b.iops.write_urgent_sum / b.latency.write_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.read_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.read_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = (w_traffic * a.traffic.read_urgent_sum - (1-w_traffic) * a.traffic_std.read_urgent_std) * a.iops.read_urgent_sum / a.latency.read_urgent_sum;
-                        double b_score = (w_traffic * b.traffic.read_urgent_sum - (1-w_traffic) * b.traffic_std.read_urgent_std) * b.iops.read_urgent_sum / b.latency.read_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficStdLatScore:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.write_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.write_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = (w_traffic * a.traffic.write_urgent_sum - (1-w_traffic) * a.traffic_std.write_urgent_std) * a.latency.write_urgent_sum;
-                        double b_score = (w_traffic * b.traffic.write_urgent_sum - (1-w_traffic) * b.traffic_std.write_urgent_std) * b.latency.write_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.read_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.read_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = (w_traffic * a.traffic.read_urgent_sum - (1-w_traffic) * a.traffic_std.read_urgent_std) * a.latency.read_urgent_sum;
-                        double b_score = (w_traffic * b.traffic.read_urgent_sum - (1-w_traffic) * b.traffic_std.read_urgent_std) * b.latency.read_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficStdIopsScore:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.write_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.write_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = (w_traffic * a.traffic.write_urgent_sum - (1-w_traffic) * a.traffic_std.write_urgent_std) / a.iops.write_urgent_sum;
-                        double b_score = (w_traffic * b.traffic.write_urgent_sum - (1-w_traffic) * b.traffic_std.write_urgent_std) / b.iops.write_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [&w_traffic](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.read_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.read_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = (w_traffic * a.traffic.read_urgent_sum - (1-w_traffic) * a.traffic_std.read_urgent_std) / a.iops.read_urgent_sum;
-                        double b_score = (w_traffic * b.traffic.read_urgent_sum - (1-w_traffic) * b.traffic_std.read_urgent_std) / b.iops.read_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::TrafficScore:
-                if (sort_type == "write"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.write_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.write_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = a.traffic.write_urgent_sum * a.iops.write_urgent_sum / a.latency.write_urgent_sum;
-                        double b_score = b.traffic.write_urgent_sum * b.iops.write_urgent_sum / b.latency.write_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else if (sort_type == "read"){
-                    std::sort(segVec.begin(), segVec.end(), [](const SegmentSummary& a, const SegmentSummary& b){
-                        if (a.latency.read_urgent_sum == 0){
-                            return false;
-                        }
-                        if (b.latency.read_urgent_sum == 0){
-                            return true;
-                        }
-                        double a_score = a.traffic.read_urgent_sum * a.iops.read_urgent_sum / a.latency.read_urgent_sum;
-                        double b_score = b.traffic.read_urgent_sum * b.iops.read_urgent_sum / b.latency.read_urgent_sum;
-                        return a_score > b_score;
-                    });
-                }
-                else{
-                    std::cerr << "Invalid sort type: " << sort_type << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case SortType::ReadRatio:
-                assert(sort_type == "read");
-                std::sort(segVec.begin(), segVec.end(), [&w_read_traffic_ratio](const SegmentSummary& a, const SegmentSummary& b){
-                    double a_score = w_read_traffic_ratio * a.traffic.read_urgent_sum - (1-w_read_traffic_ratio) * a.traffic.write_urgent_sum;
-                    double b_score = w_read_traffic_ratio * b.traffic.read_urgent_sum - (1-w_read_traffic_ratio) * b.traffic.write_urgent_sum;
-                    return a_score > b_score;
-                });
-                break;
-            default:
-                std::cerr << "Invalid sort flag: " << sort_flag << std::endl;
-                exit(EXIT_FAILURE);
-        }
+        sortSegments(segVec, write, sortType, model.window, params);
     }
     return maxblastradius;
 }
-
-int16_t sortBsSegScoreMap(BsSegScoreMap& bssegmap, std::string sort_type){
+int16_t sortBsSegScoreMap(BsSegScoreMap& bssegmap, std::string sort_type, size_t top_k){
+    PhaseTimer timer(MergePhase::Rank);
+    // the scores are computed once when the summaries are built
+    double SegmentScoreSummary::*score = is_write_rank(sort_type) ? &SegmentScoreSummary::write_score : &SegmentScoreSummary::read_score;
+    auto cmp = [score](const SegmentScoreSummary& a, const SegmentScoreSummary& b){
+        return a.*score > b.*score;
+    };
     int16_t maxblastradius = 0;
     for(auto& bsEntry : bssegmap){
-        std::string bs_ip = bsEntry.first;
         auto& segVec = bsEntry.second;
         maxblastradius = std::max(maxblastradius, static_cast<int16_t>(segVec.size()));
-        if (sort_type == "write"){
-            std::sort(segVec.begin(), segVec.end(), [](const SegmentScoreSummary& a, const SegmentScoreSummary& b){
-                return a.write_score > b.write_score;
-            });
-        }
-        else if (sort_type == "read"){
-            std::sort(segVec.begin(), segVec.end(), [](const SegmentScoreSummary& a, const SegmentScoreSummary& b){
-                return a.read_score > b.read_score;
-            });
-        }
-        else{
-            std::cerr << "Invalid sort type: " << sort_type << std::endl;
-            exit(EXIT_FAILURE);
+        bool bounded = top_k > 0 && top_k < segVec.size();
+        auto middle = bounded ? segVec.begin() + top_k : segVec.end();
+        bounded ? std::partial_sort(segVec.begin(), middle, segVec.end(), cmp) : std::sort(segVec.begin(), segVec.end(), cmp);
+        segVec.erase(middle, segVec.end());
+    }
+    return maxblastradius;
+}
+
+int16_t rank_segment_scores(const std::vector<SegmentScoreSummary>& scored, const std::vector<uint32_t>& start, std::string sort_type, size_t top_k, RankOrder& ranked){
+    PhaseTimer timer(MergePhase::Rank);
+    double SegmentScoreSummary::*score = is_write_rank(sort_type) ? &SegmentScoreSummary::write_score : &SegmentScoreSummary::read_score;
+    auto cmp = [&scored, score](uint32_t a, uint32_t b){
+        return scored[a].*score > scored[b].*score;
+    };
+    ranked.start.assign(1, 0);
+    ranked.index.clear();
+    ranked.index.reserve(scored.size());
+    int16_t maxblastradius = 0;
+    for (size_t bs = 0; bs + 1 < start.size(); ++bs) {
+        size_t num = start[bs + 1] - start[bs];
+        maxblastradius = std::max(maxblastradius, static_cast<int16_t>(num));
+        size_t base = ranked.index.size();
+        for (uint32_t i = start[bs]; i < start[bs + 1]; ++i) {
+            ranked.index.push_back(i);
         }
+        auto first = ranked.index.begin() + base;
+        bool bounded = top_k > 0 && top_k < num;
+        auto middle = bounded ? first + top_k : ranked.index.end();
+        bounded ? std::partial_sort(first, middle, ranked.index.end(), cmp) : std::sort(first, ranked.index.end(), cmp);
+        ranked.index.erase(middle, ranked.index.end());
+        ranked.start.push_back(ranked.index.size());
     }
     return maxblastradius;
 }
 
 #if not IF_PYBIND11
+// Benchmark build, one JSON line per phase and table shape:
+//   g++ -O3 -DIF_PYBIND11=0 -o bench_read_and_merge ./cpp_code/read_and_merge.cpp -std=c++11 -pthread
+//   ./bench_read_and_merge --records 10000,100000,1000000 --bs 16,128 --iters 5
+//   ./bench_read_and_merge --path /var/run/pangu_blockmaster_seg_iostats
+// Every table shape runs in a forked child so its RSS is not inherited from
+// another shape. ru_maxrss only ever rises within that child, so each phase
+// line's max_rss_so_far_kb is the peak of its shape up to and including that
+// phase, not the phase's own peak.
 #include <chrono>
-int main() {
-    while(1){
-        auto start = std::chrono::high_resolution_clock::now();
-        auto return_msg = merge_bs_segment();
-        auto end = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> elapsed = end - start;
-        std::cout << std::fixed << std::setprecision(6) << "Total execution time: " << elapsed.count() << " seconds" << std::endl;
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+std::atomic<uint64_t> benchAllocs(0);
+std::atomic<uint64_t> benchAllocBytes(0);
+
+// Every replaceable new/delete form goes through these two. They stay out of
+// line so the compiler never inlines a free() next to the builtin operator new
+// and reports the pair as mismatched.
+__attribute__((noinline)) void* bench_alloc(size_t size) noexcept {
+    benchAllocs.fetch_add(1, std::memory_order_relaxed);
+    benchAllocBytes.fetch_add(size, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+__attribute__((noinline)) void bench_free(void* p) noexcept { free(p); }
+
+void* operator new(size_t size){
+    void* p = bench_alloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void* operator new[](size_t size){ return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return bench_alloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return bench_alloc(size); }
+void operator delete(void* p) noexcept { bench_free(p); }
+void operator delete[](void* p) noexcept { bench_free(p); }
+void operator delete(void* p, size_t) noexcept { bench_free(p); }
+void operator delete[](void* p, size_t) noexcept { bench_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { bench_free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { bench_free(p); }
+#ifdef __cpp_aligned_new
+__attribute__((noinline)) void* bench_alloc_aligned(size_t size, std::align_val_t align) noexcept {
+    benchAllocs.fetch_add(1, std::memory_order_relaxed);
+    benchAllocBytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = nullptr;
+    size_t alignment = std::max(static_cast<size_t>(align), sizeof(void*));
+    return posix_memalign(&p, alignment, size ? size : 1) == 0 ? p : nullptr;
+}
+void* operator new(size_t size, std::align_val_t align){
+    void* p = bench_alloc_aligned(size, align);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void* operator new[](size_t size, std::align_val_t align){ return operator new(size, align); }
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return bench_alloc_aligned(size, align); }
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return bench_alloc_aligned(size, align); }
+void operator delete(void* p, std::align_val_t) noexcept { bench_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { bench_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { bench_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { bench_free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { bench_free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { bench_free(p); }
+#endif
+
+struct BenchCase {
+    std::string path;
+    size_t records;
+    size_t bsNum;
+    int iters;
+    int threads;
+};
+
+std::vector<size_t> parse_sizes(const std::string& list){
+    std::vector<size_t> sizes;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        sizes.push_back(std::stoull(item));
+    }
+    return sizes;
+}
+
+// Devices of 16 segments spread over bs_num BSs with zipf-skewed traffic, like a
+// production table; written in the shm layout so the mmap reader can be timed too.
+// A blockmaster's share of a larger table starts at first_record.
+void write_bench_table(const std::string& path, size_t records, size_t bs_num, size_t first_record = 0, uint64_t load_version = 1){
+    std::mt19937_64 rng(records * 31 + bs_num + first_record);
+    std::uniform_int_distribution<size_t> pick_bs(0, bs_num - 1);
+    std::vector<SegmentShmIoStat> table(records);
+    for (size_t i = 0; i < records; ++i) {
+        SegmentShmIoStat& e = table[i];
+        memset(static_cast<void*>(&e), 0, sizeof(e));
+        e.segmentId.device_id = (first_record + i) / 16 + 1;
+        e.segmentId.segmentIdx = (first_record + i) % 16;
+        e.loadVersion = load_version;
+        e.bsId = static_cast<uint64_t>(pick_bs(rng) + 1) << 40 | static_cast<uint64_t>(0x401f) << 16;
+        int64_t scale = static_cast<int64_t>((1 << 24) / (1 + ((first_record + i) / 16) % 97));
+        int64_t* counters = &e.urgent_latency.writeLatency;
+        for (int c = 0; c < 18; ++c) {
+            counters[c] = rng() % scale;
+        }
+        double* stds = &e.urgent_flow_std.writeStd;
+        for (int c = 0; c < 6; ++c) {
+            stds[c] = static_cast<double>(rng() % scale);
+        }
+    }
+    ShmStatFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = 0x48434e4542ULL;
+    header.recordSize = sizeof(SegmentShmIoStat);
+    while ((static_cast<size_t>(1) << header.capacityBits) <= records) {
+        header.capacityBits++;
+    }
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == nullptr) {
+        std::cerr << "Failed to create file: " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(table.data(), sizeof(SegmentShmIoStat), table.size(), f);
+    fclose(f);
+    // pad to the full capacity with empty slots, as the blockmaster's file is
+    if (truncate(path.c_str(), sizeof(header) + (static_cast<size_t>(1) << header.capacityBits) * sizeof(SegmentShmIoStat)) == -1) {
+        std::cerr << "Failed to resize file: " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Runs fn iters times and prints its mean cost; setup runs untimed before each call.
+template <typename Setup, typename Fn>
+void bench_phase(const BenchCase& c, size_t records, const std::string& phase, Setup setup, Fn fn){
+    double total = 0;
+    uint64_t allocs = 0, bytes = 0;
+    for (int it = 0; it < c.iters; ++it) {
+        setup();
+        uint64_t allocs_before = benchAllocs.load(), bytes_before = benchAllocBytes.load();
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        allocs += benchAllocs.load() - allocs_before;
+        bytes += benchAllocBytes.load() - bytes_before;
+        total += std::chrono::duration<double>(end - start).count();
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double mean = total / c.iters;
+    printf("{\"records\": %zu, \"bs\": %zu, \"threads\": %d, \"phase\": \"%s\", \"iters\": %d, \"ms\": %.3f, \"ns_per_record\": %.2f, \"allocs\": %llu, \"alloc_bytes\": %llu, \"max_rss_so_far_kb\": %ld}\n",
+           records, c.bsNum, c.threads, phase.c_str(), c.iters, mean * 1e3, records ? mean * 1e9 / records : 0.0,
+           static_cast<unsigned long long>(allocs / c.iters), static_cast<unsigned long long>(bytes / c.iters), usage.ru_maxrss);
+    fflush(stdout);
+}
+
+void run_bench_case(const BenchCase& c){
+    set_merge_threads(c.threads);
+    std::vector<SegmentShmIoStat> records;
+    auto nothing = [](){};
+    bench_phase(c, c.records, "shm_read", nothing, [&](){ records = read_segment_iostats_mmap(c.path); });
+    size_t n = records.size();
+    if (c.records > 0) {
+        // the same table split over 3 blockmasters, each sharing 1/32 of its
+        // records with the next one, which holds them at a newer loadVersion
+        std::vector<std::string> paths;
+        for (size_t b = 0; b < 3; ++b) {
+            size_t first = c.records * b / 3;
+            size_t last = std::min(c.records, c.records * (b + 1) / 3 + c.records / 32);
+            paths.push_back(c.path + ".bm" + std::to_string(b));
+            write_bench_table(paths.back(), last - first, c.bsNum, first, b + 1);
+        }
+        std::vector<SegmentShmIoStat> merged;
+        bench_phase(c, c.records, "shm_read_3_blockmasters", nothing, [&](){ merged = read_segment_iostats(paths); });
+        if (merged.size() != n) {
+            std::cerr << "Merged " << merged.size() << " records of " << n << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        for (const auto& path : paths) {
+            unlink(path.c_str());
+        }
+    }
+
+    std::shared_ptr<SegmentSnapshot> snap;
+    auto fresh = [&](){ snap = std::make_shared<SegmentSnapshot>(records); };
+    bench_phase(c, n, "aggregate_bs", fresh, [&](){ snap->BsState(); });
+    auto summed = [&](){ fresh(); snap->BsState(); };
+    bench_phase(c, n, "segment_view", summed, [&](){ snap->BsSegments(); });
+    bench_phase(c, n, "device_view", summed, [&](){ snap->BsDevices(); });
+
+    fresh();
+    BsSegTrafficMap segMap;
+    BsDeviceTrafficMap devMap;
+    for (size_t bs = 0; bs < snap->BsNum(); ++bs) {
+        segMap[snap->BsIps()[bs]] = snap->BsSegments()[bs];
+        auto& bsDevMap = devMap[snap->BsIps()[bs]];
+        const auto& table = snap->BsDevices();
+        for (size_t j = table.bsStart[bs]; j < table.bsStart[bs + 1]; ++j) {
+            bsDevMap.emplace(table.devices[table.order[j]].device_id, table.Summary(table.order[j]));
+        }
+    }
+    BsSegTrafficMap sorted;
+    for (int flag = 0; flag <= static_cast<int>(SortType::TrafficStdIopsScore); ++flag) {
+        bench_phase(c, n, "sort_seg_" + std::to_string(flag), [&](){ sorted = segMap; }, [&](){ sortBsSegMap(sorted, flag == static_cast<int>(SortType::ReadRatio) ? "read" : "write", flag); });
+    }
+    for (int flag = 0; flag <= static_cast<int>(SortType::LatencyPerIops); ++flag) {
+        std::map<std::string, std::vector<DeviceSummary>> devSorted;
+        int bs_device_num = 0;
+        bench_phase(c, n, "sort_dev_" + std::to_string(flag), [&](){ devSorted.clear(); bs_device_num = 0; }, [&](){ sortBsDevMap(devMap, devSorted, bs_device_num, "write", flag); });
+    }
+    ReturnRwSegScoreStat scored = snap->MergeScoreRwSegment(7, 7, 0.6);
+    BsSegScoreMap scoreMap = scored.segments.Resolve(scored.segments.write);
+    BsSegScoreMap scoreSorted;
+    bench_phase(c, n, "sort_seg_score", [&](){ scoreSorted = scoreMap; }, [&](){ sortBsSegScoreMap(scoreSorted, "write"); });
+
+    // what one scheduling tick of omar and random costs end to end, minus pybind conversion
+    bench_phase(c, n, "merge_rw_segment_9_7", fresh, [&](){ snap->MergeRwSegment(9, 7); });
+    bench_phase(c, n, "merge_segment_0", fresh, [&](){ snap->MergeSegment(0); });
+    bench_phase(c, n, "merge_rw_device_0_0", fresh, [&](){ snap->MergeRwDevice(0, 0); });
+    bench_phase(c, n, "merge_rw_device_0_0_top16", fresh, [&](){ snap->MergeRwDevice(0, 0, 16); });
+
+    // rings of one sample, so every append also evicts the last one
+    SegmentLatencyStore latencyStore(1);
+    fresh();
+    latencyStore.Append(*snap);
+    bench_phase(c, n, "latency_store_append", nothing, [&](){ latencyStore.Append(*snap); });
+
+    HotspotDetector detector;
+    bench_phase(c, n, "detect_hotspots", summed, [&](){ detector.Update(*snap); });
+}
+
+void bench_usage(){
+    std::cerr << "usage: bench_read_and_merge [--records N,N,...] [--bs N,N,...] [--iters N] [--threads N] [--dir DIR] [--path FILE]" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> record_sizes = {10000, 100000, 1000000};
+    std::vector<size_t> bs_sizes = {16, 128};
+    std::string dir = "/dev/shm";
+    std::string path;
+    int iters = 5;
+    int threads = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string key = argv[i];
+        if (i + 1 >= argc) {
+            bench_usage();
+        }
+        std::string value = argv[++i];
+        if (key == "--records") record_sizes = parse_sizes(value);
+        else if (key == "--bs") bs_sizes = parse_sizes(value);
+        else if (key == "--iters") iters = std::max(1, std::stoi(value));
+        else if (key == "--threads") threads = std::stoi(value);
+        else if (key == "--dir") dir = value;
+        else if (key == "--path") path = value;
+        else bench_usage();
+    }
+
+    std::vector<BenchCase> cases;
+    if (!path.empty()) {
+        // an existing table, e.g. the live one: its own size and BS count
+        cases.push_back(BenchCase{path, 0, 0, iters, threads});
+    }
+    else {
+        for (size_t records : record_sizes) {
+            for (size_t bs_num : bs_sizes) {
+                cases.push_back(BenchCase{dir + "/bench_seg_iostats_" + std::to_string(records) + "_" + std::to_string(bs_num), records, bs_num, iters, threads});
+            }
+        }
+    }
+    for (const auto& c : cases) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (c.records > 0) {
+                write_bench_table(c.path, c.records, c.bsNum);
+            }
+            run_bench_case(c);
+            if (c.records > 0) {
+                unlink(c.path.c_str());
+            }
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "Benchmark case failed: " << c.path << std::endl;
+            return EXIT_FAILURE;
+        }
     }
+    return 0;
 }
 
 #else
 #include <pybind11/pybind11.h>
 #include <pybind11/stl_bind.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
 namespace py = pybind11;
 
+// Read-only NumPy view over a vector owned by a snapshot or sampler view. The
+// owner is the array's base, so the memory stays alive as long as the array does.
+template <typename Owner, typename T>
+py::array snapshot_array(const std::shared_ptr<Owner>& owner, const std::vector<T>& values){
+    py::array_t<T> arr({values.size()}, {sizeof(T)}, values.data(), py::cast(owner));
+    arr.attr("setflags")(py::arg("write") = false);
+    return arr;
+}
+
+// The result maps are converted to Python on every attribute access, so the
+// getter is timed as MergePhase::Convert. Elements keep the result alive, as
+// with def_readwrite.
+template <typename C, typename T>
+void def_timed_map(py::class_<C>& cls, const char* name, T C::*member){
+    cls.def_property(name,
+        [member](py::object self) {
+            PhaseTimer timer(MergePhase::Convert);
+            return py::cast(self.cast<const C&>().*member, py::return_value_policy::reference_internal, self);
+        },
+        [member](C& c, const T& value) { c.*member = value; });
+}
+
+// One BS of one ranking of a merge result, resolving its entries on access
+// instead of converting the whole list.
+template <typename T>
+struct RankedView {
+    py::object owner;  // the result, kept alive by the view
+    const RankedEntries<T>* ranked;
+    const RankOrder* order;
+    size_t bs;
+
+    size_t Size() const { return order->Size(bs); }
+    const T& At(int64_t i) const {
+        int64_t n = Size();
+        if (i < 0) {
+            i += n;
+        }
+        if (i < 0 || i >= n) {
+            throw py::index_error("ranking index out of range");
+        }
+        return ranked->At(*order, bs, i);
+    }
+};
+
+template <typename T>
+void def_ranked_view(py::module_& m, const char* name){
+    py::class_<RankedView<T>>(m, name)
+        .def("__len__", &RankedView<T>::Size)
+        .def("__getitem__", &RankedView<T>::At, py::return_value_policy::reference_internal)
+        .def("__iter__", [](py::object self) {
+            const auto& view = self.cast<const RankedView<T>&>();
+            py::list items;
+            for (size_t i = 0; i < view.Size(); ++i) {
+                items.append(py::cast(view.At(i), py::return_value_policy::reference_internal, self));
+            }
+            return py::iter(items);
+        });
+}
+
+// A ranking of a result as {bs ip: view}, keyed like the maps the merges
+// used to return; only the views are built on each access.
+template <typename C, typename T>
+void def_ranking(py::class_<C>& cls, const char* name, RankedEntries<T> C::*member, RankOrder RankedEntries<T>::*order){
+    cls.def_property_readonly(name, [member, order](py::object self) {
+        PhaseTimer timer(MergePhase::Convert);
+        const auto& ranked = self.cast<const C&>().*member;
+        py::dict out;
+        for (size_t b = 0; b < ranked.bs.size(); ++b) {
+            RankedView<T> view = {self, &ranked, &(ranked.*order), b};
+            out[py::str(ranked.bs[b])] = py::cast(view);
+        }
+        return out;
+    });
+}
+
 PYBIND11_MODULE(read_and_merge, m) {
+    PYBIND11_NUMPY_DTYPE(SegmentId, device_id, segmentIdx, padding);
+    PYBIND11_NUMPY_DTYPE(LatencyStat, writeLatency, readLatency);
+    PYBIND11_NUMPY_DTYPE(IopsStat, writeIops, readIops);
+    PYBIND11_NUMPY_DTYPE(FlowStat, writeBytes, readBytes);
+    PYBIND11_NUMPY_DTYPE(FlowStdStat, writeStd, readStd);
+    PYBIND11_NUMPY_DTYPE(SegmentShmIoStat, segmentId, loadVersion, bsId, urgent_latency, instant_latency, longterm_latency, urgent_iops, instant_iops, longterm_iops, urgent_flow, instant_flow, longterm_flow, urgent_flow_std, instant_flow_std, longterm_flow_std);
+    PYBIND11_NUMPY_DTYPE(SumTraffic, read_urgent_sum, write_urgent_sum, read_instant_sum, write_instant_sum, read_longterm_sum, write_longterm_sum);
+    PYBIND11_NUMPY_DTYPE(SumLatency, read_urgent_sum, write_urgent_sum, read_instant_sum, write_instant_sum, read_longterm_sum, write_longterm_sum);
+    PYBIND11_NUMPY_DTYPE(SumIops, read_urgent_sum, write_urgent_sum, read_instant_sum, write_instant_sum, read_longterm_sum, write_longterm_sum);
+    PYBIND11_NUMPY_DTYPE(BsSumState, mTrafficSum, mLatencySum, mIopsSum);
+    PYBIND11_NUMPY_DTYPE(SampledTraffic, read, write, readEwma, writeEwma, readPeak, writePeak);
+
     py::class_<SumTraffic>(m, "SumTraffic")
         .def(py::init<>())
         .def_readwrite("read_urgent_sum", &SumTraffic::read_urgent_sum)
@@ -925,44 +3543,252 @@ PYBIND11_MODULE(read_and_merge, m) {
         .def_readwrite("avg_br", &BlastRadius::avgblastradius)
         .def_readwrite("max_br", &BlastRadius::maxblastradius);
 
-    py::class_<ReturnSegStat>(m, "ReturnSegStat")
-        .def(py::init<>())
-        .def_readwrite("bs_flow", &ReturnSegStat::bs_flow)
-        .def_readwrite("sort_bs_seg", &ReturnSegStat::sortSegMap)
+    py::class_<ReturnSegStat> segStat(m, "ReturnSegStat");
+    segStat.def(py::init<>())
         .def_readwrite("blast_radius", &ReturnSegStat::blastRadius);
+    def_timed_map(segStat, "bs_flow", &ReturnSegStat::bs_flow);
+    def_timed_map(segStat, "sort_bs_seg", &ReturnSegStat::sortSegMap);
 
-    py::class_<ReturnDevStat>(m, "ReturnDevStat")
-        .def(py::init<>())
-        .def_readwrite("bs_flow", &ReturnDevStat::bs_flow)
-        .def_readwrite("sort_bs_dev", &ReturnDevStat::sortDevMap)
+    py::class_<ReturnDevStat> devStat(m, "ReturnDevStat");
+    devStat.def(py::init<>())
         .def_readwrite("blast_radius", &ReturnDevStat::blastRadius);
+    def_timed_map(devStat, "bs_flow", &ReturnDevStat::bs_flow);
+    def_timed_map(devStat, "sort_bs_dev", &ReturnDevStat::sortDevMap);
 
-    py::class_<ReturnRwSegStat>(m, "ReturnRwSegStat")
-        .def(py::init<>())
-        .def_readwrite("bs_flow", &ReturnRwSegStat::bs_flow)
-        .def_readwrite("sort_write_seg", &ReturnRwSegStat::sortWriteSegMap)
-        .def_readwrite("sort_read_seg", &ReturnRwSegStat::sortReadSegMap)
+    def_ranked_view<SegmentSummary>(m, "RankedSegments");
+    def_ranked_view<SegmentScoreSummary>(m, "RankedScoreSegments");
+    def_ranked_view<DeviceSummary>(m, "RankedDevices");
+
+    py::class_<ReturnRwSegStat> rwSegStat(m, "ReturnRwSegStat");
+    rwSegStat.def(py::init<>())
         .def_readwrite("blast_radius", &ReturnRwSegStat::blastRadius);
+    def_timed_map(rwSegStat, "bs_flow", &ReturnRwSegStat::bs_flow);
+    def_ranking(rwSegStat, "sort_write_seg", &ReturnRwSegStat::segments, &RankedEntries<SegmentSummary>::write);
+    def_ranking(rwSegStat, "sort_read_seg", &ReturnRwSegStat::segments, &RankedEntries<SegmentSummary>::read);
 
-    py::class_<ReturnRwDevStat>(m, "ReturnRwDevStat")
-        .def(py::init<>())
-        .def_readwrite("bs_flow", &ReturnRwDevStat::bs_flow)
-        .def_readwrite("sort_write_dev", &ReturnRwDevStat::sortWriteDevMap)
-        .def_readwrite("sort_read_dev", &ReturnRwDevStat::sortReadDevMap)
+    py::class_<ReturnRwDevStat> rwDevStat(m, "ReturnRwDevStat");
+    rwDevStat.def(py::init<>())
         .def_readwrite("blast_radius", &ReturnRwDevStat::blastRadius);
+    def_timed_map(rwDevStat, "bs_flow", &ReturnRwDevStat::bs_flow);
+    def_ranking(rwDevStat, "sort_write_dev", &ReturnRwDevStat::devices, &RankedEntries<DeviceSummary>::write);
+    def_ranking(rwDevStat, "sort_read_dev", &ReturnRwDevStat::devices, &RankedEntries<DeviceSummary>::read);
 
-    py::class_<ReturnRwSegScoreStat>(m, "ReturnRwSegScoreStat")
-        .def(py::init<>())
-        .def_readwrite("bs_score_flow", &ReturnRwSegScoreStat::bs_score_flow)
-        .def_readwrite("sort_write_seg", &ReturnRwSegScoreStat::sortWriteSegMap)
-        .def_readwrite("sort_read_seg", &ReturnRwSegScoreStat::sortReadSegMap)
+    py::class_<ReturnRwSegScoreStat> rwSegScoreStat(m, "ReturnRwSegScoreStat");
+    rwSegScoreStat.def(py::init<>())
         .def_readwrite("blast_radius", &ReturnRwSegScoreStat::blastRadius);
+    def_timed_map(rwSegScoreStat, "bs_score_flow", &ReturnRwSegScoreStat::bs_score_flow);
+    def_ranking(rwSegScoreStat, "sort_write_seg", &ReturnRwSegScoreStat::segments, &RankedEntries<SegmentScoreSummary>::write);
+    def_ranking(rwSegScoreStat, "sort_read_seg", &ReturnRwSegScoreStat::segments, &RankedEntries<SegmentScoreSummary>::read);
+
+    py::class_<SegmentMove>(m, "SegmentMove")
+        .def_readonly("segment_id", &SegmentMove::segmentId)
+        .def_readonly("from_bs", &SegmentMove::fromBs)
+        .def_readonly("to_bs", &SegmentMove::toBs)
+        .def_readonly("load_version", &SegmentMove::loadVersion);
+
+    py::class_<SegmentSnapshot, std::shared_ptr<SegmentSnapshot>>(m, "SegmentSnapshot")
+        .def_property_readonly("record_num", [](const SegmentSnapshot& s) { return s.Records().size(); })
+        .def_property_readonly("is_delta", &SegmentSnapshot::IsDelta)
+        .def_property_readonly("changed_record_num", &SegmentSnapshot::ChangedRecords)
+        .def_property_readonly("moved_segments", &SegmentSnapshot::Moves)
+        .def_property_readonly("bs_num", &SegmentSnapshot::BsNum)
+        .def_property_readonly("bs_ips", &SegmentSnapshot::BsIps)
+        .def("records", [](const std::shared_ptr<SegmentSnapshot>& s) { return snapshot_array(s, s->Records()); }, "Raw segment stat records of this snapshot as a read-only structured array, without copying")
+        .def("record_bs", [](const std::shared_ptr<SegmentSnapshot>& s) { return snapshot_array(s, s->RecordBs()); }, "Index into bs_ips of each record, without copying")
+        .def("bs_state", [](const std::shared_ptr<SegmentSnapshot>& s) { return snapshot_array(s, s->BsState()); }, "Per-BS sums in bs_ips order as a read-only structured array, without copying")
+        .def("bs_stat", [](SegmentSnapshot& s) { return s.BsFlow(); }, "BS statistics of this snapshot", pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("merge_bs_device", &SegmentSnapshot::MergeDevice, "Merge BS device statistics of this snapshot", pybind11::arg("sort_flag")=0, pybind11::arg("top_k")=0, pybind11::arg("traffic_floor")=0, pybind11::arg("model")=pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("merge_bs_segment", &SegmentSnapshot::MergeSegment, "Merge BS segment statistics of this snapshot", pybind11::arg("sort_flag")=0, pybind11::arg("top_k")=0, pybind11::arg("traffic_floor")=0, pybind11::arg("model")=pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("merge_bs_rw_device", &SegmentSnapshot::MergeRwDevice, "Merge BS read/write device statistics of this snapshot", pybind11::arg("r_sort_flag") = 0, pybind11::arg("w_sort_flag") = 0, pybind11::arg("top_k") = 0, pybind11::arg("traffic_floor") = 0, pybind11::arg("model") = pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("merge_bs_rw_segment", &SegmentSnapshot::MergeRwSegment, "Merge BS read/write segment statistics of this snapshot", pybind11::arg("r_sort_flag") = 0, pybind11::arg("w_sort_flag") = 0, pybind11::arg("top_k") = 0, pybind11::arg("traffic_floor") = 0, pybind11::arg("model") = pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("merge_bsscore_rw_segment", &SegmentSnapshot::MergeScoreRwSegment, "Merge BS score, and read/write segment statistics of this snapshot", pybind11::arg("r_sort_flag"), pybind11::arg("w_sort_flag"), pybind11::arg("w1"), pybind11::arg("top_k") = 0, pybind11::arg("model") = pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("simulate_moves", &simulate_moves, "Projected BS sums, skews and blast radius of this snapshot after a move plan", pybind11::arg("moves"), pybind11::call_guard<pybind11::gil_scoped_release>())
+        .def("simulate_move_plans", &simulate_move_plans, "simulate_moves for each of several plans, evaluated in parallel", pybind11::arg("plans"), pybind11::call_guard<pybind11::gil_scoped_release>());
+
+    py::class_<SampledTraffic>(m, "SampledTraffic")
+        .def_readonly("read", &SampledTraffic::read)
+        .def_readonly("write", &SampledTraffic::write)
+        .def_readonly("read_ewma", &SampledTraffic::readEwma)
+        .def_readonly("write_ewma", &SampledTraffic::writeEwma)
+        .def_readonly("read_peak", &SampledTraffic::readPeak)
+        .def_readonly("write_peak", &SampledTraffic::writePeak);
+
+    py::class_<SamplerView, std::shared_ptr<SamplerView>>(m, "SamplerView")
+        .def_readonly("snapshot", &SamplerView::snapshot)
+        .def_readonly("sequence", &SamplerView::sequence)
+        .def_property_readonly("age_ms", &SamplerView::AgeMs)
+        .def_readonly("bs", &SamplerView::bs)
+        .def("segment", &SamplerView::Segment, "Sampled traffic of one segment, zero if it is not in this poll", pybind11::arg("segment_id"))
+        .def("segments", [](const std::shared_ptr<SamplerView>& v) { return snapshot_array(v, v->segments); }, "Sampled traffic aligned with snapshot.records() as a read-only structured array, without copying");
+
+    py::class_<LatencyWindowStat>(m, "LatencyWindowStat")
+        .def_readonly("count", &LatencyWindowStat::count)
+        .def_readonly("read_sum", &LatencyWindowStat::readSum)
+        .def_readonly("write_sum", &LatencyWindowStat::writeSum)
+        .def_property_readonly("read_mean", &LatencyWindowStat::ReadMean)
+        .def_property_readonly("write_mean", &LatencyWindowStat::WriteMean);
+
+    py::enum_<RankWindow>(m, "RankWindow")
+        .value("urgent", RankWindow::Urgent)
+        .value("instant", RankWindow::Instant)
+        .value("longterm", RankWindow::Longterm);
+
+    py::class_<LatencySketch>(m, "LatencySketch")
+        .def(py::init<double, size_t>(), pybind11::arg("accuracy") = 0.01, pybind11::arg("bins") = 2048)
+        .def_property_readonly("accuracy", &LatencySketch::Accuracy)
+        .def_property_readonly("bins", &LatencySketch::Bins)
+        .def_property_readonly("count", &LatencySketch::Count)
+        .def_property_readonly("p50", [](const LatencySketch& s) { return s.Percentile(50); })
+        .def_property_readonly("p99", [](const LatencySketch& s) { return s.Percentile(99); })
+        .def_property_readonly("p999", [](const LatencySketch& s) { return s.Percentile(99.9); })
+        .def("add", &LatencySketch::Add, "Count a value n times", pybind11::arg("value"), pybind11::arg("n") = 1)
+        .def("remove", &LatencySketch::Remove, "Take back a value counted before", pybind11::arg("value"), pybind11::arg("n") = 1)
+        .def("merge", &LatencySketch::Merge, "Add the counts of a sketch of the same accuracy, False if it differs", pybind11::arg("other"))
+        .def("percentile", &LatencySketch::Percentile, "Value at percentile q in [0, 100], within the sketch's relative accuracy", pybind11::arg("q"));
+
+    py::class_<SegmentLatencyStore>(m, "SegmentLatencyStore")
+        .def(py::init<size_t, RankWindow, double, size_t>(), pybind11::arg("capacity"), pybind11::arg("window") = RankWindow::Urgent, pybind11::arg("accuracy") = 0.01, pybind11::arg("bins") = 2048)
+        .def_property_readonly("capacity", &SegmentLatencyStore::Capacity)
+        .def_property_readonly("segment_num", &SegmentLatencyStore::SegmentNum)
+        .def_property_readonly("full", &SegmentLatencyStore::Full)
+        .def("append", &SegmentLatencyStore::Append, "Append the latencies of the store's window of every record of a snapshot", pybind11::arg("snapshot"))
+        .def("reset", &SegmentLatencyStore::Reset, "Drop all samples")
+        .def("cluster", &SegmentLatencyStore::Cluster, "Sums over every retained sample")
+        .def("segment", &SegmentLatencyStore::Segment, "Sums over the retained samples of one segment", pybind11::arg("segment_id"))
+        .def("bs", &SegmentLatencyStore::Bs, "Sums per BS the samples were taken on")
+        .def("segment_percentile", &SegmentLatencyStore::SegmentPercentile, "Latency percentile of one segment's window", pybind11::arg("segment_id"), pybind11::arg("q"), pybind11::arg("read") = true)
+        .def("cluster_percentile", &SegmentLatencyStore::ClusterPercentile, "Latency percentile over every retained sample", pybind11::arg("q"), pybind11::arg("read") = true)
+        .def("segment_sketch", &SegmentLatencyStore::SegmentSketch, "Sketch of one segment's retained samples", pybind11::arg("segment_id"), pybind11::arg("read") = true)
+        .def("cluster_sketch", &SegmentLatencyStore::ClusterSketch, "Sketch of every retained sample, kept as samples come and go", pybind11::arg("read") = true)
+        .def("bs_sketch", &SegmentLatencyStore::BsSketch, "Sketch per BS the samples were taken on", pybind11::arg("read") = true);
+
+    py::class_<HotspotConfig>(m, "HotspotConfig")
+        .def(py::init<>())
+        .def_readwrite("z_threshold", &HotspotConfig::zThreshold)
+        .def_readwrite("ratio_threshold", &HotspotConfig::ratioThreshold)
+        .def_readwrite("min_traffic", &HotspotConfig::minTraffic)
+        .def_readwrite("min_bs_traffic", &HotspotConfig::minBsTraffic)
+        .def_readwrite("top_k", &HotspotConfig::topK);
+
+    py::class_<Hotspot>(m, "Hotspot")
+        .def_readonly("segment_id", &Hotspot::segmentId)
+        .def_readonly("bs", &Hotspot::bs)
+        .def_readonly("read", &Hotspot::read)
+        .def_readonly("urgent", &Hotspot::urgent)
+        .def_readonly("instant", &Hotspot::instant)
+        .def_readonly("longterm", &Hotspot::longterm)
+        .def_readonly("z", &Hotspot::z)
+        .def_readonly("ratio", &Hotspot::ratio)
+        .def_readonly("sustained", &Hotspot::sustained)
+        .def_readonly("ticks", &Hotspot::ticks);
+
+    py::class_<HotspotReport>(m, "HotspotReport")
+        .def_readonly("sequence", &HotspotReport::sequence)
+        .def_readonly("segments", &HotspotReport::segments)
+        .def_readonly("bs", &HotspotReport::bs);
+
+    py::class_<HotspotDetector>(m, "HotspotDetector")
+        .def(py::init<const HotspotConfig&>(), pybind11::arg("config") = HotspotConfig())
+        .def_property("config", &HotspotDetector::Config, &HotspotDetector::SetConfig)
+        .def("update", &HotspotDetector::Update, "Flag the segments and BSs of a snapshot whose urgent traffic departs from their longterm baseline, ranked, with how many updates in a row each has been flagged", pybind11::arg("snapshot"), pybind11::call_guard<pybind11::gil_scoped_release>());
+
+    py::class_<SnapshotRecorder>(m, "SnapshotRecorder")
+        .def(py::init<const std::string&, uint64_t, uint64_t, uint32_t>(), pybind11::arg("dir"), pybind11::arg("max_bytes") = static_cast<uint64_t>(4) << 30, pybind11::arg("chunk_bytes") = static_cast<uint64_t>(64) << 20, pybind11::arg("keyframe_interval") = 64)
+        .def_property_readonly("tick_num", &SnapshotRecorder::TickNum)
+        .def_property_readonly("bytes", &SnapshotRecorder::Bytes)
+        .def("append", &SnapshotRecorder::Append, "Append the records of a snapshot as the next tick, stamped with the wall clock unless timestamp_us is given", pybind11::arg("snapshot"), pybind11::arg("timestamp_us") = 0, pybind11::call_guard<pybind11::gil_scoped_release>());
+
+    py::class_<SnapshotLog>(m, "SnapshotLog")
+        .def(py::init<const std::string&>(), pybind11::arg("dir"))
+        .def_property_readonly("tick_num", &SnapshotLog::TickNum)
+        .def("refresh", &SnapshotLog::Refresh, "Index the directory again, picking up ticks recorded since")
+        .def("timestamp", &SnapshotLog::Timestamp, "Timestamp in microseconds of a tick", pybind11::arg("tick"))
+        .def("find", &SnapshotLog::Find, "Last tick at or before timestamp_us, -1 if every tick is later", pybind11::arg("timestamp_us"))
+        .def("snapshot", &SnapshotLog::Snapshot, "Rebuild a recorded tick as a snapshot to merge and plan on, None if it cannot be read", pybind11::arg("tick"), pybind11::call_guard<pybind11::gil_scoped_release>());
+
+    py::class_<PlannedMove>(m, "PlannedMove")
+        .def_readonly("segment_id", &PlannedMove::segmentId)
+        .def_readonly("source_bs", &PlannedMove::sourceBs)
+        .def_readonly("target_bs", &PlannedMove::targetBs)
+        .def_readonly("read", &PlannedMove::read)
+        .def_readonly("urgent_traffic", &PlannedMove::urgentTraffic);
+
+    py::class_<RwMovePlan>(m, "RwMovePlan")
+        .def_readonly("moves", &RwMovePlan::moves)
+        .def_readonly("remain_tokens", &RwMovePlan::remainTokens)
+        .def_readonly("w_max_skew", &RwMovePlan::wMaxSkew)
+        .def_readonly("w_min_skew", &RwMovePlan::wMinSkew)
+        .def_readonly("r_max_skew", &RwMovePlan::rMaxSkew)
+        .def_readonly("r_min_skew", &RwMovePlan::rMinSkew);
+
+    py::enum_<ScoreNorm>(m, "ScoreNorm")
+        .value("none", ScoreNorm::None)
+        .value("max", ScoreNorm::Max);
+
+    py::class_<ScoringModel>(m, "ScoringModel")
+        .def(py::init<>())
+        .def_readwrite("traffic_weight", &ScoringModel::traffic_weight)
+        .def_readwrite("read_traffic_ratio", &ScoringModel::read_traffic_ratio)
+        .def_readwrite("urgent_traffic_weight", &ScoringModel::urgent_traffic_weight)
+        .def_readwrite("urgent_std_weight", &ScoringModel::urgent_std_weight)
+        .def_readwrite("instant_std_weight", &ScoringModel::instant_std_weight)
+        .def_readwrite("mix_traffic_weight", &ScoringModel::mix_traffic_weight)
+        .def_readwrite("mix_iops_weight", &ScoringModel::mix_iops_weight)
+        .def_readwrite("mix_latency_weight", &ScoringModel::mix_latency_weight)
+        .def_readwrite("mix_std_weight", &ScoringModel::mix_std_weight)
+        .def_readwrite("window", &ScoringModel::window)
+        .def_readwrite("norm", &ScoringModel::norm)
+        .def("__repr__", &ScoringModel::ToString);
+
+    py::class_<MoveCandidate>(m, "MoveCandidate")
+        .def(py::init<uint64_t, uint32_t, std::string>(), pybind11::arg("device_id"), pybind11::arg("segment_index"), pybind11::arg("target_bs"))
+        .def(py::init<const PlannedMove&>(), pybind11::arg("move"))
+        .def_readonly("segment_id", &MoveCandidate::segmentId)
+        .def_readonly("target_bs", &MoveCandidate::targetBs);
+    py::implicitly_convertible<PlannedMove, MoveCandidate>();
+
+    py::class_<PlanProjection> planProjection(m, "PlanProjection");
+    planProjection.def_readonly("w_max_skew", &PlanProjection::wMaxSkew)
+        .def_readonly("w_min_skew", &PlanProjection::wMinSkew)
+        .def_readonly("r_max_skew", &PlanProjection::rMaxSkew)
+        .def_readonly("r_min_skew", &PlanProjection::rMinSkew)
+        .def_readonly("blast_radius", &PlanProjection::blastRadius)
+        .def_readonly("applied_moves", &PlanProjection::appliedMoves)
+        .def_readonly("skipped_moves", &PlanProjection::skippedMoves);
+    def_timed_map(planProjection, "bs_flow", &PlanProjection::bs_flow);
+
+    py::class_<MergeStats>(m, "MergeStats")
+        .def_readonly("phase_ms", &MergeStats::phaseMs)
+        .def_readonly("phase_calls", &MergeStats::phaseCalls)
+        .def_readonly("table_reads", &MergeStats::tableReads)
+        .def_readonly("records", &MergeStats::records)
+        .def_readonly("bytes_scanned", &MergeStats::bytesScanned)
+        .def_readonly("torn_records", &MergeStats::tornRecords)
+        .def_readonly("duplicate_records", &MergeStats::duplicateRecords)
+        .def_readonly("bs_num", &MergeStats::bsNum)
+        .def_readonly("bs_ip_hits", &MergeStats::bsIpHits)
+        .def_readonly("bs_ip_misses", &MergeStats::bsIpMisses)
+        .def_readonly("summaries", &MergeStats::summaries)
+        .def_readonly("result_entries", &MergeStats::resultEntries)
+        .def_property_readonly("bs_ip_hit_rate", &MergeStats::BsIpHitRate)
+        .def("__repr__", &MergeStats::ToString);
 
-    m.def("merge_bs_device", &merge_bs_device, "A function that merges BS device statistics", pybind11::arg("sort_flag")=0);
-    m.def("merge_bs_segment", &merge_bs_segment, "A function that merges BS segment statistics", pybind11::arg("sort_flag")=0);
-    m.def("merge_bs_rw_device", &merge_bs_rw_device, "A function that merges BS read/write device statistics", pybind11::arg("r_sort_flag") = 0, pybind11::arg("w_sort_flag") = 0);
-    m.def("merge_bs_rw_segment", &merge_bs_rw_segment, "A function that merges BS read/write segment statistics", pybind11::arg("r_sort_flag") = 0, pybind11::arg("w_sort_flag") = 0, pybind11::arg("w_traffic") = W_TRAFFIC, pybind11::arg("w_read_traffic_ratio") = W_READ_TRAFFIC_RATIO);
-    m.def("merge_bsscore_rw_segment", &merge_bsscore_rw_segment, "A function that merges BS score, and read/write segment statistics");
-    m.def("bs_stat", &bs_stat, "A function that returns BS statistics");
+    m.def("merge_stats", &merge_stats, "Phase times and counters of the merge path since the last reset", pybind11::arg("reset")=false);
+    m.def("plan_rw_segment_moves", &plan_rw_segment_moves, "Greedy read-then-write segment move plan over a merge_bs_rw_segment result", pybind11::arg("res"), pybind11::arg("w_max_ratio"), pybind11::arg("w_min_ratio"), pybind11::arg("r_max_ratio"), pybind11::arg("r_min_ratio"), pybind11::arg("remain_tokens"), pybind11::arg("min_threshold"), pybind11::arg("min_segment_traffic"), pybind11::arg("max_w_skew"), pybind11::arg("max_r_skew"), pybind11::arg("max_borrow_tokens"));
+    m.def("set_stat_path", &set_stat_path, "Read the segment stat table from this file instead of the blockmaster's", pybind11::arg("path"));
+    m.def("set_stat_paths", &set_stat_paths, "Read the stat tables of several blockmasters concurrently and merge them into one snapshot, keeping the highest loadVersion of a segment found in more than one", pybind11::arg("paths"));
+    m.def("set_merge_threads", &set_merge_threads, "Set how many threads the snapshot scans use, 0 for one per core", pybind11::arg("threads"));
+    m.def("take_snapshot", &take_snapshot, "Read the segment stat table once, or reuse the last read if it is younger than max_age_ms. With incremental, BS sums are patched from the last snapshot. While the sampler runs, its latest poll", pybind11::arg("max_age_ms")=0, pybind11::arg("incremental")=false, pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("start_sampler", &start_sampler, "Poll the segment stat table every interval_ms on a native thread, keeping EWMA and peak traffic per segment and BS", pybind11::arg("interval_ms"), pybind11::arg("alpha")=0.3, pybind11::arg("incremental")=true, pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("stop_sampler", &stop_sampler, "Stop the sampler; merges read the table themselves again", pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("sampler_view", &sampler_view, "The sampler's latest poll, None if it is not running or has not polled yet. reset_peaks starts the peaks over at the next poll", pybind11::arg("reset_peaks")=false);
+    m.def("set_scoring_model", &set_scoring_model, "Rank with this model in every merge that is not passed one", pybind11::arg("model"));
+    m.def("scoring_model", &scoring_model, "A copy of the model merges rank with by default");
+    m.def("merge_bs_device", &merge_bs_device, "A function that merges BS device statistics", pybind11::arg("sort_flag")=0, pybind11::arg("top_k")=0, pybind11::arg("traffic_floor")=0, pybind11::arg("model")=pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("merge_bs_segment", &merge_bs_segment, "A function that merges BS segment statistics", pybind11::arg("sort_flag")=0, pybind11::arg("top_k")=0, pybind11::arg("traffic_floor")=0, pybind11::arg("model")=pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("merge_bs_rw_device", &merge_bs_rw_device, "A function that merges BS read/write device statistics", pybind11::arg("r_sort_flag") = 0, pybind11::arg("w_sort_flag") = 0, pybind11::arg("top_k") = 0, pybind11::arg("traffic_floor") = 0, pybind11::arg("model") = pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("merge_bs_rw_segment", &merge_bs_rw_segment, "A function that merges BS read/write segment statistics", pybind11::arg("r_sort_flag") = 0, pybind11::arg("w_sort_flag") = 0, pybind11::arg("top_k") = 0, pybind11::arg("traffic_floor") = 0, pybind11::arg("model") = pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("merge_bsscore_rw_segment", &merge_bsscore_rw_segment, "A function that merges BS score, and read/write segment statistics", pybind11::arg("r_sort_flag"), pybind11::arg("w_sort_flag"), pybind11::arg("w1"), pybind11::arg("top_k") = 0, pybind11::arg("model") = pybind11::none(), pybind11::call_guard<pybind11::gil_scoped_release>());
+    m.def("bs_stat", &bs_stat, "A function that returns BS statistics", pybind11::call_guard<pybind11::gil_scoped_release>());
 }
 #endif
@@ -2,29 +2,27 @@
 #define READ_AND_MERGE_H
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <limits>
 
+#ifndef IF_PYBIND11
 #define IF_PYBIND11 1
-#define W_TRAFFIC 0.7
-#define W_STD (1 - W_TRAFFIC)
-
-#define W_TRAFFIC_URGENT 0.4
-#define W_STD_URGENT 0.4
-#define W_STD_INSTANT (1 - W_TRAFFIC_URGENT - W_STD_URGENT)
-
-#define W_READ_TRAFFIC_RATIO 0.7
-
-std::map<std::string, float> weight_map = {
-    {"traffic", 0.5},
-    {"latency", 0.2},
-    {"iops", 0.1},
-    {"std", -0.2}
-};
-double traffic_weight = weight_map["traffic"];
-double latency_weight = weight_map["latency"];
-double iops_weight = weight_map["iops"];
-double std_weight = weight_map["std"];
+#endif
+#define SEG_IOSTATS_PATH "/var/run/pangu_blockmaster_seg_iostats"
+#define SHM_TORN_READ_RETRY 4
+#define MIN_RECORDS_PER_WORKER 4096
+#define RADIX_SORT_MIN 1024
+#define SNAPSHOT_LOG_MAGIC 0x474f4c5352414d4fULL  // "OMARSLOG"
 
 enum class SortType {
     Traffic = 0,
@@ -66,6 +64,12 @@ struct SegmentId {
     }
 };
 
+struct SegmentIdHash {
+    size_t operator()(const SegmentId& id) const {
+        return std::hash<uint64_t>()(id.device_id * 0x9E3779B97F4A7C15ULL + id.segmentIdx);
+    }
+};
+
 struct FlowStat {
     int64_t writeBytes;
     int64_t readBytes;
@@ -170,10 +174,14 @@ struct SegmentScoreSummary : public SegmentSummary{
     SegmentScoreSummary(SegmentId segmentId, SumTraffic traffic, SumLatency latency, SumIops iops, SegmentStdStat traffic_std, double readScore, double writeScore) : SegmentSummary(segmentId, traffic, latency, iops, traffic_std), read_score(readScore), write_score(writeScore) {}
 };
 
-double calculate_segment_score(const int64_t& urgent_traffic, const double& urgent_std, const int64_t& urgent_latency, const int64_t& urgent_iops, const SortType& sortType);
+double calculate_segment_score(const int64_t& urgent_traffic, const double& urgent_std, const int64_t& urgent_latency, const int64_t& urgent_iops, const SortType& sortType, double w_traffic);
 
 template <typename T>
 void AddValues(T& target, uint64_t read_urgent, uint64_t write_urgent, uint64_t read_instant, uint64_t write_instant, uint64_t read_longterm, uint64_t write_longterm);
+template <typename T>
+void AddValues(T& target, const T& values);
+template <typename T>
+void SubValues(T& target, const T& values);
 
 struct DeviceSummary{
     uint64_t device_id;
@@ -182,12 +190,27 @@ struct DeviceSummary{
     SumTraffic traffic;
     SumLatency latency;
     SumIops    iops;
+    // running sums of segment_traffic_std, added in the same order as
+    // calculate_average_urgent_std so the averages come out identical
+    double read_urgent_std_sum;
+    double write_urgent_std_sum;
+    double all_urgent_std_sum;
 
-    DeviceSummary() = default;
-    DeviceSummary(uint64_t device_id) : device_id(device_id), segment_index(), segment_traffic_std(), traffic(), latency(), iops() {}
+    DeviceSummary() : device_id(0), segment_index(), segment_traffic_std(), traffic(), latency(), iops(), read_urgent_std_sum(0), write_urgent_std_sum(0), all_urgent_std_sum(0) {}
+    DeviceSummary(uint64_t device_id) : device_id(device_id), segment_index(), segment_traffic_std(), traffic(), latency(), iops(), read_urgent_std_sum(0), write_urgent_std_sum(0), all_urgent_std_sum(0) {}
+    double AverageUrgentStd(UrgentStdType type) const {
+        if (segment_traffic_std.empty()) {
+            return 0.0;
+        }
+        double sum = type == UrgentStdType::Read ? read_urgent_std_sum : (type == UrgentStdType::Write ? write_urgent_std_sum : all_urgent_std_sum);
+        return sum / segment_traffic_std.size();
+    }
     void AddResult(uint32_t segment_idx, SegmentStdStat std, uint64_t read_urgent_sum, uint64_t write_urgent_sum, uint64_t read_instant_sum, uint64_t write_instant_sum, uint64_t read_longterm_sum, uint64_t write_longterm_sum, uint64_t read_urgent_latency, uint64_t write_urgent_latency, uint64_t read_instant_latency, uint64_t write_instant_latency, uint64_t read_longterm_latency, uint64_t write_longterm_latency, uint64_t read_urgent_iops, uint64_t write_urgent_iops, uint64_t read_instant_iops, uint64_t write_instant_iops, uint64_t read_longterm_iops, uint64_t write_longterm_iops){
         segment_index.push_back(segment_idx);
         segment_traffic_std.emplace_back(std);
+        read_urgent_std_sum += std.read_urgent_std;
+        write_urgent_std_sum += std.write_urgent_std;
+        all_urgent_std_sum += std.write_urgent_std + std.read_urgent_std;
         AddValues(traffic, read_urgent_sum, write_urgent_sum, read_instant_sum, write_instant_sum, read_longterm_sum, write_longterm_sum);
         AddValues(latency, read_urgent_latency, write_urgent_latency, read_instant_latency, write_instant_latency, read_longterm_latency, write_longterm_latency);
         AddValues(iops, read_urgent_iops, write_urgent_iops, read_instant_iops, write_instant_iops, read_longterm_iops, write_longterm_iops);
@@ -195,6 +218,83 @@ struct DeviceSummary{
 };
 bool operator==(const DeviceSummary& lhs, const DeviceSummary& rhs);
 
+// A device's sums in one BS, without its per-segment lists: those live in the
+// pooled arrays of the BsDeviceTable it belongs to.
+struct DeviceAggregate {
+    uint64_t device_id;
+    uint32_t bs;
+    uint32_t segment_begin;
+    uint32_t segment_num;
+    SumTraffic traffic;
+    SumLatency latency;
+    SumIops    iops;
+    double read_urgent_std_sum;
+    double write_urgent_std_sum;
+    double all_urgent_std_sum;
+
+    DeviceAggregate() : DeviceAggregate(0, 0) {}
+    DeviceAggregate(uint64_t device_id, uint32_t bs) : device_id(device_id), bs(bs), segment_begin(0), segment_num(0), traffic(), latency(), iops(), read_urgent_std_sum(0), write_urgent_std_sum(0), all_urgent_std_sum(0) {}
+    double AverageUrgentStd(UrgentStdType type) const {
+        if (segment_num == 0) {
+            return 0.0;
+        }
+        double sum = type == UrgentStdType::Read ? read_urgent_std_sum : (type == UrgentStdType::Write ? write_urgent_std_sum : all_urgent_std_sum);
+        return sum / segment_num;
+    }
+};
+
+// The devices of every BS of a snapshot in flat arrays. devices are in the
+// order the scan found them; BS bs owns order[bsStart[bs], bsStart[bs + 1]),
+// indices into devices ordered by device_id. Device d's segments are
+// segmentIndex/segmentStd[d.segment_begin, d.segment_begin + d.segment_num),
+// in table order.
+struct BsDeviceTable {
+    std::vector<DeviceAggregate> devices;
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> bsStart;
+    std::vector<uint32_t> segmentIndex;
+    std::vector<SegmentStdStat> segmentStd;
+
+    size_t BsNum() const { return bsStart.empty() ? 0 : bsStart.size() - 1; }
+    size_t DeviceNum(size_t bs) const { return bsStart[bs + 1] - bsStart[bs]; }
+    // the device as the merge results carry it, segment lists included
+    DeviceSummary Summary(size_t d) const;
+};
+
+// Groups records by (BS, device_id) through an open-addressing hash and
+// appends one DeviceAggregate per group to devices, so building the device
+// view costs a fixed number of allocations however many devices there are.
+// A device's records must be added in table order.
+class DeviceTableBuilder {
+public:
+    DeviceTableBuilder(std::vector<DeviceAggregate>& devices, size_t expected_records);
+    void Add(uint32_t bs, uint32_t record, const SegmentShmIoStat& e);
+    size_t DeviceNum() const { return mDevices.size() - mFirst; }
+    size_t SegmentNum() const { return mAdded.size(); }
+    // Lays the devices out in a table they were copied to from
+    // table.devices[device_offset]: their order from table.order[device_offset]
+    // and their segments from table.segmentIndex[segment_offset]. The table
+    // must already be large enough.
+    void Finish(const std::vector<SegmentShmIoStat>& records, BsDeviceTable& table, size_t device_offset, size_t segment_offset) const;
+
+private:
+    struct Slot {
+        uint64_t device_id;
+        uint32_t bs;
+        uint32_t device;  // EMPTY_SLOT when unused
+    };
+    static const uint32_t EMPTY_SLOT = 0xffffffff;
+    void Grow();
+
+    // power-of-two sized, at most half full
+    std::vector<Slot> mSlots;
+    std::vector<DeviceAggregate>& mDevices;
+    size_t mFirst;
+    uint32_t mBsNum;
+    // (record, device) in the order added
+    std::vector<std::pair<uint32_t, uint32_t>> mAdded;
+};
+
 struct BsSumState{
     SumTraffic  mTrafficSum;
     SumLatency  mLatencySum;
@@ -247,6 +347,46 @@ struct BlastRadius{
     int16_t maxblastradius;
 };
 
+// One ranking of a merge result: BS b's entries, best first, are
+// entries[index[start[b]]] .. entries[index[start[b + 1] - 1]].
+struct RankOrder {
+    std::vector<uint32_t> start;
+    std::vector<uint32_t> index;
+
+    size_t Size(size_t b) const { return start[b + 1] - start[b]; }
+};
+
+// Entries of a read/write merge stored once, BS by BS in IP order, with each
+// ranking kept as an index permutation of them rather than a copy.
+template <typename T>
+struct RankedEntries {
+    std::vector<std::string> bs;
+    std::vector<T> entries;
+    RankOrder write;
+    RankOrder read;
+
+    // index of a BS in bs, bs.size() when missing
+    size_t Find(const std::string& ip) const {
+        auto it = std::lower_bound(bs.begin(), bs.end(), ip);
+        return it != bs.end() && *it == ip ? it - bs.begin() : bs.size();
+    }
+    const T& At(const RankOrder& order, size_t b, size_t i) const {
+        return entries[order.index[order.start[b] + i]];
+    }
+    // the ranking as the per-BS map the merges used to return
+    std::map<std::string, std::vector<T>> Resolve(const RankOrder& order) const {
+        std::map<std::string, std::vector<T>> out;
+        for (size_t b = 0; b < bs.size(); ++b) {
+            auto& list = out[bs[b]];
+            list.reserve(order.Size(b));
+            for (size_t i = 0; i < order.Size(b); ++i) {
+                list.push_back(At(order, b, i));
+            }
+        }
+        return out;
+    }
+};
+
 struct ReturnSegStat{
     std::map<std::string, BsSumState> bs_flow;
     std::map<std::string, std::vector<SegmentSummary>> sortSegMap;
@@ -261,40 +401,1017 @@ struct ReturnDevStat{
 
 struct ReturnRwSegStat{
     std::map<std::string, BsSumState> bs_flow;
-    std::map<std::string, std::vector<SegmentSummary>> sortReadSegMap;
-    std::map<std::string, std::vector<SegmentSummary>> sortWriteSegMap;
+    RankedEntries<SegmentSummary> segments;
     BlastRadius blastRadius;
 };
 
 struct ReturnRwDevStat{
     std::map<std::string, BsSumState> bs_flow;
-    std::map<std::string, std::vector<DeviceSummary>> sortReadDevMap;
-    std::map<std::string, std::vector<DeviceSummary>> sortWriteDevMap;
+    RankedEntries<DeviceSummary> devices;
     BlastRadius blastRadius;
 };
 
 struct ReturnRwSegScoreStat{
     std::map<std::string, BsSumScoreState> bs_score_flow;
-    std::map<std::string, std::vector<SegmentScoreSummary>> sortReadSegMap;
-    std::map<std::string, std::vector<SegmentScoreSummary>> sortWriteSegMap;
+    RankedEntries<SegmentScoreSummary> segments;
     BlastRadius blastRadius;
 };
 
+// Long-lived reader of the shm stat table. The file stays mapped across ticks
+// and is remapped only when it grows, is replaced, or its magic changes.
+class ShmStatReader {
+public:
+    explicit ShmStatReader(const std::string& path) : mPath(path), mFd(-1), mMapped(nullptr), mMapSize(0), mDev(0), mIno(0), mMagic(0), mLastRecordNum(0), mTornRecords(0) {}
+    ~ShmStatReader() { Unmap(); }
+    ShmStatReader(const ShmStatReader&) = delete;
+    ShmStatReader& operator=(const ShmStatReader&) = delete;
+
+    bool Read(std::vector<SegmentShmIoStat>& results);
+    const std::string& Path() const { return mPath; }
+    uint64_t TornRecords() const { return mTornRecords; }
+
+private:
+    bool Remap();
+    void Unmap();
+
+    std::string mPath;
+    int         mFd;
+    void*       mMapped;
+    size_t      mMapSize;
+    uint64_t    mDev;
+    uint64_t    mIno;
+    uint64_t    mMagic;
+    size_t      mLastRecordNum;
+    uint64_t    mTornRecords;
+    std::mutex  mMutex;
+};
+
+std::map<std::string, std::shared_ptr<ShmStatReader>> statReaders;
+std::mutex statReadersMutex;
+std::shared_ptr<ShmStatReader> shm_stat_reader(const std::string& path);
+
 std::vector<SegmentShmIoStat> read_segment_iostats_mmap(const std::string& path);
+// Reads the tables of several blockmasters concurrently, one thread each, and
+// merges them into one in path order.
+std::vector<SegmentShmIoStat> read_segment_iostats(const std::vector<std::string>& paths);
+// Concatenates the tables keeping one record per segment: the one with the
+// highest loadVersion (the earliest of equal ones), at the place of its first
+// record. Returns the number of records dropped.
+size_t merge_segment_tables(const std::vector<std::vector<SegmentShmIoStat>>& tables, std::vector<SegmentShmIoStat>& merged);
 
 std::string bs_ip_transform(uint64_t bsId);
 
-std::map<uint64_t, std::string> bsIdToIp;
+// Read-mostly: lookups load the current map without locking, and a miss
+// publishes a copy with the new entry under bsIdToIpMutex. Only accessed
+// through std::atomic_load and std::atomic_store.
+std::shared_ptr<const std::map<uint64_t, std::string>> bsIdToIp = std::make_shared<const std::map<uint64_t, std::string>>();
+std::mutex bsIdToIpMutex;
 std::string bs_ip_transform_cache(uint64_t bsId);
 
-int16_t sortBsSegMap(BsSegTrafficMap& bssegmap, std::string sort_type, int sort_flag, double w_traffic=0.7, double w_read_traffic_ratio=0.3);
-int16_t sortBsDevMap(BsDeviceTrafficMap& bsdevicemap, std::map<std::string, std::vector<DeviceSummary>>& sortedBsMap, int& bs_device_num, std::string sort_type, int sort_flag);
-int16_t sortBsSegScoreMap(BsSegScoreMap& bssegmap, std::string sort_type);  
+// Maps a key onto unsigned bits with the same order, inverted so that
+// ascending bits are descending keys.
+uint64_t descending_key_bits(double key);
+
+// Bounded min-heap keeping the k entries with the largest key, so ranking n
+// candidates costs O(n log k) time and O(k) memory. Equal keys rank by the
+// larger tie key, then in push order, so pushing in input order drains the
+// first k of rank_order.
+template <typename T>
+class TopKHeap {
+public:
+    explicit TopKHeap(size_t k) : mK(k), mPushed(0) {}
+
+    bool Accepts(double key, double tie = 0) const {
+        return mK > 0 && (mHeap.size() < mK || Ahead(descending_key_bits(key), descending_key_bits(tie), mPushed, mHeap.front()));
+    }
+    void Push(double key, const T& item, double tie = 0) {
+        Entry entry{descending_key_bits(key), descending_key_bits(tie), mPushed++, item};
+        if (mK == 0 || (mHeap.size() == mK && !Before(entry, mHeap.front()))) {
+            return;
+        }
+        if (mHeap.size() == mK) {
+            std::pop_heap(mHeap.begin(), mHeap.end(), Before);
+            mHeap.pop_back();
+        }
+        mHeap.push_back(std::move(entry));
+        std::push_heap(mHeap.begin(), mHeap.end(), Before);
+    }
+    // Moves the kept entries out, largest key first.
+    void Drain(std::vector<T>& out) {
+        std::sort_heap(mHeap.begin(), mHeap.end(), Before);
+        out.reserve(out.size() + mHeap.size());
+        for (auto& entry : mHeap) {
+            out.emplace_back(std::move(entry.item));
+        }
+        mHeap.clear();
+    }
+
+private:
+    struct Entry {
+        uint64_t bits;
+        uint64_t tieBits;
+        uint64_t seq;
+        T item;
+    };
+    static bool Ahead(uint64_t bits, uint64_t tieBits, uint64_t seq, const Entry& e) {
+        if (bits != e.bits) {
+            return bits < e.bits;
+        }
+        if (tieBits != e.tieBits) {
+            return tieBits < e.tieBits;
+        }
+        return seq < e.seq;
+    }
+    // a ranks ahead of b; the heap front is the entry ranking last
+    static bool Before(const Entry& a, const Entry& b) {
+        return Ahead(a.bits, a.tieBits, a.seq, b);
+    }
+    size_t mK;
+    uint64_t mPushed;
+    std::vector<Entry> mHeap;
+};
+
+// Number of threads the snapshot scans split the record table across.
+std::atomic<int> mergeThreads(1);
+void set_merge_threads(int threads);
+
+enum class MergePhase {
+    ShmRead = 0,
+    Delta,
+    Scan,
+    Rank,
+    Result,
+    Plan,
+    Convert,
+    Detect,
+    Num,
+};
+const size_t MERGE_PHASE_NUM = static_cast<size_t>(MergePhase::Num);
+const char* merge_phase_name(MergePhase phase);
+
+// Counters of the merge path since the last reset. They are bumped once per
+// phase or per table read, never per record, so they stay on in production.
+struct MergeCounters {
+    std::atomic<uint64_t> phaseNs[MERGE_PHASE_NUM];
+    std::atomic<uint64_t> phaseCalls[MERGE_PHASE_NUM];
+    std::atomic<uint64_t> tableReads;
+    std::atomic<uint64_t> records;
+    std::atomic<uint64_t> bytesScanned;
+    std::atomic<uint64_t> tornRecords;
+    std::atomic<uint64_t> duplicateRecords; // segments found in more than one table
+    std::atomic<uint64_t> bsNum;            // BSs of the last scanned table
+    std::atomic<uint64_t> bsIpHits;         // bsIdToIp lookups
+    std::atomic<uint64_t> bsIpMisses;
+    std::atomic<uint64_t> summaries;        // SegmentSummary/DeviceSummary built
+    std::atomic<uint64_t> resultEntries;    // summaries copied into result maps
+};
+MergeCounters mergeCounters;
+
+inline void count_merge(std::atomic<uint64_t>& counter, uint64_t n = 1){
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Adds the lifetime of the scope to one phase.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(MergePhase phase) : mPhase(static_cast<size_t>(phase)), mStart(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - mStart).count();
+        count_merge(mergeCounters.phaseNs[mPhase], ns);
+        count_merge(mergeCounters.phaseCalls[mPhase]);
+    }
+
+private:
+    size_t mPhase;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+// Plain copy of MergeCounters handed to Python.
+struct MergeStats {
+    std::map<std::string, double> phaseMs;
+    std::map<std::string, uint64_t> phaseCalls;
+    uint64_t tableReads;
+    uint64_t records;
+    uint64_t bytesScanned;
+    uint64_t tornRecords;
+    uint64_t duplicateRecords;
+    uint64_t bsNum;
+    uint64_t bsIpHits;
+    uint64_t bsIpMisses;
+    uint64_t summaries;
+    uint64_t resultEntries;
+
+    double BsIpHitRate() const {
+        uint64_t lookups = bsIpHits + bsIpMisses;
+        return lookups > 0 ? static_cast<double>(bsIpHits) / lookups : 0.0;
+    }
+    std::string ToString() const;
+};
+// Read the counters, and zero them with reset so each read covers one tick.
+MergeStats merge_stats(bool reset=false);
+
+// Runs fn(worker, begin, end) for each range [bounds[w], bounds[w+1]), the
+// first one on the calling thread and the rest on their own threads.
+template <typename F>
+void parallel_ranges(const std::vector<size_t>& bounds, F fn) {
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w + 1 < bounds.size(); ++w) {
+        threads.emplace_back(fn, w, bounds[w], bounds[w + 1]);
+    }
+    if (bounds.size() > 1) {
+        fn(0, bounds[0], bounds[1]);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+// Splits [0, n) evenly across workers. The ranges depend only on n and the
+// worker count, so per-worker results can be merged back in a fixed order.
+template <typename F>
+void parallel_for(size_t workers, size_t n, F fn) {
+    std::vector<size_t> bounds(workers + 1);
+    for (size_t w = 0; w <= workers; ++w) {
+        bounds[w] = n * w / workers;
+    }
+    parallel_ranges(bounds, fn);
+}
+
+enum class RankWindow {
+    Urgent,
+    Instant,
+    Longterm,
+};
+
+// Counters one ranking reads: a direction and a window, fixed at compile time.
+// Devices only keep urgent std sums, so their Std and LongerStd are the
+// urgent average.
+template <bool Write, RankWindow Window = RankWindow::Urgent>
+struct RankSide {
+    static const bool write = Write;
+    static const RankWindow window = Window;
+
+    template <typename Sums>
+    static uint64_t Sum(const Sums& s) {
+        switch (Window) {
+            case RankWindow::Urgent: return Write ? s.write_urgent_sum : s.read_urgent_sum;
+            case RankWindow::Instant: return Write ? s.write_instant_sum : s.read_instant_sum;
+            default: return Write ? s.write_longterm_sum : s.read_longterm_sum;
+        }
+    }
+    static double WindowStd(const SegmentStdStat& s, RankWindow window) {
+        switch (window) {
+            case RankWindow::Urgent: return Write ? s.write_urgent_std : s.read_urgent_std;
+            case RankWindow::Instant: return Write ? s.write_instant_std : s.read_instant_std;
+            default: return Write ? s.write_longterm_std : s.read_longterm_std;
+        }
+    }
+    template <typename S> static uint64_t Traffic(const S& s) { return Sum(s.traffic); }
+    template <typename S> static uint64_t Latency(const S& s) { return Sum(s.latency); }
+    template <typename S> static uint64_t Iops(const S& s) { return Sum(s.iops); }
+    static double Std(const SegmentSummary& s) { return WindowStd(s.traffic_std, Window); }
+    static double Std(const DeviceSummary& d) { return d.AverageUrgentStd(Write ? UrgentStdType::Write : UrgentStdType::Read); }
+    static double Std(const DeviceAggregate& d) { return d.AverageUrgentStd(Write ? UrgentStdType::Write : UrgentStdType::Read); }
+    // std of the next longer window
+    static double LongerStd(const SegmentSummary& s) { return WindowStd(s.traffic_std, Window == RankWindow::Urgent ? RankWindow::Instant : RankWindow::Longterm); }
+    static double LongerStd(const DeviceSummary& d) { return Std(d); }
+    static double LongerStd(const DeviceAggregate& d) { return Std(d); }
+    // both directions, for the read/write rankings
+    template <typename S> static uint64_t RwTraffic(const S& s) { return RankSide<true, Window>::Traffic(s) + RankSide<false, Window>::Traffic(s); }
+    static double RwStd(const SegmentSummary& s) { return RankSide<true, Window>::Std(s) + RankSide<false, Window>::Std(s); }
+    static double RwStd(const DeviceSummary& d) { return d.AverageUrgentStd(UrgentStdType::All); }
+    static double RwStd(const DeviceAggregate& d) { return d.AverageUrgentStd(UrgentStdType::All); }
+};
+
+enum class ScoreNorm {
+    None,
+    Max,
+};
+
+// Weights of the rankings, settable from Python between merges. Each SortType
+// reads its own subset; rank_params compiles them into one coefficient per
+// feature.
+struct ScoringModel {
+    double traffic_weight;         // TrafficStd, wrTrafficStd and the *Score types, std gets 1 - traffic_weight
+    double read_traffic_ratio;     // ReadRatio, write traffic gets 1 - read_traffic_ratio
+    double urgent_traffic_weight;  // TrafficStdLong
+    double urgent_std_weight;
+    double instant_std_weight;     // std of the next longer window
+    double mix_traffic_weight;     // TrafficIopsLatency
+    double mix_iops_weight;
+    double mix_latency_weight;
+    double mix_std_weight;         // subtracted
+    RankWindow window;             // window the sums and std are read from
+    ScoreNorm norm;                // Max divides each feature by its largest magnitude among the ranked summaries
+
+    ScoringModel() : traffic_weight(0.7), read_traffic_ratio(0.3), urgent_traffic_weight(0.4), urgent_std_weight(0.4), instant_std_weight(0.2), mix_traffic_weight(0.5), mix_iops_weight(0.1), mix_latency_weight(0.2), mix_std_weight(-0.2), window(RankWindow::Urgent), norm(ScoreNorm::None) {}
+    std::string ToString() const;
+};
+
+// The model merges rank with when they are not passed one.
+ScoringModel scoringModel;
+std::mutex scoringModelMutex;
+void set_scoring_model(const ScoringModel& model);
+ScoringModel scoring_model();
+
+// Inputs of the weighted part of a ranking key.
+enum class RankFeature {
+    Traffic = 0,
+    Iops,
+    Latency,
+    Std,
+    LongerStd,
+    RwTraffic,
+    RwStd,
+    ReadTraffic,
+    WriteTraffic,
+    Num,
+};
+const size_t RANK_FEATURE_NUM = static_cast<size_t>(RankFeature::Num);
+
+// A model compiled for one SortType: a flat coefficient per feature, zero for
+// the features the ranking does not read.
+struct RankParams {
+    double coef[RANK_FEATURE_NUM];
+    double Coef(RankFeature f) const { return coef[static_cast<size_t>(f)]; }
+};
+RankParams rank_params(const ScoringModel& model, SortType sortType);
+// rank_params for ranking every list of lists with the same coefficients: with
+// ScoreNorm::Max each feature is divided by its largest magnitude across them.
+template <typename Lists>
+RankParams compile_rank_params(const ScoringModel& model, SortType sortType, bool write, const Lists& lists);
+
+const double RANK_KEY_LOWEST = -std::numeric_limits<double>::infinity();
+
+// One ranking policy per SortType: Key is evaluated once per summary, a larger
+// key ranks first, and summaries with no score (no latency or iops) get
+// RANK_KEY_LOWEST so they sink to the tail. A new SortType is a policy here plus
+// a case in the visit_*_rank switches.
+template <typename Side>
+struct TrafficRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) { return p.Coef(RankFeature::Traffic) * Side::Traffic(s); }
+};
+
+template <typename Side>
+struct TrafficStdRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) { return p.Coef(RankFeature::Traffic) * Side::Traffic(s) + p.Coef(RankFeature::Std) * Side::Std(s); }
+};
+
+template <typename Side>
+struct TrafficIopsLatencyRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) {
+        return p.Coef(RankFeature::Traffic) * Side::Traffic(s) + p.Coef(RankFeature::Iops) * Side::Iops(s) + p.Coef(RankFeature::Latency) * Side::Latency(s) + p.Coef(RankFeature::Std) * Side::Std(s);
+    }
+};
+
+template <typename Side>
+struct RwTrafficStdRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) { return p.Coef(RankFeature::RwTraffic) * Side::RwTraffic(s) + p.Coef(RankFeature::RwStd) * Side::RwStd(s); }
+};
+
+template <typename Side>
+struct LatencyRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) { return p.Coef(RankFeature::Latency) * Side::Latency(s); }
+};
+
+template <typename Side>
+struct LatencyPerIopsRank {
+    template <typename S> static double Key(const S& s, const RankParams&) {
+        uint64_t iops = Side::Iops(s);
+        return iops == 0 ? RANK_KEY_LOWEST : static_cast<double>(Side::Latency(s) / iops);
+    }
+};
+
+template <typename Side>
+struct TrafficStdLongRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) {
+        return p.Coef(RankFeature::Traffic) * Side::Traffic(s) + p.Coef(RankFeature::Std) * Side::Std(s) + p.Coef(RankFeature::LongerStd) * Side::LongerStd(s);
+    }
+};
+
+template <typename Side>
+struct TrafficStdScoreRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) {
+        uint64_t latency = Side::Latency(s);
+        return latency == 0 ? RANK_KEY_LOWEST : TrafficStdRank<Side>::Key(s, p) * Side::Iops(s) / latency;
+    }
+};
+
+template <typename Side>
+struct TrafficStdLatScoreRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) {
+        uint64_t latency = Side::Latency(s);
+        return latency == 0 ? RANK_KEY_LOWEST : TrafficStdRank<Side>::Key(s, p) * latency;
+    }
+};
+
+template <typename Side>
+struct TrafficStdIopsScoreRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) {
+        return Side::Latency(s) == 0 ? RANK_KEY_LOWEST : TrafficStdRank<Side>::Key(s, p) / Side::Iops(s);
+    }
+};
+
+template <typename Side>
+struct TrafficScoreRank {
+    template <typename S> static double Key(const S& s, const RankParams&) {
+        uint64_t latency = Side::Latency(s);
+        return latency == 0 ? RANK_KEY_LOWEST : static_cast<double>(Side::Traffic(s) * Side::Iops(s) / latency);
+    }
+};
+
+// Read traffic against write traffic; a read-only ranking.
+template <typename Side>
+struct ReadRatioRank {
+    template <typename S> static double Key(const S& s, const RankParams& p) {
+        return p.Coef(RankFeature::ReadTraffic) * RankSide<false, Side::window>::Traffic(s) + p.Coef(RankFeature::WriteTraffic) * RankSide<true, Side::window>::Traffic(s);
+    }
+};
+
+// Ranking keys matching the policies above, for one summary at a time.
+double segment_rank_key(const SegmentSummary& s, SortType sortType, bool write, RankWindow window, const RankParams& params);
+double device_rank_key(const DeviceSummary& d, SortType sortType, bool write, RankWindow window, const RankParams& params);
+void segment_rank_keys(const std::vector<SegmentSummary>& segments, SortType sortType, bool write, RankWindow window, const RankParams& params, std::vector<double>& keys);
+// the rank key of every device of a table, in table order
+void device_rank_keys(const std::vector<DeviceAggregate>& devices, SortType sortType, bool write, RankWindow window, const RankParams& params, std::vector<double>& keys);
+
+// Indices of keys by descending key, ties in input order. Lists of at least
+// RADIX_SORT_MIN keys go through an LSD radix sort on the key bits.
+std::vector<uint32_t> rank_order(const std::vector<double>& keys);
+
+// Reorders items to order, moving each element once.
+template <typename T>
+void apply_rank_order(std::vector<T>& items, const std::vector<uint32_t>& order) {
+    std::vector<T> sorted;
+    sorted.reserve(order.size());
+    for (uint32_t i : order) {
+        sorted.emplace_back(std::move(items[i]));
+    }
+    items.swap(sorted);
+}
+
+bool is_write_rank(const std::string& sort_type);
+int16_t sortBsSegMap(BsSegTrafficMap& bssegmap, std::string sort_type, int sort_flag, const ScoringModel& model=ScoringModel());
+int16_t sortBsDevMap(const BsDeviceTrafficMap& bsdevicemap, std::map<std::string, std::vector<DeviceSummary>>& sortedBsMap, int& bs_device_num, std::string sort_type, int sort_flag, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel& model=ScoringModel());
+int16_t sortBsSegScoreMap(BsSegScoreMap& bssegmap, std::string sort_type, size_t top_k=0);  
+// sortBsSegScoreMap over index slices: BS bs ranks scored[start[bs], start[bs + 1])
+int16_t rank_segment_scores(const std::vector<SegmentScoreSummary>& scored, const std::vector<uint32_t>& start, std::string sort_type, size_t top_k, RankOrder& ranked);
+void sortSegments(std::vector<SegmentSummary>& segVec, bool write, SortType sortType, RankWindow window, const RankParams& params);
+void sortDevices(const std::map<uint64_t, DeviceSummary>& devMap, std::vector<DeviceSummary>& devices, bool write, SortType sortType, RankWindow window, const RankParams& params, size_t top_k, uint64_t traffic_floor);
+
+SegmentSummary make_segment_summary(const SegmentShmIoStat& e);
+void add_bs_result(BsSumState& state, const SegmentShmIoStat& e);
+void remove_bs_result(BsSumState& state, const SegmentShmIoStat& e);
+void add_bs_state(BsSumState& state, const BsSumState& other);
+void add_device_result(std::map<uint64_t, DeviceSummary>& devMap, const SegmentShmIoStat& e);
+
+// A segment whose record changed blockserver between two snapshots.
+struct SegmentMove {
+    SegmentId segmentId;
+    std::string fromBs;
+    std::string toBs;
+    uint64_t loadVersion;
+    SegmentMove(SegmentId segmentId, std::string fromBs, std::string toBs, uint64_t loadVersion) : segmentId(segmentId), fromBs(std::move(fromBs)), toBs(std::move(toBs)), loadVersion(loadVersion) {}
+};
+
+// One read of the shm stat table. The BS, segment and device views are built
+// lazily on first use, and every view still missing is filled by the same pass
+// over the records, so a tick costs one scan however many merges it asks for.
+// Given a base snapshot, the BS sums are instead patched from the records that
+// changed since the base, so that part of the work scales with churn. With
+// mergeThreads > 1 the scans are split across threads, and the results are the
+// same as a single-threaded scan whatever the thread count. Views are filled
+// under mFillMutex and never changed once built, so merges on one snapshot may
+// run from several threads at once.
+class SegmentSnapshot {
+public:
+    SegmentSnapshot() : mChangedRecords(0), mHasBsState(false), mHasSegView(false), mHasDevView(false), mHasBsFlow(false), mHasSegmentIndex(false), mIsDelta(false), mLoadTime(std::chrono::steady_clock::now()) {}
+    explicit SegmentSnapshot(std::vector<SegmentShmIoStat> records) : mRecords(std::move(records)), mChangedRecords(0), mHasBsState(false), mHasSegView(false), mHasDevView(false), mHasBsFlow(false), mHasSegmentIndex(false), mIsDelta(false), mLoadTime(std::chrono::steady_clock::now()) {}
+    static std::shared_ptr<SegmentSnapshot> Load(const std::vector<std::string>& paths, const std::shared_ptr<SegmentSnapshot>& base=nullptr);
+
+    const std::vector<SegmentShmIoStat>& Records() const { return mRecords; }
+    std::chrono::steady_clock::time_point LoadTime() const { return mLoadTime; }
+
+    // Only meaningful after ApplyDelta: whether the BS sums were patched from
+    // the base, how many records differ from it, and which segments moved BS.
+    void ApplyDelta(SegmentSnapshot& base);
+    bool IsDelta() const { return mIsDelta; }
+    size_t ChangedRecords() const { return mChangedRecords; }
+    const std::vector<SegmentMove>& Moves() const { return mMoves; }
+
+    // Views indexed by dense BS index, in order of first appearance in the
+    // table (a delta snapshot keeps its base's order and appends new BSs).
+    // "ip:port" strings are only produced once per BS, for Python.
+    size_t BsNum();
+    const std::vector<std::string>& BsIps();
+    const std::vector<uint32_t>& RecordBs();
+    const std::vector<BsSumState>& BsState();
+    const std::vector<std::vector<SegmentSummary>>& BsSegments();
+    const BsDeviceTable& BsDevices();
+    const std::map<std::string, BsSumState>& BsFlow();
+    const std::vector<uint32_t>& BsRecordNum();
+    // Record of each segment, the first one if a segment appears twice.
+    const std::unordered_map<SegmentId, uint32_t, SegmentIdHash>& SegmentIndex();
+
+    // top_k > 0 keeps only the k best entries per BS, and traffic_floor > 0 drops
+    // entries whose urgent traffic in the ranked direction is not above it.
+    // Without a model the merges rank with scoring_model().
+    ReturnSegStat MergeSegment(int sort_flag, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
+    ReturnDevStat MergeDevice(int sort_flag, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
+    ReturnRwSegStat MergeRwSegment(int r_sort_flag, int w_sort_flag, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
+    ReturnRwSegScoreStat MergeScoreRwSegment(int r_sort_flag, int w_sort_flag, double w1, size_t top_k=0, const ScoringModel* model=nullptr);
+    ReturnRwDevStat MergeRwDevice(int r_sort_flag, int w_sort_flag, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
+
+private:
+    uint32_t InternBs(uint64_t bsId);
+    uint32_t AccumulateBs(size_t i);
+    void PatchRecord(const SegmentShmIoStat& old, uint32_t old_bs, size_t i);
+    size_t Workers() const;
+    void AccumulateBsParallel(size_t workers);
+    void BucketRecords();
+    std::vector<size_t> BsRanges(size_t workers) const;
+    void ResizeDevices(size_t device_num, size_t segment_num);
+    // bsStart from the BS of each device
+    void IndexDevices();
+    void Scan(bool want_segments, bool want_devices);
+    // rankings of record indices, BS by BS in mBsIps order
+    int16_t RankSegmentsTopK(RankOrder* write_ranked, int w_sort_flag, RankOrder* read_ranked, int r_sort_flag, const ScoringModel& model, size_t top_k, uint64_t traffic_floor);
+    // ranking of the whole BsSegments(), indices into its lists laid end to
+    // end; ties keep the order of ties, or table order without it
+    int16_t RankSegments(RankOrder& ranked, bool write, int sort_flag, const ScoringModel& model, const RankOrder* ties=nullptr);
+    // ranking of BsDevices().devices indices, BS by BS in mBsIps order
+    int16_t RankDevices(RankOrder& ranked, int& bs_device_num, std::string sort_type, int sort_flag, const ScoringModel& model, size_t top_k, uint64_t traffic_floor);
+
+    std::vector<SegmentShmIoStat> mRecords;
+    std::unordered_map<uint64_t, uint32_t> mBsIndex;
+    std::vector<std::string> mBsIps;
+    std::vector<uint32_t> mRecordBs;
+    std::vector<BsSumState> mBsState;
+    std::vector<uint32_t> mBsRecordNum;
+    // record indices grouped by BS, in table order: BS bs owns
+    // mBsRecordIdx[mBsRecordStart[bs], mBsRecordStart[bs + 1])
+    std::vector<size_t> mBsRecordStart;
+    std::vector<uint32_t> mBsRecordIdx;
+    std::vector<std::vector<SegmentSummary>> mBsSegments;
+    BsDeviceTable mBsDevices;
+    std::map<std::string, BsSumState> mBsFlow;
+    std::unordered_map<SegmentId, uint32_t, SegmentIdHash> mSegmentIndex;
+    std::vector<SegmentMove> mMoves;
+    size_t mChangedRecords;
+    bool mHasBsState;
+    bool mHasSegView;
+    bool mHasDevView;
+    bool mHasBsFlow;
+    bool mHasSegmentIndex;
+    bool mIsDelta;
+    std::chrono::steady_clock::time_point mLoadTime;
+    std::mutex mFillMutex;
+};
+
+std::shared_ptr<SegmentSnapshot> lastSnapshot;
+std::mutex lastSnapshotMutex;
+// guarded by lastSnapshotMutex
+std::vector<std::string> segIostatsPaths(1, SEG_IOSTATS_PATH);
+// Read the segment stat table from another file, e.g. one written by gen_seg_iostats.
+void set_stat_path(const std::string& path);
+// Merge the tables of several blockmasters into every snapshot.
+void set_stat_paths(const std::vector<std::string>& paths);
+std::shared_ptr<SegmentSnapshot> take_snapshot(int max_age_ms=0, bool incremental=false);
+
+// Urgent traffic of a segment or BS over the sampler's polls.
+struct SampledTraffic {
+    uint64_t read;       // at the last poll
+    uint64_t write;
+    double readEwma;
+    double writeEwma;
+    uint64_t readPeak;   // since the sampler started or the peaks were last reset
+    uint64_t writePeak;
+};
+
+// What the sampler publishes after each poll; never changed once published.
+struct SamplerView {
+    std::shared_ptr<SegmentSnapshot> snapshot;
+    uint64_t sequence;
+    std::chrono::steady_clock::time_point sampleTime;
+    // aligned with snapshot->Records()
+    std::vector<SampledTraffic> segments;
+    std::map<std::string, SampledTraffic> bs;
+
+    double AgeMs() const { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sampleTime).count(); }
+    SampledTraffic Segment(const SegmentId& id) const;
+};
+
+// Polls the stat table every interval_ms on its own thread, keeping EWMA
+// (weight alpha on the new poll) and peak urgent traffic per segment and per
+// BS. Each poll is scanned before it is published, and readers only ever load
+// the published pointer, so they never wait for a scan. A published view is
+// refilled for a later poll once no reader holds it.
+class SnapshotSampler {
+public:
+    SnapshotSampler(int interval_ms, double alpha, bool incremental);
+    // inline, as the global sampler below is destroyed in every file that
+    // includes this header, gen_seg_iostats too
+    ~SnapshotSampler() {
+        {
+            std::lock_guard<std::mutex> lock(mStopMutex);
+            mStop = true;
+        }
+        mStopCv.notify_all();
+        mThread.join();
+    }
+
+    int IntervalMs() const { return mIntervalMs; }
+    // the next poll starts the peaks over from its own values
+    void ResetPeaks() { mResetPeaks = true; }
+
+private:
+    void Run();
+    void Poll();
+    void Update(SampledTraffic& stat, uint64_t read, uint64_t write, bool fresh, bool reset_peaks) const;
+    void DropDeadSlots(const std::vector<std::string>& bsIps);
+
+    int mIntervalMs;
+    double mAlpha;
+    bool mIncremental;
+    uint64_t mSequence;
+    std::atomic<bool> mResetPeaks;
+    std::shared_ptr<SegmentSnapshot> mPrev;
+    std::shared_ptr<SamplerView> mSpare;
+    // per segment state outlives the records, slot per SegmentId seen since
+    // the last time the slots no record referenced outnumbered the rest
+    std::unordered_map<SegmentId, uint32_t, SegmentIdHash> mSlots;
+    std::vector<SampledTraffic> mSegmentStat;
+    std::vector<uint32_t> mRecordSlot;
+    std::map<std::string, SampledTraffic> mBsStat;
+    std::mutex mStopMutex;
+    std::condition_variable mStopCv;
+    bool mStop;
+    std::thread mThread;
+};
+
+// Latest view of the running sampler, only accessed through std::atomic_load
+// and std::atomic_store; empty when the sampler is stopped.
+std::shared_ptr<SamplerView> samplerView;
+std::unique_ptr<SnapshotSampler> sampler;
+std::mutex samplerMutex;
+// While the sampler runs, take_snapshot and the merge_* functions use its
+// latest poll instead of reading the table.
+void start_sampler(int interval_ms, double alpha=0.3, bool incremental=true);
+void stop_sampler();
+std::shared_ptr<SamplerView> sampler_view(bool reset_peaks=false);
+
+struct LatencyWindowStat {
+    uint64_t count;
+    uint64_t readSum;
+    uint64_t writeSum;
+    LatencyWindowStat() : count(0), readSum(0), writeSum(0) {}
+    double ReadMean() const { return count ? static_cast<double>(readSum) / count : 0; }
+    double WriteMean() const { return count ? static_cast<double>(writeSum) / count : 0; }
+};
+
+struct LatencySample {
+    uint64_t read;
+    uint64_t write;
+    uint32_t bs;
+    // LatencySketch::Key of read and write, in what would be padding
+    int16_t readKey;
+    int16_t writeKey;
+};
+
+// Quantile sketch in the style of DDSketch: a value v >= 1 falls in bucket
+// ceil(log_gamma(v)), gamma = (1 + accuracy) / (1 - accuracy), so every
+// percentile is read back within relative error `accuracy`. Counts live in a
+// fixed window of `bins` buckets that only slides up; values under it are
+// counted in its lowest bucket, so memory stays fixed and only percentiles
+// that land in that bucket lose their accuracy. Zero has its own counter. Sketches of the same accuracy
+// merge by adding their buckets, and an added value can be removed again.
+class LatencySketch {
+public:
+    // accuracy in [0.001, 1), so every key fits an int16_t
+    LatencySketch(double accuracy, size_t bins);
+
+    static const int32_t ZERO_KEY = -32768;
+    // bucket of a value, ZERO_KEY for 0
+    int32_t Key(uint64_t value) const;
+    void AddKey(int32_t key, uint64_t n = 1);
+    void RemoveKey(int32_t key, uint64_t n = 1);
+    void Add(uint64_t value, uint64_t n = 1) { AddKey(Key(value), n); }
+    void Remove(uint64_t value, uint64_t n = 1) { RemoveKey(Key(value), n); }
+    // false, leaving this sketch as it was, if the accuracies differ
+    bool Merge(const LatencySketch& other);
+    void Clear();
+
+    double Accuracy() const { return mAccuracy; }
+    size_t Bins() const { return mCounts.size(); }
+    uint64_t Count() const { return mCount; }
+    // q in [0, 100], at the rank np.percentile would interpolate from
+    double Percentile(double q) const;
+
+private:
+    double Value(int32_t key) const;
+    void AddBucket(int32_t key, uint64_t n);
+    // slides the window up until key is its top bucket
+    void Slide(int32_t key);
+
+    double mAccuracy;
+    double mGamma;
+    double mLogGamma;
+    int32_t mMinKey;
+    uint64_t mZero;
+    uint64_t mCount;
+    std::vector<uint64_t> mCounts;
+};
+
+// Read/write latency history of one window: the last `capacity` samples of
+// every segment in a fixed-size ring, all rings in one slab, with running sums
+// and sketches per BS (the BS the segment was on when sampled) and for the
+// cluster, and running sums per segment. Sketches of a segment are built from
+// its ring when asked for.
+class SegmentLatencyStore {
+public:
+    SegmentLatencyStore(size_t capacity, RankWindow window = RankWindow::Urgent, double accuracy = 0.01, size_t bins = 2048)
+        : mCapacity(std::max<size_t>(capacity, 1)), mWindow(window), mSketch(accuracy, bins), mClusterRead(mSketch), mClusterWrite(mSketch), mFull(false) {}
+
+    // one sample per record of the snapshot
+    void Append(const SegmentSnapshot& snapshot);
+    // drop every sample, keeping the slab for the next window
+    void Reset();
+
+    size_t Capacity() const { return mCapacity; }
+    size_t SegmentNum() const { return mRings.size(); }
+    // whether any segment has filled its ring since the last Reset
+    bool Full() const { return mFull; }
+    const LatencyWindowStat& Cluster() const { return mCluster; }
+    LatencyWindowStat Segment(const SegmentId& id) const;
+    std::map<std::string, LatencyWindowStat> Bs() const;
+    // q in [0, 100], linearly interpolated like np.percentile
+    double SegmentPercentile(const SegmentId& id, double q, bool read) const;
+    double ClusterPercentile(double q, bool read) const;
+    LatencySketch SegmentSketch(const SegmentId& id, bool read) const;
+    const LatencySketch& ClusterSketch(bool read) const { return read ? mClusterRead : mClusterWrite; }
+    std::map<std::string, LatencySketch> BsSketch(bool read) const;
+
+private:
+    struct Ring {
+        uint32_t head;
+        uint32_t size;
+        LatencyWindowStat stat;
+    };
+    uint32_t InternBs(uint64_t bsId);
+    void Push(uint32_t slot, const LatencySample& sample);
+
+    size_t mCapacity;
+    RankWindow mWindow;
+    // empty, copied for every new sketch
+    LatencySketch mSketch;
+    std::unordered_map<SegmentId, uint32_t, SegmentIdHash> mIndex;
+    std::vector<Ring> mRings;
+    // ring of slot s is mSamples[s * mCapacity, (s + 1) * mCapacity)
+    std::vector<LatencySample> mSamples;
+    std::unordered_map<uint64_t, uint32_t> mBsIndex;
+    std::vector<std::string> mBsIps;
+    std::vector<LatencyWindowStat> mBsStat;
+    std::vector<LatencySketch> mBsRead;
+    std::vector<LatencySketch> mBsWrite;
+    LatencyWindowStat mCluster;
+    LatencySketch mClusterRead;
+    LatencySketch mClusterWrite;
+    bool mFull;
+};
+
+// Thresholds of HotspotDetector. A segment or BS is flagged in a direction
+// when its urgent traffic is at least the floor and above its longterm
+// baseline by z_threshold longterm std or by ratio_threshold times; a
+// threshold <= 0 turns its test off.
+struct HotspotConfig {
+    double zThreshold;
+    double ratioThreshold;
+    uint64_t minTraffic;     // of a segment
+    uint64_t minBsTraffic;
+    size_t topK;             // per list, 0 keeps every hotspot
+    HotspotConfig() : zThreshold(3.0), ratioThreshold(2.0), minTraffic(static_cast<uint64_t>(1) << 20), minBsTraffic(static_cast<uint64_t>(64) << 20), topK(32) {}
+};
+
+// One flagged direction of a segment, or of a BS with a zero segmentId.
+struct Hotspot {
+    SegmentId segmentId;
+    std::string bs;
+    bool read;
+    uint64_t urgent;
+    uint64_t instant;
+    uint64_t longterm;
+    double z;           // (urgent - longterm) / longterm std, a BS's std summed as variances
+    double ratio;       // urgent / longterm, the baseline at least 1
+    bool sustained;     // the instant window passes the same test
+    uint32_t ticks;     // consecutive updates it was flagged in, 1 for a new burst
+};
+
+struct HotspotReport {
+    uint64_t sequence;
+    // by traffic above the baseline, largest first
+    std::vector<Hotspot> segments;
+    std::vector<Hotspot> bs;
+};
+
+// Flags segments and BSs whose urgent traffic departs from their longterm
+// baseline, one scan of the snapshot per update across the merge threads,
+// and remembers for how many updates in a row each one has been flagged.
+class HotspotDetector {
+public:
+    explicit HotspotDetector(const HotspotConfig& config = HotspotConfig()) : mConfig(config), mSequence(0) {}
+
+    HotspotReport Update(SegmentSnapshot& snapshot);
+    HotspotConfig Config();
+    void SetConfig(const HotspotConfig& config);
+
+private:
+    HotspotConfig mConfig;
+    uint64_t mSequence;
+    // flagged in the last update, by direction (0 write, 1 read)
+    std::unordered_map<SegmentId, uint32_t, SegmentIdHash> mSegmentTicks[2];
+    std::map<std::string, uint32_t> mBsTicks[2];
+    std::mutex mMutex;
+};
+
+// Header of one tick in a snapshot log chunk. The payload that follows lists
+// the records that differ from the previous tick, as varint gaps between their
+// indices, then column by column (one 64-bit word of SegmentShmIoStat at a
+// time) the varint XOR of each listed record against the previous tick's
+// record at the same index. A keyframe is encoded against an empty table.
+struct SnapshotLogFrame {
+    uint64_t magic;
+    int64_t timestampUs;
+    uint32_t recordNum;
+    uint32_t changedNum;
+    uint32_t payloadBytes;
+    uint32_t keyframe;
+};
+static_assert(sizeof(SegmentShmIoStat) % sizeof(uint64_t) == 0, "records are delta encoded word by word");
+
+// Appends ticks of the stat table to a rolling log in dir, as chunk files
+// named by the timestamp of their first tick. Each chunk starts with a
+// keyframe and another is written every keyframe_interval ticks, so a tick is
+// rebuilt from at most that many deltas. A chunk is closed once it passes
+// chunk_bytes, and the oldest chunks are deleted while dir holds more than
+// max_bytes.
+class SnapshotRecorder {
+public:
+    SnapshotRecorder(const std::string& dir, uint64_t max_bytes, uint64_t chunk_bytes, uint32_t keyframe_interval);
+    ~SnapshotRecorder();
+    SnapshotRecorder(const SnapshotRecorder&) = delete;
+    SnapshotRecorder& operator=(const SnapshotRecorder&) = delete;
+
+    // timestamp_us 0 stamps the tick with the wall clock
+    bool Append(const SegmentSnapshot& snapshot, int64_t timestamp_us=0);
+    uint64_t TickNum();
+    // bytes of every chunk in dir, this run's and earlier ones
+    uint64_t Bytes();
+
+private:
+    bool OpenChunk(int64_t timestamp_us);
+    void Trim();
+
+    std::string mDir;
+    uint64_t mMaxBytes;
+    uint64_t mChunkBytes;
+    uint32_t mKeyframeInterval;
+    int mFd;
+    uint64_t mChunkSize;
+    uint32_t mSinceKeyframe;
+    uint64_t mTickNum;
+    int64_t mLastTimestampUs;
+    // chunk paths oldest first, and their sizes
+    std::vector<std::pair<std::string, uint64_t>> mChunks;
+    uint64_t mBytes;
+    std::vector<SegmentShmIoStat> mPrev;
+    std::string mBuf;
+    std::mutex mMutex;
+};
+
+// Read side of a SnapshotRecorder directory. Ticks are indexed from the frame
+// headers alone; a tick is rebuilt by decoding forward from the keyframe before
+// it, and replaying ticks in order decodes one delta each.
+class SnapshotLog {
+public:
+    explicit SnapshotLog(const std::string& dir);
+    ~SnapshotLog();
+    SnapshotLog(const SnapshotLog&) = delete;
+    SnapshotLog& operator=(const SnapshotLog&) = delete;
+
+    // index the directory again, picking up ticks recorded since
+    size_t Refresh();
+    size_t TickNum() const { return mTicks.size(); }
+    int64_t Timestamp(size_t tick) const;
+    // last tick at or before timestamp_us, -1 if every tick is later
+    int64_t Find(int64_t timestamp_us) const;
+    // nullptr if the tick is out of range or its chunk is unreadable
+    std::shared_ptr<SegmentSnapshot> Snapshot(size_t tick);
+
+private:
+    struct Tick {
+        uint32_t chunk;
+        uint64_t offset;
+        int64_t timestampUs;
+        size_t keyframe;   // tick to start decoding from
+    };
+    bool Decode(const Tick& tick);
+    void CloseChunk();
+
+    std::string mDir;
+    std::vector<std::string> mChunks;
+    std::vector<Tick> mTicks;
+    int mFd;
+    int64_t mFdChunk;
+    std::vector<SegmentShmIoStat> mCurrent;
+    int64_t mCurrentTick;
+    std::string mBuf;
+    std::mutex mMutex;
+};
+
+// Loads of every BS in one direction, kept ordered so the most and least loaded
+// BS come out in O(log n). Ties go to the lowest index, as np.argmax/argmin do.
+class BsLoadIndex {
+public:
+    explicit BsLoadIndex(const std::vector<int64_t>& loads) : mLoads(loads) {
+        for (size_t bs = 0; bs < mLoads.size(); ++bs) {
+            mOrder.emplace(mLoads[bs], bs);
+        }
+    }
+    int64_t Load(size_t bs) const { return mLoads[bs]; }
+    int64_t MaxLoad() const { return mOrder.rbegin()->first; }
+    int64_t MinLoad() const { return mOrder.begin()->first; }
+    size_t Max() const { return mOrder.lower_bound(std::make_pair(MaxLoad(), static_cast<size_t>(0)))->second; }
+    size_t Min() const { return mOrder.begin()->second; }
+    // (load, bs) pairs, least loaded first
+    const std::set<std::pair<int64_t, size_t>>& Order() const { return mOrder; }
+    void Add(size_t bs, int64_t delta) {
+        mOrder.erase(std::make_pair(mLoads[bs], bs));
+        mLoads[bs] += delta;
+        mOrder.emplace(mLoads[bs], bs);
+    }
+
+private:
+    std::vector<int64_t> mLoads;
+    std::set<std::pair<int64_t, size_t>> mOrder;
+};
+
+struct PlannedMove {
+    SegmentId segmentId;
+    std::string sourceBs;
+    std::string targetBs;
+    bool read;
+    int64_t urgentTraffic;
+    PlannedMove(SegmentId segmentId, std::string sourceBs, std::string targetBs, bool read, int64_t urgentTraffic) : segmentId(segmentId), sourceBs(std::move(sourceBs)), targetBs(std::move(targetBs)), read(read), urgentTraffic(urgentTraffic) {}
+};
+
+struct RwMovePlan {
+    std::vector<PlannedMove> moves;
+    int64_t remainTokens;
+    double wMaxSkew;
+    double wMinSkew;
+    double rMaxSkew;
+    double rMinSkew;
+};
+
+// The greedy transfer loop of omar_schedule: moves the top ranked segments of
+// the most loaded BS to the least loaded one, read first, then write, until
+// the skews are within the ratios or the tokens run out.
+RwMovePlan plan_rw_segment_moves(const ReturnRwSegStat& res, double w_max_ratio, double w_min_ratio, double r_max_ratio, double r_min_ratio, int64_t remain_tokens, uint64_t min_threshold, uint64_t min_segment_traffic, double max_w_skew, double max_r_skew, int64_t max_borrow_tokens);
+
+// One move of a candidate plan: a segment and the BS it would be loaded on.
+struct MoveCandidate {
+    SegmentId segmentId;
+    std::string targetBs;
+    MoveCandidate(uint64_t device_id, uint32_t segment_index, std::string targetBs) : segmentId{device_id, segment_index, 0}, targetBs(std::move(targetBs)) {}
+    MoveCandidate(const PlannedMove& move) : segmentId(move.segmentId), targetBs(move.targetBs) {}
+};
+
+// BS sums of a snapshot as they would be after a candidate plan, with the
+// urgent skews omar_schedule checks and the blast radius as the merges report it.
+struct PlanProjection {
+    std::map<std::string, BsSumState> bs_flow;
+    double wMaxSkew;
+    double wMinSkew;
+    double rMaxSkew;
+    double rMinSkew;
+    BlastRadius blastRadius;
+    size_t appliedMoves;
+    // indices into the plan of the moves whose segment is not in the snapshot
+    std::vector<size_t> skippedMoves;
+};
+
+// Applies the moves in order, each taking the whole record of its segment from
+// wherever the plan has put it so far; a target BS missing from the snapshot
+// starts empty. simulate_move_plans evaluates independent plans across the
+// merge threads.
+PlanProjection simulate_moves(SegmentSnapshot& snap, const std::vector<MoveCandidate>& moves);
+std::vector<PlanProjection> simulate_move_plans(SegmentSnapshot& snap, const std::vector<std::vector<MoveCandidate>>& plans);
 
 extern "C" std::map<std::string, BsSumState> bs_stat();
-extern "C" ReturnSegStat merge_bs_segment(int sort_flag=0);
-extern "C" ReturnDevStat merge_bs_device(int sort_flag=0);
-extern "C" ReturnRwSegStat merge_bs_rw_segment(int r_sort_flag=0, int w_sort_flag=0, double w_traffic=0.7, double w_read_traffic_ratio=0.3);
-extern "C" ReturnRwDevStat merge_bs_rw_device(int r_sort_flag=0, int w_sort_flag=0);
+extern "C" ReturnSegStat merge_bs_segment(int sort_flag=0, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
+extern "C" ReturnDevStat merge_bs_device(int sort_flag=0, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
+extern "C" ReturnRwSegStat merge_bs_rw_segment(int r_sort_flag=0, int w_sort_flag=0, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
+extern "C" ReturnRwSegScoreStat merge_bsscore_rw_segment(int r_sort_flag, int w_sort_flag, double w1, size_t top_k=0, const ScoringModel* model=nullptr);
+extern "C" ReturnRwDevStat merge_bs_rw_device(int r_sort_flag=0, int w_sort_flag=0, size_t top_k=0, uint64_t traffic_floor=0, const ScoringModel* model=nullptr);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,295 @@
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include "resonance.h"
+
+std::vector<float> correlation_matrix(const std::vector<const double*>& rows, size_t len){
+    size_t n = rows.size();
+    // z-normalised samples stored transposed (len x n), so the kernel's inner loop
+    // walks one output row and one sample row contiguously and vectorises
+    std::vector<float> zt(len * n, 0.0f);
+    for (size_t i = 0; i < n; ++i) {
+        const double* row = rows[i];
+        double mean = 0;
+        for (size_t k = 0; k < len; ++k) {
+            mean += row[k];
+        }
+        mean /= len;
+        double ss = 0;
+        for (size_t k = 0; k < len; ++k) {
+            ss += (row[k] - mean) * (row[k] - mean);
+        }
+        // a constant series correlates with nothing (numpy yields nan there)
+        if (ss <= 0) {
+            continue;
+        }
+        double scale = 1 / std::sqrt(ss);
+        for (size_t k = 0; k < len; ++k) {
+            zt[k * n + i] = static_cast<float>((row[k] - mean) * scale);
+        }
+    }
+
+    std::vector<float> corr(n * n, 0.0f);
+    for (size_t ib = 0; ib < n; ib += CORR_BLOCK) {
+        size_t ie = std::min(ib + CORR_BLOCK, n);
+        for (size_t jb = ib; jb < n; jb += CORR_BLOCK) {
+            size_t je = std::min(jb + CORR_BLOCK, n);
+            for (size_t kb = 0; kb < len; kb += CORR_K_BLOCK) {
+                size_t ke = std::min(kb + CORR_K_BLOCK, len);
+                for (size_t i = ib; i < ie; ++i) {
+                    float* out = &corr[i * n];
+                    for (size_t k = kb; k < ke; ++k) {
+                        float a = zt[k * n + i];
+                        const float* b = &zt[k * n];
+                        for (size_t j = jb; j < je; ++j) {
+                            out[j] += a * b[j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    // only the upper triangle is computed; mirror it and clip rounding overshoot
+    for (size_t i = 0; i < n; ++i) {
+        corr[i * n + i] = 1.0f;
+        for (size_t j = i + 1; j < n; ++j) {
+            float v = std::max(-1.0f, std::min(1.0f, corr[i * n + j]));
+            corr[i * n + j] = v;
+            corr[j * n + i] = v;
+        }
+    }
+    return corr;
+}
+
+// Exact maximum clique by branch and bound with a greedy colouring bound (Tomita's MCQ).
+class CliqueSearch {
+public:
+    CliqueSearch(const std::vector<uint64_t>& adj, size_t words) : mAdj(adj), mWords(words) {}
+
+    std::vector<uint32_t> Run(std::vector<uint32_t> nodes){
+        std::vector<size_t> degree(mWords * 64, 0);
+        for (uint32_t v : nodes) {
+            for (size_t w = 0; w < mWords; ++w) {
+                degree[v] += __builtin_popcountll(mAdj[v * mWords + w]);
+            }
+        }
+        std::stable_sort(nodes.begin(), nodes.end(), [&](uint32_t a, uint32_t b){ return degree[a] > degree[b]; });
+        mBest.clear();
+        mCurrent.clear();
+        std::vector<uint32_t> order, colors;
+        ColorSort(nodes, order, colors);
+        Expand(order, colors);
+        std::sort(mBest.begin(), mBest.end());
+        return mBest;
+    }
+
+private:
+    bool Adjacent(uint32_t a, uint32_t b) const {
+        return (mAdj[a * mWords + b / 64] >> (b % 64)) & 1;
+    }
+
+    // order the candidates by greedy colour class; colors[i] bounds the clique size within order[0..i]
+    void ColorSort(const std::vector<uint32_t>& nodes, std::vector<uint32_t>& order, std::vector<uint32_t>& colors) const {
+        std::vector<std::vector<uint32_t>> classes;
+        for (uint32_t v : nodes) {
+            size_t c = 0;
+            for (; c < classes.size(); ++c) {
+                bool conflict = false;
+                for (uint32_t u : classes[c]) {
+                    if (Adjacent(u, v)) {
+                        conflict = true;
+                        break;
+                    }
+                }
+                if (!conflict) {
+                    break;
+                }
+            }
+            if (c == classes.size()) {
+                classes.emplace_back();
+            }
+            classes[c].push_back(v);
+        }
+        order.clear();
+        colors.clear();
+        for (size_t c = 0; c < classes.size(); ++c) {
+            for (uint32_t v : classes[c]) {
+                order.push_back(v);
+                colors.push_back(c + 1);
+            }
+        }
+    }
+
+    void Expand(const std::vector<uint32_t>& order, const std::vector<uint32_t>& colors){
+        for (size_t i = order.size(); i-- > 0;) {
+            if (mCurrent.size() + colors[i] <= mBest.size()) {
+                return;
+            }
+            uint32_t v = order[i];
+            mCurrent.push_back(v);
+            std::vector<uint32_t> next;
+            for (size_t j = 0; j < i; ++j) {
+                if (Adjacent(v, order[j])) {
+                    next.push_back(order[j]);
+                }
+            }
+            if (next.empty()) {
+                if (mCurrent.size() > mBest.size()) {
+                    mBest = mCurrent;
+                }
+            } else {
+                std::vector<uint32_t> nextOrder, nextColors;
+                ColorSort(next, nextOrder, nextColors);
+                Expand(nextOrder, nextColors);
+            }
+            mCurrent.pop_back();
+        }
+    }
+
+    const std::vector<uint64_t>& mAdj;
+    size_t mWords;
+    std::vector<uint32_t> mCurrent;
+    std::vector<uint32_t> mBest;
+};
+
+std::vector<std::vector<uint32_t>> resonance_cliques(const std::vector<float>& corr, size_t n, double threshold, bool negative){
+    size_t words = (n + 63) / 64;
+    std::vector<uint64_t> adj(n * words, 0);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = i + 1; j < n; ++j) {
+            float v = corr[i * n + j];
+            if (negative ? v < -threshold : v > threshold) {
+                adj[i * words + j / 64] |= uint64_t(1) << (j % 64);
+                adj[j * words + i / 64] |= uint64_t(1) << (i % 64);
+            }
+        }
+    }
+
+    // connected components in order of their smallest node, as networkx yields them
+    std::vector<std::vector<uint32_t>> cliques;
+    std::vector<bool> seen(n, false);
+    CliqueSearch search(adj, words);
+    for (size_t root = 0; root < n; ++root) {
+        if (seen[root]) {
+            continue;
+        }
+        std::vector<uint32_t> component(1, root);
+        seen[root] = true;
+        for (size_t head = 0; head < component.size(); ++head) {
+            const uint64_t* row = &adj[component[head] * words];
+            for (size_t w = 0; w < words; ++w) {
+                uint64_t bits = row[w];
+                while (bits) {
+                    size_t v = w * 64 + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    if (!seen[v]) {
+                        seen[v] = true;
+                        component.push_back(v);
+                    }
+                }
+            }
+        }
+        if (component.size() <= 1) {
+            continue;
+        }
+        std::sort(component.begin(), component.end());
+        cliques.emplace_back(search.Run(component));
+    }
+    return cliques;
+}
+
+ResonanceResult find_resonance(const std::vector<std::vector<double>>& series, size_t check_len, double corr_thresh, double avg_thresh){
+    ResonanceResult result;
+    std::vector<uint32_t> kept;
+    std::vector<const double*> rows;
+    std::vector<size_t> windows;
+    size_t len = check_len;
+    for (size_t i = 0; i < series.size(); ++i) {
+        const auto& s = series[i];
+        // samples [1, check_len]; sample 0 is the still-filling current interval
+        size_t window = s.size() > 1 ? std::min(check_len, s.size() - 1) : 0;
+        if (window == 0) {
+            continue;
+        }
+        double sum = 0;
+        for (size_t k = 1; k <= window; ++k) {
+            sum += s[k];
+        }
+        if (sum / window > avg_thresh) {
+            kept.push_back(i);
+            rows.push_back(s.data() + 1);
+            windows.push_back(window);
+            len = std::min(len, window);
+        }
+    }
+    if (kept.size() <= 1) {
+        return result;
+    }
+
+    size_t n = kept.size();
+    std::vector<float> corr = correlation_matrix(rows, len);
+    auto collect = [&](bool negative, ResonanceGroups& out){
+        for (const auto& clique : resonance_cliques(corr, n, corr_thresh, negative)) {
+            // group average skips the first sample of the window, as compute_avg_traffic always did
+            std::vector<std::pair<double, uint32_t>> members;
+            for (uint32_t idx : clique) {
+                double sum = 0;
+                for (size_t k = 1; k < windows[idx]; ++k) {
+                    sum += rows[idx][k];
+                }
+                double avg = windows[idx] > 1 ? sum / (windows[idx] - 1) : std::numeric_limits<double>::quiet_NaN();
+                members.emplace_back(avg, idx);
+            }
+            std::stable_sort(members.begin(), members.end(), [](const std::pair<double, uint32_t>& a, const std::pair<double, uint32_t>& b){ return a.first > b.first; });
+            std::vector<uint32_t> group;
+            std::vector<double> avgs;
+            std::vector<double> matrix;
+            matrix.reserve(members.size() * members.size());
+            for (const auto& a : members) {
+                group.push_back(kept[a.second]);
+                avgs.push_back(a.first);
+                for (const auto& b : members) {
+                    matrix.push_back(corr[a.second * n + b.second]);
+                }
+            }
+            out.groups.emplace_back(std::move(group));
+            out.avgs.emplace_back(std::move(avgs));
+            out.matrices.emplace_back(std::move(matrix));
+        }
+    };
+    collect(false, result.pos);
+    collect(true, result.neg);
+    return result;
+}
+
+#if IF_PYBIND11
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <pybind11/numpy.h>
+namespace py = pybind11;
+
+static py::list group_matrices(const ResonanceGroups& res){
+    py::list matrices;
+    for (size_t g = 0; g < res.groups.size(); ++g) {
+        size_t n = res.groups[g].size();
+        py::array_t<double> arr({n, n});
+        std::copy(res.matrices[g].begin(), res.matrices[g].end(), arr.mutable_data());
+        matrices.append(arr);
+    }
+    return matrices;
+}
+
+PYBIND11_MODULE(resonance, m) {
+    py::class_<ResonanceResult>(m, "ResonanceResult")
+        .def_property_readonly("pos", [](const ResonanceResult& r){ return r.pos.groups; })
+        .def_property_readonly("neg", [](const ResonanceResult& r){ return r.neg.groups; })
+        .def_property_readonly("pos_avg", [](const ResonanceResult& r){ return r.pos.avgs; })
+        .def_property_readonly("neg_avg", [](const ResonanceResult& r){ return r.neg.avgs; })
+        .def_property_readonly("pos_matrix", [](const ResonanceResult& r){ return group_matrices(r.pos); })
+        .def_property_readonly("neg_matrix", [](const ResonanceResult& r){ return group_matrices(r.neg); });
+
+    m.def("find_resonance", &find_resonance, "Positive and negative resonance groups of the given traffic series", py::arg("series"), py::arg("check_len"), py::arg("corr_thresh"), py::arg("avg_thresh") = 0.02, py::call_guard<py::gil_scoped_release>());
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef RESONANCE_H
+#define RESONANCE_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#define IF_PYBIND11 1
+// rows/columns per tile of the correlation kernel, and samples per k-slice
+#define CORR_BLOCK 128
+#define CORR_K_BLOCK 256
+
+// One volume group per entry, as indices into the series passed to find_resonance,
+// ordered by mean traffic (highest first). avgs/matrices line up with groups.
+struct ResonanceGroups {
+    std::vector<std::vector<uint32_t>> groups;
+    std::vector<std::vector<double>> avgs;
+    // row-major groups[i].size() x groups[i].size() correlation sub-matrix
+    std::vector<std::vector<double>> matrices;
+};
+
+struct ResonanceResult {
+    ResonanceGroups pos;
+    ResonanceGroups neg;
+};
+
+// Pearson correlation between equally long rows, n x n row-major, diagonal 1.
+std::vector<float> correlation_matrix(const std::vector<const double*>& rows, size_t len);
+
+// Maximum clique of every connected component (size > 1) of the graph whose edges
+// are the pairs with corr > threshold (or corr < -threshold when negative is set).
+std::vector<std::vector<uint32_t>> resonance_cliques(const std::vector<float>& corr, size_t n, double threshold, bool negative);
+
+// Drop series whose mean over samples [1, check_len] is <= avg_thresh, correlate the
+// rest over the same window and return the positive and negative resonance groups.
+ResonanceResult find_resonance(const std::vector<std::vector<double>>& series, size_t check_len, double corr_thresh, double avg_thresh);
+
+#endif
@@ -1,9 +1,9 @@
 # -*- encoding: utf-8 -*-
 
-from cpp_code.read_and_merge import merge_bs_segment, bs_stat, merge_bs_rw_segment
+from cpp_code.read_and_merge import merge_bs_segment, bs_stat, merge_bs_rw_segment, take_snapshot, set_merge_threads, set_stat_paths, merge_stats, SegmentLatencyStore, ScoringModel, RankWindow, ScoreNorm, set_scoring_model, start_sampler, stop_sampler, SnapshotRecorder, HotspotDetector, HotspotConfig
 from apscheduler.schedulers.background import BackgroundScheduler
 from utils.util import generate_resonate_list, run_cmd_with_exit, configure_logging
-from utils.config import bs_file, BS_QUEUE_LEN, Q_TIME, RESON_TIME, W_RATE, R_RATE, FIRST_ADJUST, PCC_THRESHOLD, CHECK_LEN, MAX_BASE_FREQ
+from utils.config import bs_file, BS_QUEUE_LEN, Q_TIME, RESON_TIME, W_RATE, R_RATE, FIRST_ADJUST, PCC_THRESHOLD, CHECK_LEN, MAX_BASE_FREQ, RANK_TOP_K, RW_SORT_FLAGS, MERGE_THREADS, SEG_IOSTATS_PATH, SEG_IOSTATS_PATHS, SCORING_MODEL, SAMPLER_INTERVAL_MS, SAMPLER_ALPHA, RECORD_DIR, RECORD_MAX_MB, LATENCY_TARGET, HOTSPOT_CONFIG
 from utils.token_optimizer import TokenSpeedOptimizer
 from algorithm.random_algo import random_schedule
 from algorithm.omar_algo import omar_schedule
@@ -14,7 +14,7 @@ import time
 import os
 import sys
 from concurrent.futures import ProcessPoolExecutor
-from collections import namedtuple, deque
+from functools import partial
 import pwd
 import grp
 
@@ -36,10 +36,11 @@ base_scheduler = BackgroundScheduler()
 bs_queue = {}
 
 seg_record = {}     
-seg_lat = {} 
+seg_lat = None
+recorder = None
+hotspot_detector = None
 queue_len = 0 
-update_freq_flag = False
-SegLat = namedtuple('SegLat', ['r_lat', 'w_lat'])
+snapshot_max_age_ms = 0
 avg_r_lat, avg_w_lat, all_sched_freq = [], [], []
 base_sched_freq = Q_TIME * 2 
 token_speed = Q_TIME / base_sched_freq 
@@ -53,31 +54,22 @@ r_traffic = {}
 # key: user_id, value: [volume_id, ...]
 user_volume_map = {}
 
+def cluster_latency(store, target):
+    # the mean, or a percentile read from the store's cluster sketches
+    if target == 'mean':
+        lat = store.cluster()
+        return lat.read_mean, lat.write_mean
+    return getattr(store.cluster_sketch(read=True), target), getattr(store.cluster_sketch(read=False), target)
+
 def segment_lat_collect():
-    global seg_lat, update_freq_flag, avg_w_lat, avg_r_lat
-    res = merge_bs_segment()
-    for bs, segs in res.sort_bs_seg.items():
-        for seg in segs:
-            seg_id = f'{seg.segment_id.device_id}-{seg.segment_id.segment_index}'
-            if seg_id not in seg_lat:
-                seg_lat[seg_id] = deque(maxlen=queue_len)
-            seg_lat[seg_id].append(SegLat(r_lat=seg.latency.read_urgent_sum, w_lat=seg.latency.write_urgent_sum))
-            if len(seg_lat[seg_id]) == queue_len:
-                update_freq_flag = True
-    if update_freq_flag:
-        global avg_r_lat, avg_w_lat
-        total_r_lat, total_w_lat, count = 0, 0, 0
-        for latencies in seg_lat.values():
-            for lat in latencies:
-                total_r_lat += lat.r_lat  
-                total_w_lat += lat.w_lat
-                count += 1
-        r_lat = total_r_lat / count if count else 0 
-        w_lat = total_w_lat / count if count else 0
+    global avg_w_lat, avg_r_lat
+    # reuse the table scanned by this tick's scheduling job if it is recent enough
+    seg_lat.append(take_snapshot(max_age_ms=snapshot_max_age_ms))
+    if seg_lat.full:
+        r_lat, w_lat = cluster_latency(seg_lat, LATENCY_TARGET)
         avg_r_lat.append(r_lat)
         avg_w_lat.append(w_lat)
-        seg_lat = {}
-        update_freq_flag = False
+        seg_lat.reset()
         if len(all_sched_freq) == 0:
             all_sched_freq.append(schedule_times)
         else:
@@ -121,6 +113,33 @@ def adjust_sched_freq():
     remain_token = 0
     update_job_interval('gen_token', token_speed)
 
+def build_scoring_model(config):
+    model = ScoringModel()
+    for key, value in config.items():
+        if key == 'window':
+            value = getattr(RankWindow, value)
+        elif key == 'norm':
+            value = getattr(ScoreNorm, value)
+        setattr(model, key, value)
+    return model
+
+def build_hotspot_config(config):
+    hotspot_config = HotspotConfig()
+    for key, value in config.items():
+        setattr(hotspot_config, key, value)
+    return hotspot_config
+
+def log_new_hotspots(report):
+    # only bursts first flagged this tick, the ongoing ones were logged when they started
+    for h in report.segments:
+        if h.ticks == 1:
+            cf_logger.info(f'New {"read" if h.read else "write"} burst on segment {h.segment_id.device_id}/{h.segment_id.segment_index} of {h.bs}: '
+                           f'urgent {h.urgent}, longterm {h.longterm}, z {h.z:.1f}, ratio {h.ratio:.1f}, sustained {h.sustained}')
+    for h in report.bs:
+        if h.ticks == 1:
+            cf_logger.info(f'New {"read" if h.read else "write"} burst on BS {h.bs}: '
+                           f'urgent {h.urgent}, longterm {h.longterm}, z {h.z:.1f}, ratio {h.ratio:.1f}, sustained {h.sustained}')
+
 def rpc_method():
     # This is your rpc method to send the scheduling decision to the blockmaster. It can be a http interface like 'http://0.0.0.0:1000/rpc/BM/ScheduleSegment'
     pass
@@ -137,6 +156,14 @@ def period_base(args, merge_func, sort_flag, schedule_func, rpc_method):
         res = merge_func(*sort_flag)
     else:
         res = merge_func(sort_flag)
+    if recorder is not None or hotspot_detector is not None:
+        # the table this tick's merge ran on
+        snapshot = take_snapshot(max_age_ms=snapshot_max_age_ms)
+        if recorder is not None:
+            # for replaying the decision later
+            recorder.append(snapshot)
+        if hotspot_detector is not None:
+            log_new_hotspots(hotspot_detector.update(snapshot))
     global schedule_times, sched_in_window, remain_token
     if schedule_func is None:
         schedule_time = 0
@@ -148,6 +175,8 @@ def period_base(args, merge_func, sort_flag, schedule_func, rpc_method):
     sched_in_window += schedule_time
     remain_token -= schedule_time
     cf_logger.info(f'Schedule {schedule_time} times, total schedule times: {schedule_times}!')
+    # phase times and counters of this tick's merge, zeroed for the next one
+    cf_logger.debug(f'Merge stats: {merge_stats(reset=True)}')
 
 def scheduler(args, delta=10):
     """Start the scheduler"""
@@ -167,7 +196,7 @@ def scheduler(args, delta=10):
     # sort_flag: 0-write traffic; 1-write traffic and standard deviation (for var_s_rw, it is read and write traffic and standard deviation); 2-write traffic, iops, latency weighted sum; 3-read and write together, traffic sum, standard deviation sum; 4-write latency; 5-write latency divided by iops, 6-write traffic and standard deviation (short-term and long-term); 7-write traffic, standard deviation, iops, latency calculate score; 8-write traffic, iops, latency calculate score; 9-read sort, choose read traffic large and write traffic small
     
     if 'omar' in args.algo:
-        merge_func = merge_bs_rw_segment
+        merge_func = partial(merge_bs_rw_segment, top_k=RANK_TOP_K)
     elif 'random' in args.algo:
         merge_func = merge_bs_segment
     else:
@@ -175,7 +204,7 @@ def scheduler(args, delta=10):
     
     sort_flag = 0
     if 'omar' in args.algo:
-        sort_flag = [9, 7]
+        sort_flag = RW_SORT_FLAGS
     assert (sort_flag !=0 if 'var' in args.algo else True), 'Standard deviation is required for var algorithms'
     cf_logger.info(f'Sort flag: {sort_flag}')
     schedule_func = schedule_functions[args.algo]
@@ -222,8 +251,19 @@ def main():
     parser.add_argument('--bs_qlen', '-bsl', type=int, default=BS_QUEUE_LEN, help='The length of bs_queue')
     args = parser.parse_args()
 
-    global queue_len
+    global queue_len, snapshot_max_age_ms, seg_lat, recorder, hotspot_detector
     queue_len = Q_TIME // (args.interval * 2)
+    seg_lat = SegmentLatencyStore(queue_len)
+    snapshot_max_age_ms = args.interval * 1000
+    set_merge_threads(MERGE_THREADS)
+    set_stat_paths(SEG_IOSTATS_PATHS or [SEG_IOSTATS_PATH])
+    set_scoring_model(build_scoring_model(SCORING_MODEL))
+    if SAMPLER_INTERVAL_MS > 0:
+        start_sampler(SAMPLER_INTERVAL_MS, alpha=SAMPLER_ALPHA)
+    if RECORD_DIR:
+        recorder = SnapshotRecorder(RECORD_DIR, max_bytes=RECORD_MAX_MB * 1024 * 1024)
+    if HOTSPOT_CONFIG:
+        hotspot_detector = HotspotDetector(build_hotspot_config(HOTSPOT_CONFIG))
 
     if args.start_time:
         current_time = args.start_time.replace(' ', '_')
@@ -250,6 +290,7 @@ def main():
         f_logger.info(output)
 
     scheduler(args)
+    stop_sampler()
     os.chown(logger_file, admin_uid, admin_gid)
 
 if __name__ == '__main__':
@@ -0,0 +1,59 @@
+# -*- encoding: utf-8 -*-
+# Python side of a scheduling tick against a stat table (e.g. one written by
+# cpp_code/gen_seg_iostats): the merge call through pybind and the conversion of
+# its result, one JSON line per phase like bench_read_and_merge.
+#   python -m utils.bench_merge --path /dev/shm/seg_iostats --iters 5
+
+import argparse
+import json
+import time
+from cpp_code.read_and_merge import take_snapshot, set_stat_paths, set_merge_threads
+
+
+def bench_phase(phase, records, bs_num, threads, iters, fn, setup=None):
+    total = 0.0
+    for _ in range(iters):
+        arg = setup() if setup else None
+        start = time.perf_counter()
+        fn(arg)
+        total += time.perf_counter() - start
+    mean = total / iters
+    print(json.dumps({'records': records, 'bs': bs_num, 'threads': threads, 'phase': phase, 'iters': iters, 'ms': round(mean * 1e3, 3), 'ns_per_record': round(mean * 1e9 / records, 2) if records else 0.0}), flush=True)
+
+
+def iterate_segments(seg_map):
+    total = 0
+    for segs in seg_map.values():
+        for seg in segs:
+            total += seg.traffic.write_urgent_sum
+    return total
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark the merge path as seen from Python')
+    parser.add_argument('--path', type=str, nargs='+', required=True, help='The segment stat table to read, or one per blockmaster')
+    parser.add_argument('--iters', type=int, default=5, help='Iterations per phase')
+    parser.add_argument('--threads', type=int, default=1, help='Threads used by the snapshot scans, 0 for one per core')
+    args = parser.parse_args()
+
+    set_stat_paths(args.path)
+    set_merge_threads(args.threads)
+    snap = take_snapshot()
+    records, bs_num = snap.record_num, snap.bs_num
+    phase = lambda name, fn, setup=None: bench_phase(name, records, bs_num, args.threads, args.iters, fn, setup)
+
+    phase('take_snapshot', lambda _: take_snapshot())
+    phase('merge_rw_segment_9_7', lambda s: s.merge_bs_rw_segment(9, 7), setup=take_snapshot)
+    res = take_snapshot().merge_bs_rw_segment(9, 7)
+    # bs_flow converts the whole std::map on every access; the rankings only
+    # build a dict of per-BS views over the shared entries
+    phase('convert_bs_flow', lambda _: res.bs_flow)
+    phase('convert_sort_write_seg', lambda _: res.sort_write_seg)
+    phase('convert_sort_read_seg', lambda _: res.sort_read_seg)
+    seg_map = res.sort_write_seg
+    phase('iterate_sort_write_seg', lambda _: iterate_segments(seg_map))
+    phase('records_array', lambda s: s.records(), setup=take_snapshot)
+
+
+if __name__ == '__main__':
+    main()
@@ -21,6 +21,39 @@ MAX_R_SKEW = 0.4
 MAX_BORROW_TOKENS = 8 
 PCC_THRESHOLD = 0.7
 CHECK_LEN = 12 * 60
+RANK_TOP_K = 0  # keep only the top-k ranked segments per BS, 0 keeps the full ranking
+RW_SORT_FLAGS = [9, 7]  # read and write sort flags of the omar read/write merge, also used by utils/replay_log
+MERGE_THREADS = 1  # threads used to scan the segment stat table, 0 uses one per core
+SEG_IOSTATS_PATH = '/var/run/pangu_blockmaster_seg_iostats'  # segment stat table written by the blockmaster, or by cpp_code/gen_seg_iostats
+SEG_IOSTATS_PATHS = []  # tables of several blockmasters merged into one snapshot, overrides SEG_IOSTATS_PATH when set
+SAMPLER_INTERVAL_MS = 0  # poll the table on a native thread this often and merge its latest poll, 0 reads it on every merge
+SAMPLER_ALPHA = 0.3  # EWMA weight of the newest poll
+RECORD_DIR = ''  # record the table of every scheduling tick under this directory for utils/replay_log, '' disables
+RECORD_MAX_MB = 4096  # the oldest recorded chunks are deleted past this size
+LATENCY_TARGET = 'mean'  # cluster latency the token speed optimizer tunes against: mean, p50, p99 or p999
+# default ranking weights of the merges, see ScoringModel in cpp_code/read_and_merge.h
+SCORING_MODEL = {
+    'traffic_weight': 0.7,
+    'read_traffic_ratio': 0.3,
+    'urgent_traffic_weight': 0.4,
+    'urgent_std_weight': 0.4,
+    'instant_std_weight': 0.2,
+    'mix_traffic_weight': 0.5,
+    'mix_iops_weight': 0.1,
+    'mix_latency_weight': 0.2,
+    'mix_std_weight': -0.2,
+    'window': 'urgent',  # urgent, instant or longterm
+    'norm': 'none',  # none, or max to scale each feature by its largest value in the snapshot
+}
+# thresholds of the urgent vs longterm burst detector run every tick, see HotspotConfig in cpp_code/read_and_merge.h; None disables it
+HOTSPOT_CONFIG = None
+# HOTSPOT_CONFIG = {
+#     'z_threshold': 3.0,  # urgent traffic this many longterm stds above the longterm mean, 0 disables the test
+#     'ratio_threshold': 2.0,  # urgent traffic this many times the longterm mean, 0 disables the test
+#     'min_traffic': 1 * MB,  # segments with less urgent traffic are never flagged
+#     'min_bs_traffic': 64 * MB,  # same floor for a whole BS
+#     'top_k': 32,  # hottest segments and BSs reported per tick
+# }
 MB = 1024 * 1024
 MIN_THRESHOLD = 300 * MB
 MAX_THRESHOLD = 800 * MB
@@ -0,0 +1,51 @@
+# -*- encoding: utf-8 -*-
+# Feeds ticks recorded by SnapshotRecorder (RECORD_DIR in utils/config.py) back
+# through the merge and the move planner, one JSON line per tick, as fast as
+# they decode.
+#   python -m utils.replay_log --dir /var/log/omar/seg_iostats --start 1718000000 --end 1718003600
+
+import argparse
+import json
+import time
+from cpp_code.read_and_merge import SnapshotLog, plan_rw_segment_moves, set_merge_threads
+from utils.config import MB, MIN_THRESHOLD, MAX_W_SKEW, MAX_R_SKEW, MAX_BORROW_TOKENS, RANK_TOP_K, RW_SORT_FLAGS
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay recorded segment stat ticks through the merge and planner')
+    parser.add_argument('--dir', type=str, required=True, help='The directory SnapshotRecorder wrote')
+    parser.add_argument('--start', type=float, default=None, help='Unix time of the first tick to replay, default the oldest')
+    parser.add_argument('--end', type=float, default=None, help='Unix time of the last tick to replay, default the newest')
+    parser.add_argument('--ratio', type=float, default=0.1, help='Allowed deviation from the mean BS traffic')
+    parser.add_argument('--tokens', type=int, default=8, help='Remaining tokens given to every tick')
+    parser.add_argument('--threads', type=int, default=1, help='Threads used by the snapshot scans, 0 for one per core')
+    args = parser.parse_args()
+
+    set_merge_threads(args.threads)
+    log = SnapshotLog(args.dir)
+    first = 0
+    if args.start is not None:
+        # find gives the last tick at or before start, the replay begins at the first at or after it
+        start_us = int(args.start * 1e6)
+        first = log.find(start_us)
+        if first < 0 or log.timestamp(first) != start_us:
+            first += 1
+    last = log.tick_num - 1 if args.end is None else log.find(int(args.end * 1e6))
+    begin = time.perf_counter()
+    for tick in range(first, last + 1):
+        snap = log.snapshot(tick)
+        if snap is None:
+            continue
+        res = snap.merge_bs_rw_segment(*RW_SORT_FLAGS, top_k=RANK_TOP_K)
+        plan = plan_rw_segment_moves(res, w_max_ratio=1+args.ratio, w_min_ratio=1-args.ratio, r_max_ratio=1+args.ratio, r_min_ratio=1-args.ratio,
+                                     remain_tokens=args.tokens, min_threshold=MIN_THRESHOLD, min_segment_traffic=MB,
+                                     max_w_skew=MAX_W_SKEW, max_r_skew=MAX_R_SKEW, max_borrow_tokens=MAX_BORROW_TOKENS)
+        print(json.dumps({'tick': tick, 'time': log.timestamp(tick) / 1e6, 'records': snap.record_num, 'bs': snap.bs_num, 'moves': len(plan.moves),
+                          'w_max_skew': round(plan.w_max_skew, 4), 'r_max_skew': round(plan.r_max_skew, 4)}), flush=True)
+    elapsed = time.perf_counter() - begin
+    replayed = max(last + 1 - first, 0)
+    print(json.dumps({'replayed': replayed, 'seconds': round(elapsed, 3), 'ticks_per_second': round(replayed / elapsed, 1) if elapsed else 0.0}))
+
+
+if __name__ == '__main__':
+    main()
@@ -7,11 +7,10 @@ import time
 import json
 from enum import Enum
 from typing import Dict, List, Tuple
-import networkx as nx
-from tqdm import tqdm
 import re
 from concurrent.futures import as_completed
 import numpy as np
+from cpp_code.resonance import find_resonance
 
 # scheduling priority of segment
 class Priority(Enum):
@@ -176,108 +175,23 @@ def extract_resonate(user, w_vol_traffic: Dict, r_vol_traffic: Dict, check_len,
 def judge_vol_resonate(vol_traffic: Dict, check_len: int, user: str, type: str, corr_thresh, avg_thresh=0.02):
 
     assert type in ['w', 'r']
-    vol_traffic = {vol: traffic[1:check_len+1] for vol, traffic in vol_traffic.items() if np.mean(traffic[1:check_len+1]) > avg_thresh}
-    if len(vol_traffic) <= 1:
-        return [], [], [], [], [], []
-    res_matrix = pearson_correlation(list(vol_traffic.values()))
-    pos_list, neg_list = graph_method(res_matrix, corr_thresh)
+    volumes = list(vol_traffic.keys())
+    res = find_resonance(list(vol_traffic.values()), check_len, corr_thresh, avg_thresh)
+    pos_list, neg_list = res.pos, res.neg
     if len(pos_list) > 0:
         vol_num = sum(len(pos_l) for pos_l in pos_list)
         print(f'Find {len(pos_list)} pos {type}_reson pairs for ali_uid {user}, total {vol_num} vols!')
     if len(neg_list) > 0:
         vol_num = sum(len(neg_l) for neg_l in neg_list)
         print(f'Find {len(neg_list)} neg {type}_reson pairs for ali_uid {user}, total {vol_num} vols!')
-    pos_vol_list = trans_index_volume(pos_list, list(vol_traffic.keys()))
-    neg_vol_list = trans_index_volume(neg_list, list(vol_traffic.keys()))
-    avg_pos_traffic = compute_avg_traffic(vol_traffic, pos_vol_list, check_len)
-    avg_neg_traffic = compute_avg_traffic(vol_traffic, neg_vol_list, check_len)
-    avg_pos_traffic, pos_vol_list, pos_list = sort_by_avg(avg_pos_traffic, pos_vol_list, pos_list)
-    avg_neg_traffic, neg_vol_list, neg_list = sort_by_avg(avg_neg_traffic, neg_vol_list, neg_list)
-    pos_matrix = extract_matrix(res_matrix, pos_list)
-    neg_matrix = extract_matrix(res_matrix, neg_list)
-    return pos_vol_list, neg_vol_list, avg_pos_traffic, avg_neg_traffic, pos_matrix, neg_matrix
+    pos_vol_list = trans_index_volume(pos_list, volumes)
+    neg_vol_list = trans_index_volume(neg_list, volumes)
+    return pos_vol_list, neg_vol_list, res.pos_avg, res.neg_avg, res.pos_matrix, res.neg_matrix
 
 def trans_index_volume(resonate_list, volumes):
     volume_list = [[volumes[i] for i in group] for group in resonate_list]
     return volume_list
 
-def compute_avg_traffic(vol_traffic, reson_list, check_len):
-    all_avg = []
-    for group in reson_list:
-        avg = [np.mean(vol_traffic[vol][1:check_len+1]) for vol in group]
-        all_avg.append(avg)
-    return all_avg
-
-def sort_by_avg(avg_traffic, vol_list, index_list):
-
-    if len(avg_traffic) == 0:
-        return [], [], []
-    sorted_avg_traffic, sorted_vol_list, sorted_index_list = [], [], []
-    for i in range(len(avg_traffic)):
-        zipped_lists = zip(avg_traffic[i], vol_list[i], index_list[i])
-        sorted_lists = sorted(zipped_lists, key=lambda x: x[0], reverse=True)
-        sorted_avg, sorted_vol, sorted_index = zip(*sorted_lists)
-        sorted_avg_traffic.append(list(sorted_avg))
-        sorted_vol_list.append(list(sorted_vol))
-        sorted_index_list.append(list(sorted_index))
-    return sorted_avg_traffic, sorted_vol_list, sorted_index_list
-
-def extract_matrix(matrix, index_list):
-    all_mat = []
-    for index in index_list:
-        trunc_mat = trunc_matrix(matrix, index)
-        all_mat.append(trunc_mat)
-    return all_mat
-
-def trunc_matrix(matrix, index):
-    n = len(index)
-    trunc_mat = np.zeros((n, n))
-    for i in range(n):
-        for j in range(i, n):
-            trunc_mat[i][j] = matrix[index[i], index[j]]
-            trunc_mat[j][i] = matrix[index[j], index[i]]
-    return trunc_mat
-
-
-def pearson_correlation(time_series):
-    res_matrix = np.corrcoef(time_series, dtype='float32')
-    return res_matrix
-
-
-def graph_method(matrix, pos_threshold=0.5) -> Tuple[List[List[int]], List[List[int]]]:
-
-    neg_threhold = -pos_threshold
-    pos_graph = nx.Graph()
-    neg_graph = nx.Graph()
-    n = matrix.shape[0]
-    indices = list(range(n))
-    pos_graph.add_nodes_from(indices)
-    neg_graph.add_nodes_from(indices)
-
-    for i in tqdm(range(n), desc='Building graph'):
-        row = matrix[i, i+1:]
-        mask1 = row > pos_threshold
-        mask2 = row < neg_threhold
-        idx1 = np.where(mask1)[0] + i + 1
-        idx2 = np.where(mask2)[0] + i + 1
-        pos_graph.add_edges_from((i, j) for j in idx1)
-        neg_graph.add_edges_from((i, j) for j in idx2)
-    pos_reson = max_clique(pos_graph)
-    neg_reson = max_clique(neg_graph)
-    return pos_reson, neg_reson
-                
-def max_clique(graph) -> List[List[int]]:
-
-    connected_components = list(nx.connected_components(graph))
-    reson_group = []
-    for component in connected_components:
-        if len(component) <= 1:
-            continue
-        subgraph = graph.subgraph(component)
-        max_clique = nx.max_weight_clique(subgraph, weight=None)  # type: ignore
-        reson_group.append(max_clique[0])
-    return reson_group
-
 def avg_similar(matrix, cliques):
 
     sum_similar = []